@@ -0,0 +1,392 @@
+// bench.cpp
+// 代表的なビューを サイズ x 精度 x スレッド数 x 色付けモード で描画し,
+// ステージごとの時間 (iterate, histogram, color, encode) と pixels/s, iterations/s, ケースごとの peak RSS を
+// JSON で出力する. --backends で数値型 (Backend) ごとの比較もできる.
+// 複数ソケットのホストでは --pin, --numa でスレッド配置を変え, ソケットごとの処理量 (sockets) を比べる.
+//
+// 例: ./bench --views full,seahorse --sizes 64,128 --threads 1,4 --out bench.json
+
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "Mandelbrot.hpp"
+#include "util.hpp"
+
+
+// 計測対象のビュー. 深いビューは double を経由しないよう文字列で持つ
+struct BenchView {
+    std::string name;
+    std::string re, im, width;
+    size_t mandel_count_max;
+};
+
+// c = i は Misiurewicz 点 (集合の境界上) なので, どの深さでも構造が残る
+const std::vector<BenchView> BENCH_VIEWS = {
+    {"full",        "-0.5",    "0.0",    "3.0",    300},
+    {"seahorse",    "-0.7453", "0.1127", "6.5e-3", 1000},
+    {"deep_1e-15",  "0.0",     "1.0",    "1e-15",  2000},
+    {"deep_1e-30",  "0.0",     "1.0",    "1e-30",  3000},
+    {"deep_1e-100", "0.0",     "1.0",    "1e-100", 5000},
+};
+
+// 1ケース分の計測結果 (時間は repeat 回の中央値, 単位は秒)
+struct BenchResult {
+    std::string view;
+    std::string backend;  // 実際に使われた数値型 (auto は解決後の名前)
+    size_t size;
+    size_t precision;
+    int threads;
+    bool eq_hist;
+    size_t mandel_count_max;
+    size_t iterations;
+    double iterate_s, histogram_s, color_s, encode_s, total_s;
+    long peak_rss_kb;
+    bool rss_per_case;  // peak_rss_kb がこのケースの間のピークか (false ならプロセス全体のピーク)
+    std::string pinning;
+    bool numa;
+    std::vector<SocketStats> sockets;  // 最後の repeat の makeCountVector の集計
+};
+
+
+// ピーク RSS を今の RSS に戻す. Linux では /proc/self/clear_refs に 5 を書くと VmHWM が戻る.
+// 戻せなければ false (peakRssKb はプロセス全体のピークになる)
+bool resetPeakRss() {
+    #ifdef __linux__
+        std::ofstream ofs("/proc/self/clear_refs");
+        ofs << "5";
+        ofs.flush();
+        return static_cast<bool>(ofs);
+    #else
+        return false;
+    #endif
+}
+
+// 最後の resetPeakRss から (戻せなければプロセスの開始から) のピーク RSS [KB]
+long peakRssKb() {
+    #ifdef __linux__
+        std::ifstream ifs("/proc/self/status");
+        std::string line;
+        while (std::getline(ifs, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) return std::stol(line.substr(6));
+        }
+    #endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+        return usage.ru_maxrss / 1024;  // macOS は bytes
+    #else
+        return usage.ru_maxrss;
+    #endif
+}
+
+double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    size_t m = v.size() / 2;
+    return (v.size() % 2) ? v[m] : (v[m - 1] + v[m]) / 2.0;
+}
+
+// 正の整数. 読めなければ std::invalid_argument
+size_t parseSize(const std::string& s) {
+    size_t pos = 0;
+    unsigned long n = 0;
+    if (!s.empty() && std::isdigit(static_cast<unsigned char>(s[0]))) {
+        try {
+            n = std::stoul(s, &pos);
+        } catch (const std::logic_error&) {
+            pos = 0;
+        }
+    }
+    if (pos == 0 || pos != s.size() || n == 0) throw std::invalid_argument("Invalid number: " + s);
+    return n;
+}
+
+std::vector<size_t> splitSizeList(const std::string& s) {
+    std::vector<size_t> values;
+    for (const std::string& item : splitString(s, ',')) values.push_back(parseSize(item));
+    return values;
+}
+
+// ビューを size px で描くのに必要な 10 進の桁数 (画素間隔 + 余裕 10 桁)
+size_t requiredPrecision(const BenchView& view, size_t size) {
+    double pixel_digits = std::log10(static_cast<double>(size)) - std::log10(std::stod(view.width));
+    return std::max<size_t>(20, static_cast<size_t>(std::ceil(pixel_digits)) + 10);
+}
+
+BenchResult runCase(
+    const BenchView& view, size_t size, size_t precision, Backend backend, int threads, bool eq_hist,
+    Pinning pinning, bool numa, const Palette& palette, size_t repeat, const std::string& png_path
+) {
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::time_point a, clock::time_point b) {
+        return std::chrono::duration<double>(b - a).count();
+    };
+
+    omp_set_num_threads(threads);
+
+    // 文字列 -> Float の変換は精度を明示して行う
+    Mandelbrot m;
+    Float re = makeFloat(view.re, precision), im = makeFloat(view.im, precision), width = makeFloat(view.width, precision);
+    m.setAllParams(precision, size, size, re, im, width, width, view.mandel_count_max, palette);
+    m.setBackend(backend);
+    m.setPinning(pinning);
+    m.setNumaFirstTouch(numa);
+
+    BenchResult r{};
+    r.view = view.name;
+    r.backend = Mandelbrot::backendName(m.resolveBackend());
+    r.size = size;
+    r.precision = precision;
+    r.threads = threads;
+    r.eq_hist = eq_hist;
+    r.mandel_count_max = view.mandel_count_max;
+    r.pinning = Topology::pinningName(pinning);
+    r.numa = numa;
+
+    r.rss_per_case = resetPeakRss();
+    std::vector<double> t_iter, t_hist, t_color, t_enc, t_total;
+    for (size_t k = 0; k < repeat; k++) {
+        auto t0 = clock::now();
+        FrameVector<size_t> count_vec = m.makeCountVector();
+        auto t1 = clock::now();
+        std::vector<double> brightness_table;
+        if (eq_hist) brightness_table = m.makeBrightnessTable(count_vec);
+        auto t2 = clock::now();
+        FrameVector<Color> color_vec = m.makeColorVector(count_vec, brightness_table, eq_hist);
+        auto t3 = clock::now();
+        if (!savePNG(png_path, color_vec, size, size)) {
+            std::cerr << "Failed to save PNG: " << png_path << std::endl;
+        }
+        auto t4 = clock::now();
+
+        t_iter.push_back(seconds(t0, t1));
+        t_hist.push_back(seconds(t1, t2));
+        t_color.push_back(seconds(t2, t3));
+        t_enc.push_back(seconds(t3, t4));
+        t_total.push_back(seconds(t0, t4));
+
+        r.iterations = 0;
+        for (size_t n : count_vec) r.iterations += n;
+        r.sockets = m.getSocketStats();
+    }
+
+    r.iterate_s = median(t_iter);
+    r.histogram_s = median(t_hist);
+    r.color_s = median(t_color);
+    r.encode_s = median(t_enc);
+    r.total_s = median(t_total);
+    r.peak_rss_kb = peakRssKb();
+    return r;
+}
+
+void writeJson(std::ostream& os, const std::vector<BenchResult>& results, size_t repeat) {
+    std::time_t now = std::time(nullptr);
+    char timestamp[32];
+    std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    os << std::setprecision(9);
+    os << "{\n";
+    os << "  \"schema\": 1,\n";
+    os << "  \"timestamp\": \"" << timestamp << "\",\n";
+    os << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    os << "  \"num_procs\": " << omp_get_num_procs() << ",\n";
+    os << "  \"num_sockets\": " << Topology::host().socketCount() << ",\n";
+    os << "  \"repeat\": " << repeat << ",\n";
+    os << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        double pixels = static_cast<double>(r.size * r.size);
+        os << "    {"
+           << "\"view\": \"" << r.view << "\", "
+           << "\"width_px\": " << r.size << ", "
+           << "\"height_px\": " << r.size << ", "
+           << "\"backend\": \"" << r.backend << "\", "
+           << "\"precision\": " << r.precision << ", "
+           << "\"threads\": " << r.threads << ", "
+           << "\"pin\": \"" << r.pinning << "\", "
+           << "\"numa\": " << (r.numa ? "true" : "false") << ", "
+           << "\"eq_hist\": " << (r.eq_hist ? "true" : "false") << ", "
+           << "\"mandel_count_max\": " << r.mandel_count_max << ", "
+           << "\"iterations\": " << r.iterations << ", "
+           << "\"iterate_s\": " << r.iterate_s << ", "
+           << "\"histogram_s\": " << r.histogram_s << ", "
+           << "\"color_s\": " << r.color_s << ", "
+           << "\"encode_s\": " << r.encode_s << ", "
+           << "\"total_s\": " << r.total_s << ", "
+           << "\"pixels_per_s\": " << pixels / r.total_s << ", "
+           << "\"iterations_per_s\": " << r.iterations / r.iterate_s << ", "
+           << "\"peak_rss_kb\": " << r.peak_rss_kb << ", "
+           << "\"peak_rss_scope\": \"" << (r.rss_per_case ? "case" : "process") << "\", "
+           << "\"sockets\": [";
+        // ソケットごとの処理量. 時間は全体の wall 時間で割る (ソケットは同時に動くため)
+        for (size_t k = 0; k < r.sockets.size(); k++) {
+            const SocketStats& s = r.sockets[k];
+            os << (k ? ", " : "")
+               << "{\"socket\": " << s.socket
+               << ", \"threads\": " << s.threads
+               << ", \"tiles\": " << s.tiles
+               << ", \"pixels_per_s\": " << (s.wall_s > 0 ? s.pixels / s.wall_s : 0.0)
+               << ", \"iterations_per_s\": " << (s.wall_s > 0 ? s.iterations / s.wall_s : 0.0)
+               << ", \"busy_s\": " << s.busy_s;
+            // double_compact のレーンの使用率
+            if (s.lane_slots > 0) os << ", \"lane_utilization\": " << static_cast<double>(s.lane_active) / s.lane_slots;
+            os << "}";
+        }
+        os << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n";
+    os << "}\n";
+}
+
+void usage() {
+    std::cerr
+        << "usage: bench [options]\n"
+        << "  --views   full,seahorse,deep_1e-15,deep_1e-30,deep_1e-100 (default: all)\n"
+        << "  --sizes   64,128            画像の一辺 [px]\n"
+        << "  --precs   auto | 20,40,...  10進の桁数. auto はビューと画像サイズから決める\n"
+        << "  --backends auto             auto,double,long_double,mpfr,double_compact\n"
+        << "  --threads 1,<max>           OpenMP スレッド数\n"
+        << "  --pin     none              none,compact,scatter (スレッドの CPU への固定)\n"
+        << "  --numa    off               off,on (ソケットごとの帯で first touch と描画を行う)\n"
+        << "  --modes   eq,linear         ヒストグラム平坦化の有無\n"
+        << "  --repeat  1                 中央値を取る回数\n"
+        << "  --out     FILE              JSON の出力先 (default: stdout)\n"
+        << "  --png-dir DIR               encode ステージの出力先 (default: 一時ディレクトリ)\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> view_names;
+    for (const BenchView& v : BENCH_VIEWS) view_names.push_back(v.name);
+    std::vector<size_t> sizes = {64, 128};
+    std::vector<size_t> precs;  // 空なら auto
+    std::vector<int> threads = {1};
+    if (omp_get_max_threads() > 1) threads.push_back(omp_get_max_threads());
+    std::vector<std::string> modes = {"eq"};
+    std::vector<std::string> backends = {"auto"};
+    std::vector<std::string> pins = {"none"};
+    std::vector<std::string> numas = {"off"};
+    size_t repeat = 1;
+    std::string out_file;
+    std::string png_dir = std::filesystem::temp_directory_path().string();
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--views") view_names = splitString(value, ',');
+            else if (arg == "--sizes") sizes = splitSizeList(value);
+            else if (arg == "--precs") precs = (value == "auto") ? std::vector<size_t>{} : splitSizeList(value);
+            else if (arg == "--threads") {
+                threads.clear();
+                for (size_t t : splitSizeList(value)) threads.push_back(static_cast<int>(t));
+            }
+            else if (arg == "--modes") modes = splitString(value, ',');
+            else if (arg == "--backends") backends = splitString(value, ',');
+            else if (arg == "--pin") pins = splitString(value, ',');
+            else if (arg == "--numa") numas = splitString(value, ',');
+            else if (arg == "--repeat") repeat = parseSize(value);
+            else if (arg == "--out") out_file = value;
+            else if (arg == "--png-dir") png_dir = value;
+            else {
+                usage();
+                return 1;
+            }
+        } catch (const std::invalid_argument& e) {
+            std::cerr << arg << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    Palette palette = Palette::makeGradationHue(256, 0, 360, 1.0, 0.9);
+    std::string png_path = (std::filesystem::path(png_dir) / "mandel_bench.png").string();
+
+    for (const std::string& mode : modes) {
+        if (mode != "eq" && mode != "linear") {
+            std::cerr << "Unknown mode: " << mode << std::endl;
+            return 1;
+        }
+    }
+    std::vector<Backend> backend_list;
+    for (const std::string& name : backends) {
+        try {
+            backend_list.push_back(Mandelbrot::backendFromName(name));
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Pinning> pin_list;
+    for (const std::string& name : pins) {
+        try {
+            pin_list.push_back(Topology::pinningFromName(name));
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    for (const std::string& numa : numas) {
+        if (numa != "on" && numa != "off") {
+            std::cerr << "Unknown numa mode: " << numa << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const std::string& name : view_names) {
+        auto it = std::find_if(BENCH_VIEWS.begin(), BENCH_VIEWS.end(),
+                               [&](const BenchView& v) { return v.name == name; });
+        if (it == BENCH_VIEWS.end()) {
+            std::cerr << "Unknown view: " << name << std::endl;
+            return 1;
+        }
+        for (size_t size : sizes) {
+            std::vector<size_t> case_precs = precs.empty() ? std::vector<size_t>{requiredPrecision(*it, size)} : precs;
+            for (size_t prec : case_precs) {
+                for (Backend backend : backend_list) {
+                    for (int t : threads) {
+                        for (Pinning pin : pin_list) {
+                            for (const std::string& numa : numas) {
+                                for (const std::string& mode : modes) {
+                                    std::cerr << "bench: " << name << " " << size << "px prec=" << prec
+                                              << " backend=" << Mandelbrot::backendName(backend)
+                                              << " threads=" << t << " pin=" << Topology::pinningName(pin)
+                                              << " numa=" << numa << " " << mode << std::endl;
+                                    results.push_back(runCase(*it, size, prec, backend, t, mode == "eq",
+                                                              pin, numa == "on", palette, repeat, png_path));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (out_file.empty()) {
+        writeJson(std::cout, results, repeat);
+    } else {
+        std::ofstream ofs(out_file);
+        if (!ofs) {
+            std::cerr << "Failed to open: " << out_file << std::endl;
+            return 1;
+        }
+        writeJson(ofs, results, repeat);
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef ASYNCRENDER_HPP
+#define ASYNCRENDER_HPP
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Mandelbrot.hpp"
+
+// makeCountTiles を別スレッドで実行し, 完了したタイルから順に受け取れるようにする.
+// 画像全体が終わるのを待たずに, エンコーダやビューア, ネットワークの送信がタイル単位で始められる.
+//
+// - on_tile (TileSink) は描画中のスレッドからタイルごとに呼ばれる (同時に複数のスレッドから呼ばれる)
+// - queue_tiles なら, 完了したタイルの写しを完了キューに入れる. tryPop で完了順に取り出す.
+//   キューはタイル数の枠を先に確保し, 書き込むスレッドは枠の番号を fetch_add で取るだけなのでロックを使わない.
+//   取り出すのは1つのスレッドだけにすること
+// - cancel で残りのタイルを飛ばす. getFuture / wait の結果は全てのタイルを計算したら true
+//
+// エンジンは構築時にコピーするので, 描画中に元のエンジンの設定を変えてもよい.
+// threads > 0 なら描画に使う OpenMP のスレッド数 (0 なら既定値)
+class AsyncRender {
+    public:
+    struct Tile {
+        size_t x0 = 0, y0 = 0, width = 0, height = 0;  // 領域の左上からの画素座標
+        std::vector<size_t> counts;  // width * height の反復回数 (ラスタースキャン順)
+    };
+
+    explicit AsyncRender(const Mandelbrot& engine, TileSink on_tile = nullptr, bool queue_tiles = true, int threads = 0);
+
+    // 描画中なら中止して終わるのを待つ
+    ~AsyncRender();
+
+    AsyncRender(const AsyncRender&) = delete;
+    AsyncRender& operator=(const AsyncRender&) = delete;
+
+    // 完了キューの先頭のタイルを tile に移す. 次のタイルがまだ完了していなければ false
+    bool tryPop(Tile& tile);
+
+    void cancel();
+    bool isCancelled() const;
+
+    // 完了したタイルの数 / 全体のタイルの数
+    size_t tilesDone() const;
+    size_t tileCount() const;
+    double progress() const;
+
+    // 描画が終わったら (中止を含む) true
+    bool finished() const;
+
+    // 描画が終わるのを待つ. 全てのタイルを計算したら true
+    bool wait();
+
+    std::shared_future<bool> getFuture() const;
+
+    // 描画に使ったエンジンのコピー. 集計 (getSocketStats) は描画が終わってから読むこと
+    const Mandelbrot& getEngine() const;
+
+
+    private:
+    // 完了キューの枠. tile を書いてから ready を立てる
+    struct Slot {
+        Tile tile;
+        std::atomic<bool> ready{false};
+    };
+
+    Mandelbrot engine;
+    TileSink on_tile;
+    bool queue_tiles;
+    int threads;
+    size_t tile_count;
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<size_t> done{0};
+    std::atomic<bool> running{true};
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> tail{0};  // 次に書き込む枠
+    size_t head = 0;  // 次に取り出す枠 (取り出すスレッドだけが使う)
+
+    std::promise<bool> promise;
+    std::shared_future<bool> future;
+    std::thread thread;
+
+    void run();
+};
+
+#endif  // ASYNCRENDER_HPP
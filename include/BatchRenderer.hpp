@@ -0,0 +1,63 @@
+#ifndef BATCHRENDERER_HPP
+#define BATCHRENDERER_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "Mandelbrot.hpp"
+#include "RenderJob.hpp"
+
+// 1つのプロセスで多数の RenderJob を描画する.
+// Mandelbrot のインスタンス, 反復回数・色のバッファ, パレットをジョブ間で使い回し,
+// OpenMP のスレッドプールもプロセス内で再利用される.
+class BatchRenderer {
+    public:
+    BatchRenderer() = default;
+
+    // 精度・パレット・画像サイズ・上限回数・数値型の順に安定ソートする.
+    // 同じ精度・パレット・サイズのジョブが続くので, 設定の変更とバッファの確保が減る
+    static void sortJobs(std::vector<RenderJob>& jobs);
+
+    // jobs を並べ替えて順に描画し, 1ジョブ1行の結果を log に出力する. 失敗したジョブの数を返す
+    size_t run(std::vector<RenderJob> jobs, std::ostream& log);
+
+    // 1ジョブを描画して job.output に保存する. 保存に失敗したら false
+    bool render(const RenderJob& job);
+
+    // 計算済みの counts (job と同じビュー. FrameVector<size_t> か IterationField) に job のパレットで色を付けて
+    // job.output に保存する. job.apply(getEngine()) の後に呼ぶこと.
+    // job.cycle_frames > 0 なら, パレットを循環させた cycle_frames 枚を出力する (colorizeCycle)
+    bool colorize(const RenderJob& job, const IterationView& counts);
+
+    // 上と同じ. job.distance のときに makeDistanceVector の結果 dist で色を付ける
+    bool colorize(const RenderJob& job, const IterationView& counts, const FrameVector<float>& dist);
+
+    Mandelbrot& getEngine() { return this->engine; }
+
+
+    private:
+    Mandelbrot engine;
+    std::map<std::string, Palette> palettes;  // spec -> パレット
+    std::string current_palette;  // engine に設定済みのパレットの spec
+
+    IterationField field;  // 距離推定でないジョブの反復回数
+    FrameVector<size_t> count_vec;  // 距離推定のジョブの反復回数
+    FrameVector<float> dist_vec;
+    std::vector<double> brightness_table;
+    FrameVector<Color> color_vec;
+    FrameVector<Color> cycle_vec;  // colorizeCycle で保存中のフレーム
+
+    // パレット循環のアニメーション. 反復回数 -> パレットの番号の表を1回だけ作り, フレームごとに
+    // 回転・補間したパレットで表引きする (反復計算もヒストグラムもやり直さない).
+    // フレーム k の色付けと, フレーム k - 1 の保存を別スレッドで重ねる
+    bool colorizeCycle(const RenderJob& job, const IterationView& counts);
+
+    // spec のパレット. 初めての spec なら作ってキャッシュする
+    const Palette& paletteFor(const std::string& spec);
+
+    // job.palette を engine に設定する (前のジョブと同じなら何もしない)
+    void applyPalette(const RenderJob& job);
+};
+
+#endif  // BATCHRENDERER_HPP
@@ -0,0 +1,102 @@
+#ifndef BUDDHABROT_HPP
+#define BUDDHABROT_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Color.hpp"
+#include "FrameBuffer.hpp"
+#include "Palette.hpp"
+
+// Buddhabrot (軌道の密度) の描画. c を多数サンプルし, 発散した c の軌道 z_1, z_2, ... が通った画素を数える.
+//
+// 表示範囲を通る軌道は c 全体のごく一部なので, 一様なサンプルはほとんどが無駄になる.
+// ここでは各スレッドが Metropolis-Hastings の連鎖を持ち, c を「範囲内を通った軌道の点の数」f(c) に比例して
+// サンプルする. 提案は
+//   - mutation_probability の確率で今の c の近く (半径は表示範囲の幅の 1e-4 ~ 1e-1 倍, 対数一様)
+//   - それ以外は [-2, 2] x [-2, 2] から R2 の低食い違い列で独立に選ぶ (連鎖が1か所に留まらない)
+// で, どちらも対称なので受理確率は min(1, f(c') / f(c)). 各ステップで今の c の軌道を重み 1 / f(c) で加えるので,
+// 画像は一様サンプルの密度に比例する (定数倍は色付けで正規化する).
+//
+// 軌道は double で計算する (画素より細かい精度は要らない). 深い拡大は対象外.
+//
+// 密度はスレッドごとのバッファ (float) に足し, 1ラウンドごとに木の形に2つずつ足し合わせて全体 (double) に加える.
+// 共有のバッファへの atomic な加算はしない. ラウンドごとに checkpoint に途中の密度を保存でき,
+// 同じ設定なら続きから再開する
+class Buddhabrot {
+    public:
+    struct Options {
+        double re_target = -0.5, im_target = 0.0;
+        double width_target = 3.0, height_target = 0.0;  // height_target が 0 なら width_target * height_px / width_px
+        size_t width_px = 512, height_px = 512;
+        size_t mandel_count_max = 5000;  // これ以上反復して発散しない c は数えない
+        size_t mandel_count_min = 20;  // これより早く発散した c の軌道は数えない
+        size_t samples = 10000000;  // 軌道を計算する回数 (連鎖の全ステップ)
+        size_t round_samples = 1000000;  // 1ラウンドのステップ数. チェックポイントの間隔
+        double mutation_probability = 0.8;
+        uint64_t seed = 1;
+        std::string checkpoint;  // 空ならチェックポイントを使わない
+
+        // key に value を設定する (キー名はメンバ名と同じ). 不明なキーや不正な値では std::invalid_argument
+        void set(const std::string& key, const std::string& value);
+
+        // 描画の結果に関わる設定の "key=value" の1行 (チェックポイントで同じ描画か確かめる)
+        std::string toLine() const;
+    };
+
+    // 1回の render の集計
+    struct Stats {
+        size_t samples = 0;  // 計算した軌道
+        size_t contributing = 0;  // 表示範囲を通った軌道
+        size_t accepted = 0;  // 受理した提案
+        double seconds = 0.0;
+    };
+
+    explicit Buddhabrot(const Options& options);
+
+    // 残りのサンプルを描画する (チェックポイントがあれば続きから). 進み具合を log に出力する.
+    // チェックポイントの保存に失敗したら false
+    bool render(std::ostream& log);
+
+    // 密度を palette で色付けする. 密度の上位 0.1% を上限として正規化し, gamma 乗してパレットの番号にする
+    void makeColorVector(const Palette& palette, double gamma, FrameVector<Color>& color_vec) const;
+
+    const FrameVector<double>& getDensity() const { return this->density; }
+    size_t getSamplesDone() const { return this->samples_done; }
+    const Stats& getStats() const { return this->stats; }
+
+
+    private:
+    Options options;
+    double re_min, im_max;  // 画像の左上
+    double px_re, px_im;  // 1画素の幅と高さ
+    FrameVector<double> density;
+    size_t samples_done = 0;
+    Stats stats;
+
+    // スレッドごとの連鎖の状態
+    struct Chain {
+        std::mt19937_64 rng;
+        // 独立な提案に使う R2 列の今の点. 小数部を 2^-64 単位の固定小数点で持ち, 足し算の桁あふれで mod 1 をとる
+        uint64_t r2_x = 0, r2_y = 0;
+        double c_re = 0.0, c_im = 0.0;
+        std::vector<uint32_t> hits, proposal_hits;  // 今の c と提案の c の軌道が通った画素
+        FrameVector<float> acc;  // このラウンドの密度
+    };
+
+    // c の軌道が通った表示範囲内の画素を hits に入れる. 発散しないか早く発散したら空
+    void orbit(double c_re, double c_im, std::vector<uint32_t>& hits) const;
+
+    // chain の連鎖を steps ステップ進め, 密度を chain.acc に加える
+    void runChain(Chain& chain, size_t steps, Stats& stats) const;
+
+    // 各スレッドの acc を木の形に足し合わせて density に加える
+    void reduce(std::vector<Chain>& chains);
+
+    bool saveCheckpoint() const;
+    bool loadCheckpoint();
+};
+
+#endif  // BUDDHABROT_HPP
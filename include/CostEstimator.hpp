@@ -0,0 +1,74 @@
+#ifndef COSTESTIMATOR_HPP
+#define COSTESTIMATOR_HPP
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "Mandelbrot.hpp"
+
+// 描画の前に, ビューを小さく (既定 32 x 32) 試し描き (probe) して, 本番の解像度での反復回数の合計・集合内の割合・
+// 時間を見積もる. バッチや分散描画でコアを割り当てる前に重さを知るためのもの.
+//
+// probe の画素 (i, j) は本番の画素 [i W / w, (i + 1) W / w) x [j H / h, (j + 1) H / h) の代表とみなす
+// (Mandelbrot の座標は画素の左上なので, probe の画素はこの矩形の左上の点). 矩形ごとの反復回数の予測
+// (コストマップ) から任意の矩形の重さを求められるので, 画像の分割に使える.
+//
+// 時間は 1 スレッドの反復の速さ (Calibration) から求める. 速さは bench の JSON (--out) で校正できる.
+// 反復の速さは画素ごとの手間を含めた平均 (bench の iterations / iterate_s と同じ定義)
+class CostEstimator {
+    public:
+    // 数値型ごとの 1 スレッドの反復の速さ [回/s]. キーは Mandelbrot::backendName.
+    // mpfr は語数 (64 bit) + 2 に反比例するとみなし, "mpfr" には 速さ x (語数 + 2) を持つ
+    struct Calibration {
+        std::map<std::string, double> rates = {
+            {"double", 2.2e8},
+            {"double_compact", 3.0e8},
+            {"long_double", 1.6e8},
+            {"mpfr", 3.6e6}
+        };
+
+        // precision 桁の backend の速さ
+        double rate(Backend backend, size_t precision) const;
+    };
+
+    struct Estimate {
+        std::string backend;  // 本番で使う数値型
+        size_t precision = 0;
+        int threads = 1;
+        size_t probe_width = 0, probe_height = 0;
+        double probe_seconds = 0.0;  // 試し描きにかかった時間
+
+        uint64_t iterations = 0;  // 領域の反復回数の合計の予測
+        uint64_t pixels = 0;
+        double interior_fraction = 0.0;  // 集合内の画素の割合
+        double seconds = 0.0;  // threads スレッドでの反復の時間の予測
+
+        // コストマップ: probe の画素ごとの, 本番の画素での反復回数の予測 (ラスタースキャン順, probe_width x probe_height).
+        // 画像全体について持つ (領域を指定したときも)
+        size_t width_px = 0, height_px = 0;
+        std::vector<double> cell_cost;
+
+        // 本番の画素の矩形 [x0, x1) x [y0, y1) の反復回数の予測. セルに一部だけ重なる分は面積で按分する
+        double costOfRect(size_t x0, size_t y0, size_t x1, size_t y1) const;
+    };
+
+    CostEstimator();  // 既定の Calibration
+    explicit CostEstimator(const Calibration& calibration);
+
+    // bench の JSON の results から数値型ごとの速さ (iterations / (iterate_s * threads) の中央値) を求める.
+    // 結果のない数値型は既定値のまま. 読めなければ std::invalid_argument
+    static Calibration calibrate(std::istream& bench_json);
+    static Calibration calibrateFile(const std::string& filename);
+
+    // engine のビューを probe_px x (probe_px * 高さ / 幅) で試し描きして見積もる. 数値型は本番と同じものを使う
+    Estimate estimate(const Mandelbrot& engine, int threads, size_t probe_px = 32) const;
+
+    const Calibration& getCalibration() const;
+
+
+    private:
+    Calibration calibration;
+};
+
+#endif  // COSTESTIMATOR_HPP
@@ -0,0 +1,45 @@
+#ifndef COUNTCACHE_HPP
+#define COUNTCACHE_HPP
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "IterationField.hpp"
+#include "RenderJob.hpp"
+
+// 最近描画した makeIterationField の結果を保持する LRU キャッシュ.
+// IterationField で持つので, 1画素あたり 2 byte (mandel_count_max > 65536 なら 4 byte) + 1 bit.
+// 色付け (palette, eq_hist) と出力先だけが違う要求は, 反復計算をせずにここから色を付け直せる.
+// スレッドセーフではない. 使う側で排他すること
+class CountCache {
+    public:
+    using CountField = std::shared_ptr<const IterationField>;
+
+    explicit CountCache(size_t capacity = 32) : capacity(capacity) {}
+
+    // 反復回数を決めるパラメタだけからなるキー (palette, eq_hist, fused, cycle_*, output は含まない)
+    static std::string keyOf(const RenderJob& job);
+
+    // key の結果. なければ nullptr. 見つかったものは最も新しい扱いになる
+    CountField find(const std::string& key);
+
+    // key の結果を登録する. capacity を超えたら最も古いものを捨てる
+    void insert(const std::string& key, CountField counts);
+
+    size_t size() const { return this->entries.size(); }
+    size_t getHits() const { return this->hits; }
+    size_t getMisses() const { return this->misses; }
+
+
+    private:
+    using Entry = std::pair<std::string, CountField>;
+
+    size_t capacity;
+    std::list<Entry> entries;  // 先頭が最も新しい
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t hits = 0, misses = 0;
+};
+
+#endif  // COUNTCACHE_HPP
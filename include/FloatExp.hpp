@@ -0,0 +1,204 @@
+#ifndef FLOATEXP_HPP
+#define FLOATEXP_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <boost/multiprecision/mpfr.hpp>
+
+// double の仮数部 (53 bit) と 64 bit の指数を持つ実数. 値は mantissa * 2^exponent.
+// double は 1e-308 より小さい値がアンダーフローするが, 仮数部の精度だけが要る値 (深い拡大での
+// 画素間隔や, 基準点からの差分) なら mpfr の数百 bit の代わりにこれで足りる.
+//
+// 正規化 (|mantissa| を [0.5, 1) に戻す) は遅延して行う. 乗除算は仮数部どうしの演算と指数の加減算だけで,
+// 仮数部の大きさが 2^±256 を超えたときだけ frexp で正規化する. 加減算は桁をそろえるので毎回正規化する.
+// 精度は double と同じなので, |c| ~ 1 の画素の座標そのものを持つのには使えない (差分を持つ側で使う)
+class FloatExp {
+    public:
+    FloatExp() = default;
+    FloatExp(double x) : mantissa(x), exponent(0) { this->normalize(); }
+    FloatExp(double mantissa, int64_t exponent) : mantissa(mantissa), exponent(exponent) { this->normalize(); }
+
+    // mpfr の値を仮数部 53 bit に丸める (指数は切り詰めない).
+    // types.hpp の Float と同じ型だが, Mandelbrot_proto.hpp で Float を FloatExp にできるよう types.hpp は読まない
+    explicit FloatExp(const boost::multiprecision::mpfr_float& x) {
+        long e = 0;
+        this->mantissa = mpfr_get_d_2exp(&e, x.backend().data(), MPFR_RNDN);
+        this->exponent = e;
+    }
+
+    double getMantissa() const { return this->mantissa; }
+    int64_t getExponent() const { return this->exponent; }
+
+    // double に戻す. 範囲外は 0 か ±inf
+    double toDouble() const {
+        if (this->exponent > std::numeric_limits<int>::max()) return this->mantissa * std::numeric_limits<double>::infinity();
+        if (this->exponent < std::numeric_limits<int>::min()) return this->mantissa * 0.0;
+        return std::ldexp(this->mantissa, static_cast<int>(this->exponent));
+    }
+    explicit operator double() const { return this->toDouble(); }
+    // 0 方向に切り捨てた整数 (反復回数との比較用). 範囲外の値は未定義
+    explicit operator int() const { return static_cast<int>(this->toDouble()); }
+
+    // 2進の指数 (0 なら 0 を返す)
+    int64_t log2Floor() const {
+        if (this->mantissa == 0.0) return 0;
+        int e;
+        std::frexp(this->mantissa, &e);
+        return this->exponent + e - 1;
+    }
+
+    // 10進の指数表記 (表示用. 指数が大きいと下の桁は log10 の丸めで不正確になる)
+    std::string toString() const {
+        if (this->mantissa == 0.0 || !std::isfinite(this->mantissa)) return std::to_string(this->mantissa);
+        // |x| = 10^(log10 |mantissa| + exponent * log10 2) を 10 進の仮数と指数に分ける
+        long double l = std::log10(std::fabs(static_cast<long double>(this->mantissa)))
+                      + static_cast<long double>(this->exponent) * 0.301029995663981195213738894724493L;
+        long double e10 = std::floor(l);
+        long double m10 = std::pow(10.0L, l - e10);
+        if (this->mantissa < 0.0) m10 = -m10;
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.16Lge%lld", m10, static_cast<long long>(e10));
+        return buf;
+    }
+
+    FloatExp operator-() const {
+        FloatExp r;
+        r.mantissa = -this->mantissa;
+        r.exponent = this->exponent;
+        return r;
+    }
+
+    friend FloatExp operator*(const FloatExp& a, const FloatExp& b) {
+        FloatExp r;
+        r.mantissa = a.mantissa * b.mantissa;
+        r.exponent = a.exponent + b.exponent;
+        r.normalizeLazily();
+        return r;
+    }
+
+    friend FloatExp operator/(const FloatExp& a, const FloatExp& b) {
+        FloatExp r;
+        r.mantissa = a.mantissa / b.mantissa;
+        r.exponent = a.exponent - b.exponent;
+        r.normalizeLazily();
+        return r;
+    }
+
+    friend FloatExp operator+(const FloatExp& a, const FloatExp& b) {
+        if (a.mantissa == 0.0) return b;
+        if (b.mantissa == 0.0) return a;
+        // 仮数部の指数も含めた大きさでそろえる. 差が 64 bit を超えれば小さい方は丸めで消える
+        int ea, eb;
+        double ma = std::frexp(a.mantissa, &ea), mb = std::frexp(b.mantissa, &eb);
+        int64_t xa = a.exponent + ea, xb = b.exponent + eb;
+        if (xa - xb > 64) return a;
+        if (xb - xa > 64) return b;
+        FloatExp r;
+        if (xa >= xb) {
+            r.mantissa = ma + std::ldexp(mb, static_cast<int>(xb - xa));
+            r.exponent = xa;
+        } else {
+            r.mantissa = std::ldexp(ma, static_cast<int>(xa - xb)) + mb;
+            r.exponent = xb;
+        }
+        r.normalize();
+        return r;
+    }
+
+    friend FloatExp operator-(const FloatExp& a, const FloatExp& b) { return a + (-b); }
+
+    FloatExp& operator+=(const FloatExp& b) { return *this = *this + b; }
+    FloatExp& operator-=(const FloatExp& b) { return *this = *this - b; }
+    FloatExp& operator*=(const FloatExp& b) { return *this = *this * b; }
+    FloatExp& operator/=(const FloatExp& b) { return *this = *this / b; }
+
+    // 2^k 倍 (仮数部は変えない)
+    friend FloatExp ldexp(const FloatExp& a, int64_t k) {
+        FloatExp r = a;
+        if (r.mantissa != 0.0) r.exponent += k;
+        return r;
+    }
+
+    friend int compare(const FloatExp& a, const FloatExp& b) {
+        FloatExp d = a - b;
+        return (d.mantissa > 0.0) - (d.mantissa < 0.0);
+    }
+    friend bool operator<(const FloatExp& a, const FloatExp& b) { return compare(a, b) < 0; }
+    friend bool operator>(const FloatExp& a, const FloatExp& b) { return compare(a, b) > 0; }
+    friend bool operator<=(const FloatExp& a, const FloatExp& b) { return compare(a, b) <= 0; }
+    friend bool operator>=(const FloatExp& a, const FloatExp& b) { return compare(a, b) >= 0; }
+    friend bool operator==(const FloatExp& a, const FloatExp& b) { return compare(a, b) == 0; }
+    friend bool operator!=(const FloatExp& a, const FloatExp& b) { return compare(a, b) != 0; }
+
+    friend FloatExp abs(const FloatExp& a) { return a.mantissa < 0.0 ? -a : a; }
+
+    friend FloatExp sqrt(const FloatExp& a) {
+        // 指数を偶数にしてから半分にする
+        FloatExp n = a;
+        n.normalize();
+        if (n.exponent % 2 != 0) {
+            n.mantissa *= 2.0;
+            n.exponent -= 1;
+        }
+        return FloatExp(std::sqrt(n.mantissa), n.exponent / 2);
+    }
+
+
+    private:
+    double mantissa = 0.0;
+    int64_t exponent = 0;
+
+    // |mantissa| を [0.5, 1) にする. 0, inf, nan は指数を 0 にする
+    void normalize() {
+        if (this->mantissa == 0.0 || !std::isfinite(this->mantissa)) {
+            this->exponent = 0;
+            return;
+        }
+        int e;
+        this->mantissa = std::frexp(this->mantissa, &e);
+        this->exponent += e;
+    }
+
+    void normalizeLazily() {
+        double a = std::fabs(this->mantissa);
+        // 2^±256 の中なら, 次の乗除算でも double の指数範囲を超えない. 0, inf, nan もここで正規化する
+        if (!(a >= 0x1p-256 && a <= 0x1p256)) this->normalize();
+    }
+};
+
+// FloatExp (や double) の実部と虚部を持つ複素数. Mandelbrot_proto.hpp の Complex として使える
+// (std::complex は算術型以外の要素を想定していない). 演算は formula::Cpx と同じ式
+template <typename T>
+class FloatExpComplex {
+    public:
+    FloatExpComplex() = default;
+    FloatExpComplex(const T& re, const T& im) : re(re), im(im) {}
+
+    const T& real() const { return this->re; }
+    const T& imag() const { return this->im; }
+
+    friend FloatExpComplex operator+(const FloatExpComplex& a, const FloatExpComplex& b) {
+        return {a.re + b.re, a.im + b.im};
+    }
+    friend FloatExpComplex operator-(const FloatExpComplex& a, const FloatExpComplex& b) {
+        return {a.re - b.re, a.im - b.im};
+    }
+    friend FloatExpComplex operator*(const FloatExpComplex& a, const FloatExpComplex& b) {
+        return {a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+    }
+
+    friend T norm(const FloatExpComplex& z) { return z.re * z.re + z.im * z.im; }
+    friend T abs(const FloatExpComplex& z) {
+        using std::sqrt;
+        return sqrt(norm(z));
+    }
+
+
+    private:
+    T re = T(0.0), im = T(0.0);
+};
+
+#endif  // FLOATEXP_HPP
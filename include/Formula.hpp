@@ -0,0 +1,270 @@
+#ifndef FORMULA_HPP
+#define FORMULA_HPP
+
+#include <cmath>
+#include <cstddef>
+#include "types.hpp"
+#include "Precision.hpp"
+
+// 反復式のポリシー. z_{n+1} = z_n^D + c の D と, 初期値の決め方を型で指定する.
+//   Multibrot<D>: z_0 = 0, c = 画素 (D = 2 が通常のマンデルブロ集合)
+//   Julia<D>:     z_0 = 画素, c = 固定のパラメタ
+// z^D は squaring の繰り返しでコンパイル時に展開され, pow は呼ばない.
+namespace formula {
+
+template <unsigned D>
+struct Multibrot {
+    static_assert(D >= 2, "degree must be >= 2");
+    static constexpr unsigned degree = D;
+    static constexpr bool julia = false;
+};
+
+template <unsigned D>
+struct Julia {
+    static_assert(D >= 2, "degree must be >= 2");
+    static constexpr unsigned degree = D;
+    static constexpr bool julia = true;
+};
+
+// 実部と虚部を別々に持つ複素数 (double, long double 用). mpfr は下の countMpc を使う
+template <typename T>
+struct Cpx {
+    T re, im;
+};
+
+template <typename T>
+inline Cpx<T> sqr(const Cpx<T>& z) {
+    return {z.re * z.re - z.im * z.im, 2 * z.re * z.im};
+}
+
+template <typename T>
+inline Cpx<T> mul(const Cpx<T>& a, const Cpx<T>& b) {
+    return {a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+}
+
+template <typename T>
+inline Cpx<T> add(const Cpx<T>& a, const Cpx<T>& b) {
+    return {a.re + b.re, a.im + b.im};
+}
+
+template <typename T>
+inline Cpx<T> scale(const Cpx<T>& z, unsigned s) {
+    return {z.re * s, z.im * s};
+}
+
+template <typename T>
+inline T norm2(const Cpx<T>& z) {
+    return z.re * z.re + z.im * z.im;
+}
+
+// z^D. D の2進展開に従って squaring と乗算を並べる (D = 2: 1回, D = 5: 3回)
+template <unsigned D, typename Z>
+inline Z ipow(const Z& z) {
+    if constexpr (D == 1) {
+        return z;
+    } else if constexpr (D % 2 == 0) {
+        return sqr(ipow<D / 2>(z));
+    } else {
+        return mul(sqr(ipow<D / 2>(z)), z);
+    }
+}
+
+// |z|^2 > bailout2 となる最初の n (上限 count_max)
+// p: 画素の座標, k: Julia のパラメタ (Multibrot では使わない), zero: 0
+template <typename F, typename Z, typename R>
+inline size_t count(const Z& p, const Z& k, const Z& zero, const R& bailout2, size_t count_max) {
+    Z z = F::julia ? p : zero;
+    const Z& c = F::julia ? k : p;
+    size_t n = 0;
+
+    while (n < count_max) {
+        z = add(ipow<F::degree>(z), c);
+        if (norm2(z) > bailout2) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// 外部距離推定の計算結果 (複素平面上の距離)
+template <typename R>
+struct Distance {
+    R estimate;  // G / |G'| = |z| log|z| / |dz|. 集合内なら 0
+    R lower;     // 距離の下界. この半径の円内に集合の境界はない (Multibrot<2> のみ保証)
+};
+
+// Koebe の 1/4 定理から dist >= sinh(G) / (2 e^G |G'|) = estimate * (1 - e^(-2G)) / (4G) の係数.
+// G = log|z| / D^steps は深い反復では 0 に近く, 係数は 1/2 に近づく
+inline double koebeFactor(double log_z, unsigned degree, size_t steps) {
+    double g = log_z / std::pow(static_cast<double>(degree), static_cast<double>(steps));
+    return (g > 1e-8) ? (1.0 - std::exp(-2.0 * g)) / (4.0 * g) : 0.5;
+}
+
+// 脱出後, 距離推定が十分正確になるまで反復を続ける |z|^2 の閾値と最大の追加回数
+constexpr double distance_bailout2 = 1e20;
+constexpr size_t distance_extra_max = 64;
+
+// count と同じ反復回数を返し, 同時に導関数 dz を追って距離推定を dist に書き込む.
+// Multibrot は dz/dc (dz_0 = 0, dz' = D z^(D-1) dz + 1), Julia は dz/dz_0 (dz_0 = 1, dz' = D z^(D-1) dz).
+// one: 1
+template <typename F, typename Z, typename R>
+inline size_t countDistance(
+    const Z& p, const Z& k, const Z& zero, const Z& one, const R& bailout2, size_t count_max, Distance<R>& dist
+) {
+    using std::log;
+    using std::sqrt;
+
+    Z z = F::julia ? p : zero;
+    Z dz = F::julia ? one : zero;
+    const Z& c = F::julia ? k : p;
+    size_t n = 0;
+
+    auto step = [&] {
+        Z zp = ipow<F::degree - 1>(z);
+        dz = scale(mul(zp, dz), F::degree);
+        if constexpr (!F::julia) dz = add(dz, one);
+        z = add(mul(zp, z), c);
+    };
+
+    while (n < count_max) {
+        step();
+        if (norm2(z) > bailout2) {
+            break;
+        }
+        n++;
+    }
+    if (n >= count_max) {
+        dist.estimate = dist.lower = R(0);
+        return n;
+    }
+
+    // 脱出半径 2 の直後は G(c) の近似が粗いので, |z| が大きくなるまで続ける (反復回数には数えない)
+    size_t steps = n + 1;
+    for (size_t i = 0; i < distance_extra_max && norm2(z) < R(distance_bailout2); i++) {
+        step();
+        steps++;
+    }
+
+    R z2 = norm2(z), dz2 = norm2(dz);
+    if (!(dz2 > R(0))) {
+        dist.estimate = dist.lower = R(0);
+        return n;
+    }
+    R log_z = log(z2) / 2;
+    dist.estimate = sqrt(z2) * log_z / sqrt(dz2);
+    dist.lower = dist.estimate * R(koebeFactor(static_cast<double>(log_z), F::degree, steps));
+    return n;
+}
+
+
+// mpfr 用の作業領域. 反復中は mpc_t / mpfr_t を確保し直さない
+struct MpcScratch {
+    explicit MpcScratch(mpfr_prec_t bits) : z(bits), dz(bits), zp(bits), n2(bits), a(bits), b(bits) {}
+
+    MpcVar z, dz, zp;
+    MpfrVar n2, a, b;
+};
+
+// out = z^D. out と z は別の変数であること
+template <unsigned D>
+inline void ipowInto(mpc_ptr out, mpc_srcptr z) {
+    if constexpr (D == 1) {
+        mpc_set(out, z, MPC_RNDNN);
+    } else {
+        if constexpr (D / 2 == 1) mpc_sqr(out, z, MPC_RNDNN);
+        else {
+            ipowInto<D / 2>(out, z);
+            mpc_sqr(out, out, MPC_RNDNN);
+        }
+        if constexpr (D % 2 == 1) mpc_mul(out, out, z, MPC_RNDNN);
+    }
+}
+
+// count の mpfr 版. 精度は p, k, s の精度 (呼び出し側で揃える)
+template <typename F>
+inline size_t countMpc(mpc_srcptr p, mpc_srcptr k, mpfr_srcptr bailout2, size_t count_max, MpcScratch& s) {
+    mpc_srcptr c = F::julia ? k : p;
+    if constexpr (F::julia) mpc_set(s.z, p, MPC_RNDNN);
+    else mpc_set_ui(s.z, 0, MPC_RNDNN);
+    size_t n = 0;
+
+    while (n < count_max) {
+        ipowInto<F::degree>(s.zp, s.z);
+        mpc_add(s.z, s.zp, c, MPC_RNDNN);
+        mpc_norm(s.n2, s.z, MPFR_RNDN);
+        if (mpfr_cmp(s.n2, bailout2) > 0) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// countDistance の mpfr 版. 距離は画素間隔 pixel で割った値 [px] を返す
+template <typename F>
+inline size_t countDistanceMpc(
+    mpc_srcptr p, mpc_srcptr k, mpfr_srcptr bailout2, size_t count_max, mpfr_srcptr pixel,
+    MpcScratch& s, Distance<double>& dist_px
+) {
+    mpc_srcptr c = F::julia ? k : p;
+    if constexpr (F::julia) {
+        mpc_set(s.z, p, MPC_RNDNN);
+        mpc_set_ui(s.dz, 1, MPC_RNDNN);
+    } else {
+        mpc_set_ui(s.z, 0, MPC_RNDNN);
+        mpc_set_ui(s.dz, 0, MPC_RNDNN);
+    }
+    size_t n = 0;
+
+    auto step = [&] {
+        ipowInto<F::degree - 1>(s.zp, s.z);
+        mpc_mul(s.dz, s.dz, s.zp, MPC_RNDNN);
+        mpc_mul_ui(s.dz, s.dz, F::degree, MPC_RNDNN);
+        if constexpr (!F::julia) mpc_add_ui(s.dz, s.dz, 1, MPC_RNDNN);
+        mpc_mul(s.z, s.z, s.zp, MPC_RNDNN);
+        mpc_add(s.z, s.z, c, MPC_RNDNN);
+        mpc_norm(s.n2, s.z, MPFR_RNDN);
+    };
+
+    while (n < count_max) {
+        step();
+        if (mpfr_cmp(s.n2, bailout2) > 0) {
+            break;
+        }
+        n++;
+    }
+    if (n >= count_max) {
+        dist_px.estimate = dist_px.lower = 0.0;
+        return n;
+    }
+
+    size_t steps = n + 1;
+    for (size_t i = 0; i < distance_extra_max && mpfr_cmp_d(s.n2, distance_bailout2) < 0; i++) {
+        step();
+        steps++;
+    }
+
+    mpc_norm(s.b, s.dz, MPFR_RNDN);
+    if (mpfr_sgn(s.b) <= 0) {
+        dist_px.estimate = dist_px.lower = 0.0;
+        return n;
+    }
+    // estimate = |z| log|z| / |dz| / pixel
+    mpfr_log(s.a, s.n2, MPFR_RNDN);
+    mpfr_div_2ui(s.a, s.a, 1, MPFR_RNDN);
+    double log_z = mpfr_get_d(s.a, MPFR_RNDN);
+    mpfr_sqrt(s.n2, s.n2, MPFR_RNDN);
+    mpfr_mul(s.a, s.a, s.n2, MPFR_RNDN);
+    mpfr_sqrt(s.b, s.b, MPFR_RNDN);
+    mpfr_div(s.a, s.a, s.b, MPFR_RNDN);
+    mpfr_div(s.a, s.a, pixel, MPFR_RNDN);
+
+    dist_px.estimate = mpfr_get_d(s.a, MPFR_RNDN);
+    dist_px.lower = dist_px.estimate * koebeFactor(log_z, F::degree, steps);
+    return n;
+}
+
+}  // namespace formula
+
+#endif  // FORMULA_HPP
@@ -0,0 +1,65 @@
+#ifndef FORMULAJIT_HPP
+#define FORMULAJIT_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// 反復式を式の文字列で指定する (Mandelbrot::setExpression). 式から double / long double の反復の関数の
+// C++ ソースを生成し, その場のコンパイラで共有ライブラリにして dlopen する. 組み込みの反復式と同じく
+// 式はコンパイル時に展開されるので, 式を解釈しながら反復するより桁違いに速い.
+//
+// 式の書式: z (今の値), c (Mandelbrot では画素, Julia ではパラメタ), i (虚数単位), 実数の定数,
+//           + - * / と整数の冪 ^N (1 <= N <= 64, squaring に展開), 括弧, 関数
+//             conj(x)  複素共役
+//             abs(x)   実部と虚部それぞれの絶対値 (burning ship)
+//             re(x), im(x)  実部, 虚部 (実数として)
+//           ';' で区切ると, 反復ごとに順に使う (hybrid). 1回の適用を1回の反復と数える
+//   例: "z^2+c" (通常), "conj(z)^2+c" (tricorn), "abs(z)^2+c" (burning ship), "z^2+c;abs(z)^2+c"
+//
+// 生成したソースと共有ライブラリは, ソースとコンパイルのコマンドのハッシュの名前でキャッシュのディレクトリに置き,
+// 同じ式は2回目からコンパイルしない. ディレクトリは $MANDEL_JIT_CACHE, なければ $XDG_CACHE_HOME/mandel-jit,
+// $HOME/.cache/mandel-jit, 一時ディレクトリの mandel-jit-<uid> の順. 他人が置いたライブラリを読み込まないよう,
+// ディレクトリは自分が所有し, グループと他人が書き込めないものに限る (そうでなければ std::runtime_error).
+// コンパイラは $MANDEL_JIT_CXX (既定 c++)
+class FormulaJit {
+    public:
+    // 1行分の反復. 画素 (re[x], im) (x < n) の反復回数 (formula::count と同じ数え方) を counts[x] に書き込む.
+    // julia なら z_0 = 画素, c = k. そうでなければ z_0 = 0, c = 画素
+    template <typename T>
+    using RowFunction = void (*)(const T* re, T im, size_t n, int julia, T k_re, T k_im, T bailout2,
+                                 size_t count_max, size_t* counts);
+
+    // expression の反復の関数を読み込む. 同じ式はプロセス内でも共有する.
+    // 式の誤りは std::invalid_argument, コンパイルや読み込みの失敗は std::runtime_error.
+    // コンパイラの出力はキャッシュのディレクトリの <ハッシュ>.log に残す
+    static std::shared_ptr<const FormulaJit> load(const std::string& expression);
+
+    // expression から生成する C++ のソース. 式の誤りは std::invalid_argument
+    static std::string generateSource(const std::string& expression);
+
+    // キャッシュのディレクトリ
+    static std::string cacheDirectory();
+
+    FormulaJit(const FormulaJit&) = delete;
+    FormulaJit& operator=(const FormulaJit&) = delete;
+    ~FormulaJit();
+
+    const std::string& getExpression() const;
+    const std::string& getLibraryPath() const;
+
+    RowFunction<double> rowDouble() const;
+    RowFunction<long double> rowLongDouble() const;
+
+
+    private:
+    std::string expression;
+    std::string library_path;
+    void* handle = nullptr;  // dlopen の結果
+    RowFunction<double> row_double = nullptr;
+    RowFunction<long double> row_long_double = nullptr;
+
+    FormulaJit(const std::string& expression, const std::string& library_path);
+};
+
+#endif  // FORMULAJIT_HPP
@@ -0,0 +1,87 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// 画素ごとのバッファ (反復回数・距離・色) 用のアロケータ.
+// - resize() で要素を初期化しない. ページに最初に書き込んだスレッドのソケットに
+//   メモリが割り当てられる (first touch) ので, 初期化は描画と同じスレッド配置で行う
+//   (Mandelbrot::setNumaFirstTouch)
+// - huge_page_bytes 以上の確保は mmap + MADV_HUGEPAGE で 2 MiB ページを使い, TLB ミスを減らす
+template <typename T>
+class FrameAllocator {
+    public:
+    using value_type = T;
+
+    static constexpr size_t huge_page_bytes = size_t(2) << 20;
+
+    FrameAllocator() = default;
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T);
+        #ifdef __linux__
+            if (bytes >= huge_page_bytes) {
+                void* p = mmap(nullptr, roundUp(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED) throw std::bad_alloc();
+                #ifdef MADV_HUGEPAGE
+                    madvise(p, roundUp(bytes), MADV_HUGEPAGE);  // 失敗しても通常のページで動く
+                #endif
+                return static_cast<T*>(p);
+            }
+        #endif
+        void* p = std::malloc(bytes ? bytes : 1);
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t n) {
+        #ifdef __linux__
+            if (n * sizeof(T) >= huge_page_bytes) {
+                munmap(p, roundUp(n * sizeof(T)));
+                return;
+            }
+        #endif
+        (void)n;
+        std::free(p);
+    }
+
+    // 引数なしの構築は default-initialize (算術型・Color では何も書き込まない)
+    template <typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+
+    private:
+    static size_t roundUp(size_t bytes) {
+        return (bytes + huge_page_bytes - 1) / huge_page_bytes * huge_page_bytes;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const FrameAllocator<T>&, const FrameAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const FrameAllocator<T>&, const FrameAllocator<U>&) { return false; }
+
+// 画素バッファ. resize() 直後の値は不定
+template <typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+#endif  // FRAMEBUFFER_HPP
@@ -0,0 +1,106 @@
+#ifndef ITERATIONFIELD_HPP
+#define ITERATIONFIELD_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "FrameBuffer.hpp"
+
+// 反復回数の画像をコンパクトに持つコンテナ.
+// FrameVector<size_t> は1画素 8 byte だが, 発散した画素の反復回数は mandel_count_max 未満なので
+// mandel_count_max <= 65536 なら uint16, それ以外は uint32 で持つ (16K x 16K で 2 GB -> 512 MB).
+// 集合内 (反復回数 >= mandel_count_max) は別の 1 bit のフラグで持ち, 反復回数の値は 0 にする.
+//
+// compress / save は行ごとの差分 (集合内の画素は直前の値とみなして差分 0) を行ごとにバイト面に分けて
+// zlib (既定は最速の level 1) で圧縮する. 発散回数は隣の画素とほぼ同じなので数倍から数十倍に縮む.
+// 1行ずつ deflate に渡すので, 圧縮前の全体のコピーは作らない
+class IterationField {
+    public:
+    IterationField() = default;
+
+    // mandel_count_max の画像を入れるのに必要な要素の大きさ [byte] (2 か 4)
+    static size_t elementBytes(size_t mandel_count_max);
+
+    // width x height, 上限 mandel_count_max の領域を確保する. 値は未初期化 (FrameVector と同じ)
+    void reset(size_t width, size_t height, size_t mandel_count_max);
+
+    // counts (width x height, FrameVector<size_t> の形式) から作る
+    void assign(const FrameVector<size_t>& counts, size_t width, size_t height, size_t mandel_count_max);
+
+    // FrameVector<size_t> の形式に戻す (集合内は mandel_count_max)
+    void toCounts(FrameVector<size_t>& counts) const;
+
+    // (x0, y0) から w x h の反復回数 src (1行 stride 要素) を書き込む.
+    // フラグの語は atomic に更新するので, 重ならないタイルなら別スレッドから同時に書ける
+    void storeTile(size_t x0, size_t y0, size_t w, size_t h, const size_t* src, size_t stride);
+
+    // 行 [y0, y1) を 0 で初期化する (NUMA の first touch 用)
+    void clearRows(size_t y0, size_t y1);
+
+    size_t count(size_t i) const {
+        if (this->interior(i)) return this->mandel_count_max;
+        return this->elem_bytes == 2 ? this->c16[i] : this->c32[i];
+    }
+    bool interior(size_t i) const { return (this->flags[i / 32] >> (i % 32)) & 1u; }
+
+    size_t size() const { return this->width * this->height; }
+    size_t getWidth() const { return this->width; }
+    size_t getHeight() const { return this->height; }
+    size_t getMandelCountMax() const { return this->mandel_count_max; }
+    size_t getElementBytes() const { return this->elem_bytes; }
+    // 反復回数とフラグが使うメモリ [byte]
+    size_t bytes() const;
+
+    const uint16_t* data16() const { return this->elem_bytes == 2 ? this->c16.data() : nullptr; }
+    const uint32_t* data32() const { return this->elem_bytes == 4 ? this->c32.data() : nullptr; }
+    const uint32_t* interiorFlags() const { return this->flags.data(); }
+
+    // 差分 + zlib で圧縮したバイト列. level は zlib の圧縮レベル (1: 最速, 9: 最小)
+    std::vector<uint8_t> compress(int level = 1) const;
+
+    // compress の結果から元に戻す. 壊れたデータなら false (このインスタンスは変えない)
+    bool decompress(const std::vector<uint8_t>& data);
+
+    // compress した内容をファイルに保存する (writeFileAtomic). 失敗したら false
+    bool save(const std::string& filename, int level = 1) const;
+    bool load(const std::string& filename);
+
+
+    private:
+    size_t width = 0, height = 0;
+    size_t mandel_count_max = 0;
+    size_t elem_bytes = 2;
+    FrameVector<uint16_t> c16;
+    FrameVector<uint32_t> c32;
+    FrameVector<uint32_t> flags;  // 集合内の画素のビット. 画素 i は flags[i / 32] の bit (i % 32)
+};
+
+// 色付けなどが反復回数を読むための共通の型. FrameVector<size_t> と IterationField のどちらからも作れる.
+// 元のバッファを参照するだけなので, 元より長く持たないこと
+class IterationView {
+    public:
+    IterationView(const FrameVector<size_t>& counts)
+        : wide(counts.data()), n(counts.size()) {}
+    IterationView(const IterationField& field)
+        : c16(field.data16()), c32(field.data32()), flags(field.interiorFlags()),
+          interior_count(field.getMandelCountMax()), n(field.size()) {}
+
+    size_t size() const { return this->n; }
+
+    size_t operator[](size_t i) const {
+        if (this->wide) return this->wide[i];
+        if ((this->flags[i / 32] >> (i % 32)) & 1u) return this->interior_count;
+        return this->c16 ? this->c16[i] : this->c32[i];
+    }
+
+
+    private:
+    const size_t* wide = nullptr;
+    const uint16_t* c16 = nullptr;
+    const uint32_t* c32 = nullptr;
+    const uint32_t* flags = nullptr;
+    size_t interior_count = 0;
+    size_t n = 0;
+};
+
+#endif  // ITERATIONFIELD_HPP
@@ -2,16 +2,84 @@
 #define MANDELBROT_HPP
 
 #include <vector>
+#include <atomic>
+#include <cstdint>
 #include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <png.h>
 #include <omp.h>
 #include "Color.hpp"
 #include "Palette.hpp"
 #include "types.hpp"
+#include "FrameBuffer.hpp"
+#include "IterationField.hpp"
+#include "Numa.hpp"
+#include "Precision.hpp"
+#include "Formula.hpp"
+#include "FormulaJit.hpp"
+#include "Trace.hpp"
+
+// 画素ごとの反復計算に使う数値型
+enum class Backend {
+    Auto,        // 画素間隔から double / long double / mpfr を自動で選ぶ
+    Double,
+    LongDouble,
+    Mpfr,        // precision 桁の mpfr. 基準となる実装
+    // double を SIMD のレーンで並べて反復する. 脱出した画素のレーンには, chunk ごとにタイルの未計算の画素を
+    // 詰め直すので, 遅い画素が1つあってもレーンが空かない. 結果は Double と同じ. 距離推定は Double で計算する
+    DoubleCompact
+};
+
+// 反復式 z = z^degree + c の種類 (Formula.hpp)
+enum class Formula {
+    Mandelbrot,  // z_0 = 0, c = 画素
+    Julia        // z_0 = 画素, c = julia_re + julia_im i
+};
+
+// makeCountVector 1回分のソケットごとの集計 (Mandelbrot::getSocketStats)
+struct SocketStats {
+    size_t socket = 0;
+    size_t threads = 0;
+    size_t tiles = 0;
+    size_t pixels = 0;
+    uint64_t iterations = 0;
+    double busy_s = 0.0;  // このソケットのスレッドがタイルの計算に使った時間の合計
+    double wall_s = 0.0;  // makeCountVector 全体の時間 (全ソケット共通)
+    // Backend::DoubleCompact のレーンの使用率 = lane_active / lane_slots
+    uint64_t lane_slots = 0;  // 反復したステップ数 x レーン数
+    uint64_t lane_active = 0;  // そのうち計算中の画素があったレーン
+};
+
+class Mandelbrot;
+
+// Mandelbrot::makeCountVectorPanned の前回の結果. 反復回数と, それを描画したときの設定を組で持つ.
+// どちらもエンジンだけが書き換えるので, 別のビューの反復回数をずらして使うことはない
+struct PannedCounts {
+    FrameVector<size_t> counts;
+    std::shared_ptr<const Mandelbrot> view;  // counts を描画したときの設定. nullptr なら counts は使えない
+
+    bool valid() const { return static_cast<bool>(this->view); }
+    void clear() {
+        this->counts = FrameVector<size_t>();
+        this->view.reset();
+    }
+};
+
+// 計算したタイルの反復回数を受け取る関数 (Mandelbrot::makeCountTiles).
+// (x0, y0) は領域の左上からの画素座標で, counts の画素 (x, y) は counts[y * stride + x] (w x h).
+// 描画中のスレッドから同時に呼ばれる (タイルは重ならない)
+using TileSink = std::function<void(size_t x0, size_t y0, size_t w, size_t h, const size_t* counts, size_t stride)>;
+
+// 色を付けたタイルを受け取る関数 (Mandelbrot::makeColorTiles). 座標と呼ばれ方は TileSink と同じ
+using ColorTileSink = std::function<void(size_t x0, size_t y0, size_t w, size_t h, const Color* colors, size_t stride)>;
 
 class Mandelbrot {
     private:
-    size_t precision;  // 浮動小数点数の精度, mpfr使用
+    size_t precision = 50;  // 浮動小数点数の精度 (10進の桁数), mpfr使用. 既定値は boost の既定精度と同じ
     size_t width_px, height_px;  // 出力画像の解像度
     Float re_target, im_target, width_target, height_target;  // 複素数平面上のどの座標・範囲を描画するか
     Palette palette;  // パレット
@@ -19,9 +87,45 @@ class Mandelbrot {
     Float re_min, re_max;
     Float im_min, im_max;
     size_t mandel_count_max;  // 発散回数を計算するときの上限回数
+    Backend backend = Backend::Auto;  // 反復計算に使う数値型
+    Formula formula = Formula::Mandelbrot;  // 反復式
+    unsigned degree = 2;  // 反復式の次数
+    Float julia_re, julia_im;  // Julia 集合のパラメタ c
+    std::string expression;  // 空でなければ z^degree + c の代わりに使う反復式 (FormulaJit)
+    std::shared_ptr<const FormulaJit> jit;  // expression をコンパイルしたもの. コピーとは共有する
+    // 計算する画素の範囲 [region_x0, region_x1) x [region_y0, region_y1). 既定は画像全体
+    size_t region_x0 = 0, region_y0 = 0;
+    size_t region_x1 = std::numeric_limits<size_t>::max(), region_y1 = std::numeric_limits<size_t>::max();
+    bool numa_first_touch = false;  // ソケットごとに行の帯を割り当て, バッファもそのソケットで初期化する
+    Pinning pinning = Pinning::None;  // OpenMP のスレッドの CPU への固定
+    std::vector<double> tile_costs;  // setTileCosts. 空ならタイルを動的に割り当てる
+    // 直前の描画の集計. 描画はローカルに集計し, 終わったら std::atomic_store で丸ごと差し替える.
+    // const のエンジンで同時に描画しても (AsyncRender, C API), 読む側は std::atomic_load した一貫した集計を見る
+    struct RenderStats {
+        std::vector<SocketStats> sockets;  // ソケットごとの集計
+        std::vector<uint64_t> tile_iterations;  // タイルごとの反復回数
+    };
+    mutable std::shared_ptr<const RenderStats> last_stats;
+    std::shared_ptr<const RenderStats> loadStats() const;
+
+    static constexpr size_t tile_size = 32;  // makeCountVector で各スレッドに割り当てるタイルの一辺 [px]
+    static constexpr float de_falloff_px = 8.0f;  // nToColor_DE でパレットの端に達する距離 [px]
+    static constexpr size_t compact_lanes = 8;  // Backend::DoubleCompact で同時に反復する画素数
+    static constexpr size_t compact_chunk = 16;  // Backend::DoubleCompact でレーンを詰め直す間隔 [反復]
 
 
     public:
+    // Backend::Auto の切り替え基準.
+    // 仮数部 d bit の型は, 画素間隔 / max(|c|, 1) が 2^(auto_guard_bits - d) 以上なら mpfr と一致する.
+    // tools/accuracy (32px, 上限 1000 回, 不一致 1%) での最悪値は long double の 23 bit
+    static constexpr int auto_guard_bits = 24;
+
+    // setFormula で指定できる次数の上限. 次数ごとに反復の関数がコンパイルされる
+    static constexpr unsigned max_degree = 8;
+
+    // panOffset で画素単位の移動とみなす誤差 [px]. 10進の文字列で渡した中心の丸め誤差を許す
+    static constexpr double pan_tolerance_px = 1e-6;
+
     Mandelbrot() = default;
 
     // 全てのパラメタの設定
@@ -50,6 +154,27 @@ class Mandelbrot {
     void setHeightTarget(const Float& height_target);
     void setPalette(const Palette& palette);
     void setMandelCountMax(size_t mandel_count_max);
+    void setBackend(Backend backend);
+    void setFormula(Formula formula, unsigned degree=2);  // degree が [2, max_degree] の外なら std::invalid_argument
+    void setJuliaParam(const Float& julia_re, const Float& julia_im);
+    // 反復式を式の文字列 (FormulaJit.hpp の書式) にする. 初期値の決め方は formula (Mandelbrot / Julia) に従い,
+    // degree は使わない. 初めての式はコンパイルする (キャッシュがあれば読み込むだけ). 空の文字列で z^degree + c に戻す.
+    // 数値型は double, long double, double_compact (double で計算する) だけで, 距離推定もできない
+    // (描画時に std::invalid_argument). 式の誤りは std::invalid_argument, コンパイルの失敗は std::runtime_error
+    void setExpression(const std::string& expression);
+    // 画像の一部 [x0, x1) x [y0, y1) だけを計算する. 画素の座標は画像全体のときと同じで,
+    // バッファ (makeCountVector など) は領域の大きさになる. 空の領域なら std::invalid_argument
+    void setRegion(size_t x0, size_t y0, size_t x1, size_t y1);
+    void clearRegion();
+    // 複数ソケットのホスト用. 画像の行をソケットごとの帯に分け, 帯の初期化 (first touch)・反復・色付けを
+    // そのソケットのスレッドで行う. タイルは自分の帯から取り, なくなれば他の帯から取る
+    void setNumaFirstTouch(bool numa_first_touch);
+    // 描画するスレッドを pinning に従って CPU に固定する. 呼び出したスレッド (OpenMP のスレッド 0) も固定されたままになる
+    void setPinning(Pinning pinning);
+    // タイルごとの重さの予測 (tileCount 個, タイルの番号順). 設定すると, タイルを番号順に重さの等しい連続した範囲に
+    // 分けてスレッドに固定で割り当てる (動的な割り当ての同期がない). 空なら動的な割り当て.
+    // 個数が tileCount と違うときと NUMA モードでは使わない
+    void setTileCosts(const std::vector<double>& tile_costs);
 
     // Getter
     size_t getPrecision() const;
@@ -61,37 +186,224 @@ class Mandelbrot {
     Float getHeightTarget() const;
     Palette getPalette() const;
     size_t getMandelCountMax() const;
+    Backend getBackend() const;
+    Formula getFormula() const;
+    unsigned getDegree() const;
+    const std::string& getExpression() const;
+    Float getJuliaRe() const;
+    Float getJuliaIm() const;
+    // 画像に収まるよう切り詰めた領域
+    size_t regionX0() const;
+    size_t regionY0() const;
+    size_t regionX1() const;
+    size_t regionY1() const;
+    size_t regionWidth() const;
+    size_t regionHeight() const;
+    // makeCountVector などが領域を分けるタイルの数
+    size_t tileCount() const;
+    bool getNumaFirstTouch() const;
+    Pinning getPinning() const;
 
-    // ラスタースキャン順の height_px * width_px サイズのvector.
-    // mandelCountの結果を格納する
-    std::vector<size_t> makeCountVector() const;
+    // 直前の makeCountVector / makeDistanceVector のソケットごとの画素数・反復回数・時間.
+    // 同時に描画していたら, 最後に終わった描画の集計
+    std::vector<SocketStats> getSocketStats() const;
+
+    // 直前の makeCountVector などのタイルごとの反復回数の合計 (タイルの番号順. 中止したら計算したタイルだけ)
+    std::vector<uint64_t> getTileIterations() const;
+
+    // prev の直前の描画のタイルごとの反復回数を, このビューのタイルに写した重さ (setTileCosts 用).
+    // ズームの連続したフレームは重さの分布が似ているので, 前のフレームから次のフレームの分割を決められる.
+    // 画素ごとの手間を反復 1 回分として足す. prev のビューの外の部分は prev の平均とする.
+    // prev が描画していなければ空
+    std::vector<double> tileCostsFrom(const Mandelbrot& prev) const;
+
+    // 実際に使う数値型. Auto のときは現在のビューから決める
+    Backend resolveBackend() const;
+
+    // Backend <-> 名前 ("auto", "double", "long_double", "mpfr", "double_compact")
+    static std::string backendName(Backend backend);
+    static Backend backendFromName(const std::string& name);
+
+    // Formula <-> 名前 ("mandelbrot", "julia")
+    static std::string formulaName(Formula formula);
+    static Formula formulaFromName(const std::string& name);
+
+    // ラスタースキャン順の height_px * width_px サイズのvector (領域を指定したときは領域の大きさ).
+    // 反復回数 (formula::count の結果)を格納する
+    FrameVector<size_t> makeCountVector() const;
+
+    // makeCountVector の結果を count_vec に書き込む. 同じサイズなら確保し直さない.
+    // cancel が true になると残りのタイルを飛ばして false を返す (count_vec は不完全)
+    bool makeCountVector(FrameVector<size_t>& count_vec, const std::atomic<bool>* cancel = nullptr) const;
+
+    // makeCountVector の結果を field (IterationField) に書き込む. 各タイルはスレッドごとの小さなバッファで計算してから
+    // 詰めて書き込むので, 1画素 8 byte のバッファは確保しない
+    bool makeIterationField(IterationField& field, const std::atomic<bool>* cancel = nullptr) const;
+
+    // 各タイルを計算したら sink に渡す. 画像全体のバッファは確保しないので, 呼び出し側の形式のバッファに
+    // 直接書き込める (libmandel の C API)
+    bool makeCountTiles(const TileSink& sink, const std::atomic<bool>* cancel = nullptr) const;
+
+    // prev (前に描画したときの設定) からの変化が画素単位の平行移動だけなら true で, 新しい画素 (x, y) が
+    // prev の画素 (x + dx, y + dy) に当たる (dx, dy) を返す. 解像度・幅・領域・反復式・上限・数値型・精度が同じで,
+    // 中心の差が画素間隔の整数倍 (誤差 pan_tolerance_px 以内) のときだけ
+    bool panOffset(const Mandelbrot& prev, long& dx, long& dy) const;
+
+    // frame.counts を今の設定の makeCountVector の結果にする. frame が前の呼び出しの結果で, その設定 frame.view から
+    // 画素単位の平行移動 (panOffset) なら, 反復回数をずらして残し, 新しく見えた帯だけを反復する.
+    // ドラッグ中の再描画の時間が画像全体ではなく帯の大きさで決まる. 平行移動でないか, 移動が領域より大きければ
+    // 全て計算する. getSocketStats は反復した帯の集計. getTileIterations は, ずらした画素がタイルの境界に
+    // 合わないので空にする (次の setTileCosts(tileCostsFrom(...)) は動的な割り当てになる).
+    // 中止したら frame は無効になる (次は全て計算する)
+    bool makeCountVectorPanned(PannedCounts& frame, const std::atomic<bool>* cancel = nullptr) const;
+
+    // makeCountVector と同時に外部距離推定 (単位は画素, 集合内は 0) を dist_vec に書き込む. 導関数 dz を追って計算する.
+    // disk_fill のときは, 距離の下界を半径とする円内に境界がないことを使い, 円内の画素を計算せずに埋める.
+    // 埋めた画素の反復回数は円の中心の値, 距離は下界になる. 下界が保証されるのは Multibrot (degree 2) だけなので,
+    // それ以外の反復式では disk_fill は無視される
+    bool makeDistanceVector(
+        FrameVector<size_t>& count_vec, FrameVector<float>& dist_vec,
+        bool disk_fill, const std::atomic<bool>* cancel = nullptr
+    ) const;
 
     // ラスタースキャン順の height_px * width_px サイズのvector.
     // nToColorの結果を格納する
-    std::vector<Color> makeColorVector(bool eq_hist) const;
+    FrameVector<Color> makeColorVector(bool eq_hist) const;
+
+    // 計算済みの count_vec (FrameVector<size_t> か IterationField) から色を決める. eq_hist のときは brightness_table を使う
+    FrameVector<Color> makeColorVector(
+        const IterationView& count_vec,
+        const std::vector<double>& brightness_table,
+        bool eq_hist
+    ) const;
+
+    // 上と同じ. 結果を color_vec に書き込む
+    void makeColorVector(
+        const IterationView& count_vec,
+        const std::vector<double>& brightness_table,
+        bool eq_hist,
+        FrameVector<Color>& color_vec
+    ) const;
+
+    // makeDistanceVector の結果から色を決める. 境界からの距離 [px] でパレットを引くので境界が細く鮮明になる
+    void makeColorVector(
+        const IterationView& count_vec,
+        const FrameVector<float>& dist_vec,
+        FrameVector<Color>& color_vec
+    ) const;
+
+    // 色の番号の表で集合内 (黒) を表す値
+    static constexpr size_t palette_black = std::numeric_limits<size_t>::max();
+
+    // makeColorVector と同じ対応で, 反復回数 n (0..mandel_count_max) -> パレットの番号 (集合内は palette_black) の表.
+    // パレットの色数が同じなら, 回転・補間したパレットにもそのまま使える (パレット循環のアニメーション)
+    std::vector<size_t> makePaletteIndexTable(const std::vector<double>& brightness_table, bool eq_hist) const;
+
+    // makePaletteIndexTable を今のパレットの色にした表 (集合内は黒). makeColorTiles, remapColors に渡す
+    std::vector<Color> makeColorTable(const std::vector<double>& brightness_table, bool eq_hist) const;
+
+    // 反復と色付けを1つにしたもの. 各タイルを計算したらすぐに color_table で色にして sink に渡すので,
+    // 反復回数の画像 (FrameVector<size_t>, IterationField) を作らず, 読み直しもしない.
+    // ヒストグラム平坦化には makeSampledBrightnessTable の表から作った color_table を使う
+    bool makeColorTiles(const std::vector<Color>& color_table, const ColorTileSink& sink,
+                        const std::atomic<bool>* cancel = nullptr) const;
+
+    // 上と同じ. 色を color_vec (領域の大きさ) に直接書き込む
+    bool makeColorTiles(const std::vector<Color>& color_table, FrameVector<Color>& color_vec,
+                        const std::atomic<bool>* cancel = nullptr) const;
+
+    // 画像全体を幅 sample_px (以下) に縮めて試し描きし, そのヒストグラムから明るさテーブルを作る.
+    // 本番の反復回数を全て持たずにヒストグラム平坦化するための近似 (領域を指定しても画像全体の分布になる)
+    std::vector<double> makeSampledBrightnessTable(size_t sample_px = 256) const;
+
+    // 反復回数 n の画素を color_table[n] の色にする. 表引きだけなので, パレットを変えて何度も色を付け直すのに使う
+    void remapColors(const IterationView& count_vec, const std::vector<Color>& color_table, FrameVector<Color>& color_vec) const;
+
+    // ヒストグラム平坦化用の明るさテーブル (値は [0.0, 1.0]) を count_vec から作る
+    std::vector<double> makeBrightnessTable(const IterationView& count_vec) const;
 
 
     private:
+    // タイルの書き込み先. 画素 (x, y) は count[(y - y0) * stride + (x - x0)]
+    struct TileTarget {
+        size_t* count;
+        float* dist;  // nullptr なら反復回数だけ計算する
+        size_t x0, y0, stride;
+        SocketStats* stats = nullptr;  // あれば DoubleCompact のレーンの使用率を足す
+
+        size_t index(size_t x, size_t y) const { return (y - this->y0) * this->stride + (x - this->x0); }
+    };
+
     // re_min, im_maxなどの複素数平面上での描画範囲を更新
     void updateComplexRange();
 
-    // 画像上の座標x, yから対応する複素平面上の複素数を得る
-    Complex getComplexAt(const size_t x, const size_t y) const;
+    // 画像上の座標x, yから対応する複素平面上の複素数を out に得る. work1, work2 は作業用.
+    // 精度は out, work1, work2 の精度 (makeCountTileMpfr で precision に揃える)
+    void getComplexAt(size_t x, size_t y, mpc_ptr out, mpfr_ptr work1, mpfr_ptr work2) const;
+
+    // pinning に従って呼び出したスレッドを固定し, スレッドのいるソケットを返す
+    size_t placeThread(size_t thread) const;
+
+    // 全画素 i について body(i) を並列に呼ぶ. NUMA モードでは iterateTiles と同じ行の帯の割り当てで呼ぶ
+    template <typename Body>
+    void forEachPixel(size_t pixels, Body body) const;
+
+    // makeCountVector, makeDistanceVector, makeIterationField, makeCountTiles の本体. dist_buf が nullptr なら反復回数だけ計算する.
+    // field か sink があれば count_buf は使わず, タイルごとに field に詰めて書き込むか sink に渡す
+    bool iterateTiles(size_t* count_buf, float* dist_buf, IterationField* field, const TileSink* sink,
+                      bool disk_fill, const std::atomic<bool>* cancel) const;
+
+    // [x0, x1) x [y0, y1) のタイルの反復回数を out に書き込む.
+    // out.dist があれば距離推定も書き込み, disk_fill なら距離の下界の円内を埋める
+    void makeCountTile(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const;
+
+    // degree に応じて F<degree> の makeCountTileF を呼ぶ
+    template <template <unsigned> class F>
+    void makeCountTileDegree(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const;
+
+    // 反復式 F で backend の数値型の makeCountTile* を呼ぶ
+    template <typename F>
+    void makeCountTileF(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const;
 
-    // abs(z)が初めて2を超えるnを計算する
-    size_t mandelCount(const Complex& c) const;
+    // makeCountTile の double / long double 版. 座標も T で計算する
+    template <typename T, typename F>
+    void makeCountTileT(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const;
 
-    // mandelCountの結果nからpalette中の⾊を決めるstatic method
+    // makeCountTile の setExpression 版. 行ごとにコンパイルした row を呼ぶ. 反復回数だけ計算する
+    template <typename T>
+    void makeCountTileJit(FormulaJit::RowFunction<T> row, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out) const;
+
+    // makeCountTile の DoubleCompact 版. 反復回数だけ計算する
+    template <typename F>
+    void makeCountTileCompact(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out) const;
+
+    // (x, y) を中心とする半径 lower_px [px] の円内で, タイル内の未計算の画素を反復回数 n で埋める.
+    // 埋めた画素の距離は下界 lower_px - (中心からの距離)
+    void fillDisk(size_t x, size_t y, size_t x0, size_t x1, size_t y1,
+                  size_t n, float lower_px, const TileTarget& out) const;
+
+    // makeCountTile の mpfr 版. getComplexAt の座標で mpc のまま反復する
+    template <typename F>
+    void makeCountTileMpfr(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const;
+
+    // 反復回数nからpalette中の⾊を決めるstatic method
     Color nToColor(size_t n) const;
 
+    // nToColor, nToColor_EqHist が使うパレットの番号 (集合内は palette_black)
+    size_t nToPaletteIndex(size_t n) const;
+    size_t nToPaletteIndex_EqHist(size_t n, const std::vector<double>& brightness_table) const;
+
+    // 距離推定 dist_px [px] から Color を決定. 集合内は黒
+    Color nToColor_DE(size_t n, float dist_px) const;
+
     // ヒストグラム平坦化を用いてnからColorを決定。コントラストが上がる
-    Color nToColor_EqHist(size_t n, std::vector<Float> brightness_table) const;
+    Color nToColor_EqHist(size_t n, const std::vector<double>& brightness_table) const;
 
     // 発散にかかる回数nのヒストグラム
-    std::vector<size_t> nHist() const;
+    std::vector<size_t> nHist(const IterationView& count_vec) const;
 
     // 発散にかかる回数nの累積分布(CDF)
-    std::vector<size_t> nCdf() const;
+    std::vector<size_t> nCdf(const std::vector<size_t>& hist) const;
 
     // 発散にかかる回数 n の勾配のマグニチュードを，makeCountVectorの結果から計算
     std::vector<Float> calcGradMag() const;
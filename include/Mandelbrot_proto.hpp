@@ -1,5 +1,5 @@
-#ifndef MANDELBROT_HPP
-#define MANDELBROT_HPP
+#ifndef MANDELBROT_PROTO_HPP
+#define MANDELBROT_PROTO_HPP
 
 #include <vector>
 #include <cmath>
@@ -10,8 +10,8 @@
 
 // Complex<Float> の形で、複素数型を扱う
 // 実数型 Float と複素数型のテンプレート Complex
-// Float: e.g. double
-// Complex: e.g. std::complex<double>
+// Float: e.g. double, FloatExp (FloatExp.hpp. 1e-308 より小さい値も扱える)
+// Complex: e.g. std::complex<double>, FloatExpComplex<FloatExp>
 template <typename Float, template<typename> class Complex>
 class Mandelbrot {
     public:
@@ -280,7 +280,7 @@ Color Mandelbrot<Float, Complex>::nToColor(int n) const {
     Float left = Float(0.0);
 
     for (size_t i = 0; i < this->palette.size(); i++) {
-        if ((int) (left + step * i) <= n && n <= (int) (left + step * (i + 1))) {
+        if (static_cast<int>(left + step * Float(i)) <= n && n <= static_cast<int>(left + step * Float(i + 1))) {
             return palette.at(i);
         }
     }
@@ -304,4 +304,4 @@ std::vector<Float> Mandelbrot<Float, Complex>::calcGradMag() const {
     return mag;
 }
 
-#endif  // MANDELBROT_HPP
+#endif  // MANDELBROT_PROTO_HPP
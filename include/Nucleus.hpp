@@ -0,0 +1,50 @@
+#ifndef NUCLEUS_HPP
+#define NUCLEUS_HPP
+
+#include <string>
+#include "types.hpp"
+
+// ミニブロ (周期 p の双曲成分) の中心 (nucleus) を探す. z^2 + c の Mandelbrot 集合だけ.
+//
+// 1. 周期: ビューの4隅の c の軌道 z_n を同時に反復し, 4点の多角形が初めて原点を囲む n を周期 p とする
+//    (box period). ビュー内に z_p(c) = 0 の根があれば多角形は原点を囲むので, ビュー内で最も周期の短い
+//    成分の周期が得られる
+// 2. 中心: z_p(c) = 0 をビューの中心から Newton 法で解く (c <- c - z_p / z_p', z' <- 2 z z' + 1).
+//    mpfr で計算するので, double の範囲を超える深さでも収束する
+// 3. 大きさ: 成分の大きさの見積り 1 / |b l^2| (l = Π 2 z_i, b = Σ 1 / l_i, i = 1..p-1).
+//    主カージオイドで 1 になる尺度で, 成分全体を収める描画範囲の幅はおよそ 3 倍
+//
+// 精度は precision (10進の桁数). ビューの幅の桁数より十分大きくすること (RenderJob::resolvePrecision + 10 程度)
+class NucleusLocator {
+    public:
+    struct Result {
+        bool found = false;
+        size_t period = 0;
+        Float re, im;  // 中心
+        Float size;  // 大きさの見積り
+        size_t newton_steps = 0;
+        std::string error;  // found でないときの理由
+    };
+
+    explicit NucleusLocator(size_t precision);
+
+    // 中心 (re, im), 半径 radius (ビューの幅の半分) の正方形の box period. max_period までに見つからなければ 0
+    size_t findPeriod(const Float& re, const Float& im, const Float& radius, size_t max_period) const;
+
+    // (re, im) から周期 period の中心へ Newton 法で収束させる. 収束したら true で, re, im を中心にする
+    bool newton(size_t period, Float& re, Float& im, size_t max_steps, size_t* steps = nullptr) const;
+
+    // 中心 (re, im) の周期 period の成分の大きさの見積り
+    Float atomSize(size_t period, const Float& re, const Float& im) const;
+
+    // findPeriod, newton, atomSize をまとめて行う. 中心が正方形の外 (半径の 2 倍より遠く) に収束したら失敗
+    Result locate(const Float& re, const Float& im, const Float& radius, size_t max_period, size_t max_steps = 64) const;
+
+    size_t getPrecision() const;
+
+
+    private:
+    size_t precision;
+};
+
+#endif  // NUCLEUS_HPP
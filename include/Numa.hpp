@@ -0,0 +1,78 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// スレッドを CPU に固定するときの並べ方
+enum class Pinning {
+    None,     // OS に任せる
+    Compact,  // ソケット 0 の CPU を埋めてから次のソケットへ
+    Scatter   // スレッド i をソケット i % ソケット数 へ
+};
+
+// CPU とソケット (NUMA ノード) の対応. Linux では /sys から読み,
+// 読めなければ全 CPU を1ソケットとみなす
+class Topology {
+    public:
+    // このプロセスが使える CPU の構成 (初回に1度だけ読む)
+    static const Topology& host();
+
+    size_t socketCount() const;
+    size_t cpuCount() const;
+
+    // cpu が属するソケット. 不明な CPU は 0
+    size_t socketOfCpu(int cpu) const;
+
+    // thread 番目のスレッドを置く CPU
+    int cpuForThread(size_t thread, Pinning pinning) const;
+
+    static std::string pinningName(Pinning pinning);
+    static Pinning pinningFromName(const std::string& name);  // 不明なら std::invalid_argument
+
+
+    private:
+    Topology();
+
+    std::vector<std::vector<int>> sockets;  // ソケットごとの CPU 番号 (昇順)
+    std::vector<size_t> cpu_socket;  // CPU 番号 -> ソケット
+};
+
+// 呼び出したスレッドを cpu に固定する. 非対応の環境では false
+bool pinCurrentThread(int cpu);
+
+// 呼び出したスレッドが今動いている CPU. 不明なら -1
+int currentCpu();
+
+// OpenMP のスレッドをソケットごとにまとめ, 画像の行を各ソケットに連続した帯として割り当てる.
+// 同じスレッド配置なら, 初期化 (first touch)・反復・色付けが同じ行を同じソケットで扱う
+class SocketPartition {
+    public:
+    // thread_socket: スレッド番号 -> ソケット. rows 行を align 行単位 (タイルの高さ) で分ける
+    SocketPartition(const std::vector<size_t>& thread_socket, size_t rows, size_t align);
+
+    // スレッドのいるソケットの数 (スレッドのいないソケットには行を割り当てない)
+    size_t groupCount() const;
+
+    size_t groupOfThread(size_t thread) const;
+    size_t socketOfGroup(size_t group) const;
+    size_t threadsInGroup(size_t group) const;
+
+    // グループが受け持つ行 [first, second)
+    std::pair<size_t, size_t> groupRows(size_t group) const;
+
+    // スレッドが受け持つ行 [first, second). グループの行をグループ内の順位で等分する
+    std::pair<size_t, size_t> threadRows(size_t thread) const;
+
+
+    private:
+    std::vector<size_t> group_socket;
+    std::vector<size_t> group_threads;
+    std::vector<size_t> thread_group, thread_rank;
+    std::vector<size_t> group_begin;  // groupCount() + 1 個. 行の境界
+};
+
+#endif  // NUMA_HPP
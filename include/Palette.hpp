@@ -12,6 +12,8 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <stdexcept>
+#include <string>
 
 
 class Palette : public std::vector<Color> {
@@ -47,6 +49,9 @@ class Palette : public std::vector<Color> {
     // dedupe: dedupulication of the same Colors
     void dedupe();
 
+    // rotated: shift 色分回転したパレット. 結果の i 番目は元の (i + shift) 番目. 小数部は隣の色と線形補間
+    Palette rotated(double shift) const;
+
 
     // Sort
 
@@ -74,6 +79,13 @@ class Palette : public std::vector<Color> {
     // makeGrayScale: n 階調のグレイスケールパレット
     static Palette makeGrayScale(size_t n);
 
+    // interpolate: 同じ色数の a と b を色ごとに t (0~1) で線形補間. 色数が違えば std::invalid_argument
+    static Palette interpolate(const Palette& a, const Palette& b, double t);
+
+    // fromSpec: 文字列からパレットを作成. make* の引数を ':' 区切りで並べる
+    //   "gray:n", "hue:n:Hmin:Hmax:S:B", "sat:n:H:Smin:Smax:B", "bri:n:H:S:Bmin:Bmax"
+    static Palette fromSpec(const std::string& spec);
+
 
     // IO operators
     friend std::ostream& operator<<(std::ostream& os, const Palette& palette);
@@ -0,0 +1,89 @@
+#ifndef PRECISION_HPP
+#define PRECISION_HPP
+
+#include <string>
+#include "types.hpp"
+
+// boost (1.74) の mpfr_float / mpc_complex は精度を指定しない一時変数を
+// プロセス全体で共有の default_precision で作り, 精度の違う値どうしの演算では
+// scoped_default_precision がその値を一時的に書き換える. そのため精度の違う描画を
+// 別スレッドで同時に行うと互いの精度を壊す.
+// 描画エンジンの中ではここの関数と mpfr_t / mpc_t を直接使い, 精度は常に明示する.
+
+// 10進の桁数 -> mpfr の bit 数 (boost と同じ換算)
+inline mpfr_prec_t digitsToBits(size_t digits10) {
+    return static_cast<mpfr_prec_t>(boost::multiprecision::detail::digits10_2_2(static_cast<unsigned>(digits10)));
+}
+
+// digits10 桁の Float. 既定精度を読まない
+inline Float makeFloat(const std::string& s, size_t digits10) {
+    return Float(s, static_cast<unsigned>(digits10));
+}
+
+inline Float makeFloat(const Float& x, size_t digits10) {
+    return Float(x, static_cast<unsigned>(digits10));
+}
+
+// Float -> double / long double (最近接に丸める)
+template <typename T>
+inline T toReal(const Float& x) {
+    if constexpr (sizeof(T) > sizeof(double)) {
+        return static_cast<T>(mpfr_get_ld(x.backend().data(), MPFR_RNDN));
+    } else {
+        return static_cast<T>(mpfr_get_d(x.backend().data(), MPFR_RNDN));
+    }
+}
+
+// x を10進の文字列にする. 同じ精度の makeFloat で読み直すと x と全く同じ値になる桁数で出す
+inline std::string toExactString(const Float& x) {
+    mpfr_exp_t exp;
+    char* digits = mpfr_get_str(nullptr, &exp, 10, 0, x.backend().data(), MPFR_RNDN);
+    std::string s(digits);
+    mpfr_free_str(digits);
+    if (!mpfr_number_p(x.backend().data())) return s;  // nan, inf
+    if (mpfr_zero_p(x.backend().data())) return "0";
+    bool negative = !s.empty() && s[0] == '-';
+    if (negative) s.erase(0, 1);
+    // 0.DDDD x 10^exp -> D.DDDe(exp-1)
+    std::string mantissa = s.substr(0, 1) + (s.size() > 1 ? "." + s.substr(1) : "");
+    return (negative ? "-" : "") + mantissa + "e" + std::to_string(static_cast<long>(exp) - 1);
+}
+
+// 精度 bits の mpfr_t. コピー不可
+class MpfrVar {
+    public:
+    explicit MpfrVar(mpfr_prec_t bits) { mpfr_init2(this->v, bits); }
+    ~MpfrVar() { mpfr_clear(this->v); }
+
+    MpfrVar(const MpfrVar&) = delete;
+    MpfrVar& operator=(const MpfrVar&) = delete;
+
+    operator mpfr_ptr() { return this->v; }
+    operator mpfr_srcptr() const { return this->v; }
+
+
+    private:
+    mpfr_t v;
+};
+
+// 精度 bits の mpc_t. コピー不可
+class MpcVar {
+    public:
+    explicit MpcVar(mpfr_prec_t bits) { mpc_init2(this->v, bits); }
+    ~MpcVar() { mpc_clear(this->v); }
+
+    MpcVar(const MpcVar&) = delete;
+    MpcVar& operator=(const MpcVar&) = delete;
+
+    operator mpc_ptr() { return this->v; }
+    operator mpc_srcptr() const { return this->v; }
+
+    mpfr_ptr re() { return mpc_realref(this->v); }
+    mpfr_ptr im() { return mpc_imagref(this->v); }
+
+
+    private:
+    mpc_t v;
+};
+
+#endif  // PRECISION_HPP
@@ -0,0 +1,136 @@
+#ifndef RENDERCOORDINATOR_HPP
+#define RENDERCOORDINATOR_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include "BatchRenderer.hpp"
+#include "RenderJob.hpp"
+
+// 分散描画のコーディネータ (./prg coordinate FILE ...).
+// ジョブファイルの各フレームをタイルに分け, 接続してきた RenderWorker に1タイルずつ渡す.
+// 返ってきた反復回数をフレームに組み立て, そろったフレームから色を付けて保存する.
+// ヒストグラム平坦化はフレーム全体の反復回数で行うので, 1プロセスで描画したときと同じ画像になる.
+//
+// - タイルの座標は画像全体の画素座標 (RenderJob の region) で渡すので, 画素の複素座標は
+//   1プロセスで描画したときと同じ. 座標の値は文字列のまま渡す (mpfr の値を丸めない)
+// - ワーカーが切断したりエラーを返したりしたタイルは他のワーカーに渡し直す.
+//   max_attempts 回失敗したタイルのフレームは失敗
+// - 完了したタイルの所要時間の中央値の slow_factor 倍 (最低 min_slow_s 秒) を超えたタイルは,
+//   手の空いたワーカーにも渡し, 先に返った方を使う (遅いワーカーには cancel を送る)
+// - 同時に組み立てるフレームは max_frames_in_flight 枚まで. 長いズームでもメモリは一定
+//
+// local_workers を指定すると worker_exe worker ADDRESS を子プロセスとして起動するので,
+// 1台でも全体を試せる. 他のマシンのワーカーは TCP のアドレス (HOST:PORT) に接続する.
+class RenderCoordinator {
+    public:
+    struct Options {
+        size_t tile_px = 256;  // タイルの一辺 [px]. 32 の倍数に切り上げる (エンジンのタイルとそろえる)
+        size_t local_workers = 0;
+        std::string worker_exe;  // local_workers を起動する実行ファイル (prg)
+        size_t max_frames_in_flight = 4;
+        size_t max_attempts = 3;
+        double slow_factor = 4.0;
+        double min_slow_s = 5.0;
+    };
+
+    explicit RenderCoordinator(const Options& options);
+    ~RenderCoordinator();
+
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+
+    // address で待ち受けて jobs を描画し, 1フレーム1行の結果を log に出力する. 失敗したフレームの数を返す.
+    // 待ち受けに失敗したら std::runtime_error
+    size_t run(const std::string& address, const std::vector<RenderJob>& jobs, std::ostream& log);
+
+
+    private:
+    using Clock = std::chrono::steady_clock;
+
+    // 組み立て中のフレーム
+    struct Frame {
+        RenderJob job;
+        FrameVector<size_t> counts;
+        FrameVector<float> dist;
+        size_t tiles = 0;
+        size_t remaining = 0;  // 未完了のタイル
+        std::string error;  // 空でなければ失敗
+        Clock::time_point started;
+    };
+
+    // ワーカーに渡す1タイル
+    struct Unit {
+        size_t frame;
+        size_t x0, y0, x1, y1;
+        size_t attempts = 0;
+        std::vector<size_t> running;  // 描画中の接続
+        Clock::time_point started;
+    };
+
+    // ワーカーとの接続. 書き込みは write_mutex を持って行う (cancel は他のスレッドからも送る)
+    struct Connection {
+        size_t id;
+        int fd;
+        std::mutex write_mutex;
+        std::string name;
+        size_t tiles = 0;
+        bool alive = true;
+    };
+
+    Options options;
+    std::vector<RenderJob> jobs;
+
+    std::mutex mutex;  // 以下を保護する
+    std::condition_variable cv;
+    std::map<size_t, Frame> frames;  // ジョブ番号 -> 組み立て中のフレーム
+    size_t next_frame = 0;
+    std::map<uint64_t, Unit> units;  // 未完了のタイル
+    std::deque<uint64_t> pending;  // どのワーカーにも渡していないタイル
+    uint64_t next_unit = 0;
+    std::deque<size_t> completed;  // そろった (か失敗した) フレーム
+    std::vector<double> unit_seconds;  // 完了したタイルの所要時間
+    size_t reassigned = 0, duplicated = 0;
+    bool finished = false;
+    int listen_fd = -1;
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<std::thread> threads;
+    std::vector<pid_t> children;
+
+    // 接続を受け付けて connectionLoop のスレッドを起動する
+    void acceptLoop();
+    void connectionLoop(Connection& conn);
+
+    // conn に渡す次のタイルとジョブの行, 結果の画素数と距離推定の有無. なければ待つ. 全て終わったら false
+    bool nextUnit(Connection& conn, uint64_t& id, std::string& line, size_t& pixels, bool& distance);
+
+    // 次のフレームをタイルに分けて pending に入れる. mutex を持って呼ぶ
+    void admitFrame();
+
+    // タイルの結果 (RenderWorker の形式) をフレームに書き込む. 大きさが合わなければ false
+    bool deliver(Connection& conn, uint64_t id, double seconds, const std::vector<uint8_t>& payload, bool distance);
+
+    // conn でのタイルの描画が失敗した. 他のワーカーに渡し直すか, フレームを失敗にする
+    void fail(Connection& conn, uint64_t id, const std::string& error);
+
+    // フレームを失敗にする. mutex を持って呼ぶ
+    void failFrame(size_t frame, const std::string& error);
+
+    void spawnLocalWorkers(const std::string& address);
+
+    // 起動した子プロセスが1つでも動いていれば true (終了したものは回収する)
+    bool localWorkersAlive();
+
+    void shutdown();
+};
+
+#endif  // RENDERCOORDINATOR_HPP
@@ -0,0 +1,98 @@
+#ifndef RENDERJOB_HPP
+#define RENDERJOB_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Mandelbrot.hpp"
+
+// 1枚分の描画の指定. 複素平面上の値は mpfr で正確に扱えるよう文字列のまま持つ.
+// "key=value" の並び (キー名は Mandelbrot のメンバ名と同じ) と相互に変換できる.
+//
+//   re_target, im_target, width_target, height_target  描画範囲 (height_target は省略可)
+//   width_px, height_px   出力画像の解像度
+//   precision             mpfr の10進の桁数. "auto" なら画素間隔から決める
+//   mandel_count_max      発散回数の上限
+//   palette               Palette::fromSpec の書式
+//   eq_hist               ヒストグラム平坦化 (true / false)
+//   fused                 反復と色付けをタイルごとにまとめて行い, 反復回数の画像を作らない (true / false).
+//                         eq_hist のときは縮小した試し描きのヒストグラムで近似する. distance, cycle_frames では無視
+//   backend               auto, double, long_double, mpfr, double_compact
+//   formula, degree       mandelbrot, julia と z^degree + c の次数
+//   julia_re, julia_im    Julia 集合のパラメタ c
+//   expression            空でなければ z^degree + c の代わりの反復式 (FormulaJit.hpp. 例: "abs(z)^2+c").
+//                         テキストのジョブファイルでは空白を含めないこと
+//   distance              距離推定で色を付ける (true / false)
+//   disk_fill             distance のとき, 境界のない円を計算せずに埋める (true / false)
+//   region                "x0,y0,x1,y1": 画像の一部 [x0, x1) x [y0, y1) だけを描画する (Mandelbrot::setRegion).
+//                         空なら画像全体. RenderCoordinator がタイルをワーカーに渡すのに使う
+//   cycle_frames          0 より大きければ, 1回計算した反復回数からパレットを回転させた cycle_frames 枚を出力する
+//   cycle_shift           最後のフレームまでに回転する色数 (小数可). "auto" ならパレットの色数 (1周),
+//                         cycle_palette があれば 0
+//   cycle_palette         指定すると, palette からこのパレット (同じ色数) へ色を補間しながら変える.
+//                         繰り返し再生して切れ目がないのは, cycle_palette がなく, cycle_shift が "auto"
+//                         またはパレットの色数の整数倍のときだけ (最後のフレームの次が最初のフレームに戻る)
+//   counts_output         空でなければ, 反復回数を IterationField::save (差分 + zlib) でこのファイルに保存する
+//   counts_input          空でなければ, 反復計算の代わりに counts_output で保存した反復回数を読み込む.
+//                         同じビューのジョブで保存したものを使うこと (大きさと mandel_count_max だけを確かめる).
+//                         counts_output / counts_input は prg batch だけで使え, distance では使えない
+//   output                出力 PNG のパス. cycle_frames のときは "name_0000.png" の連番,
+//                         ".rgb" で終われば全フレームの rgb24 をこのファイル (FIFO でもよい) に続けて書く
+struct RenderJob {
+    std::string re_target = "-0.5";
+    std::string im_target = "0.0";
+    std::string width_target = "3.0";
+    std::string height_target;  // 空なら width_target * height_px / width_px
+    size_t width_px = 512;
+    size_t height_px = 512;
+    std::string precision = "auto";
+    size_t mandel_count_max = 300;
+    std::string palette = "hue:256:0:360:1.0:0.9";
+    bool eq_hist = true;
+    bool fused = false;
+    Backend backend = Backend::Auto;
+    Formula formula = Formula::Mandelbrot;
+    unsigned degree = 2;
+    std::string julia_re = "0.0";
+    std::string julia_im = "0.0";
+    std::string expression;
+    bool distance = false;
+    bool disk_fill = true;
+    bool has_region = false;
+    size_t region_x0 = 0, region_y0 = 0, region_x1 = 0, region_y1 = 0;
+    size_t cycle_frames = 0;
+    std::string cycle_shift = "auto";
+    std::string cycle_palette;
+    std::string counts_output;
+    std::string counts_input;
+    std::string output;
+
+    // key に value を設定する. 不明なキーや不正な値では std::invalid_argument
+    void set(const std::string& key, const std::string& value);
+
+    // "key=value key=value ..." を順に set する
+    void setFromLine(const std::string& line);
+
+    // 全てのキーを "key=value" の1行にする. setFromLine で元に戻せる
+    std::string toLine() const;
+
+    // cycle_shift を色数に解決する (palette_size はパレットの色数)
+    double resolveCycleShift(size_t palette_size) const;
+
+    // precision を10進の桁数に解決する ("auto" なら画素間隔 + 余裕 10 桁)
+    size_t resolvePrecision() const;
+
+    // 精度・解像度・描画範囲・上限回数・数値型・反復式を engine に設定する. パレットは呼び出し側で設定する
+    void apply(Mandelbrot& engine) const;
+};
+
+// ジョブファイルを読む. 先頭が '{' か '[' なら JSON, それ以外はテキスト.
+//
+// テキスト: 1行1ジョブで "key=value" を空白区切りで並べる. '#' 以降はコメント.
+//           "defaults key=value ..." の行は以降のジョブの既定値を変える.
+// JSON:     {"defaults": {...}, "jobs": [{...}, ...]} またはジョブの配列.
+//
+// 書式の誤りは行番号 (JSON ではジョブ番号) 付きの std::invalid_argument
+std::vector<RenderJob> readJobFile(const std::string& filename);
+
+#endif  // RENDERJOB_HPP
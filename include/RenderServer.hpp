@@ -0,0 +1,108 @@
+#ifndef RENDERSERVER_HPP
+#define RENDERSERVER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BatchRenderer.hpp"
+#include "CountCache.hpp"
+#include "RenderJob.hpp"
+
+// Unix ドメインソケットで描画要求を受け付ける常駐サーバ (./prg serve SOCKET).
+//
+// プロトコルは1行1要求のテキストで, 応答も1行. 応答は要求を受け取った順に返す.
+//   render [priority=interactive|batch] [session=NAME] [id=ID] key=value ...
+//       key=value は RenderJob と同じ. output に PNG を保存する.
+//       -> "ok id=ID output=PATH backend=B cached=true|false seconds=S"
+//          "cancelled id=ID"  (同じ session の新しい要求に置き換えられた)
+//          "error id=ID MESSAGE"
+//   stats    -> "ok queued=N cache=N hits=N misses=N cancelled=N"
+//   shutdown -> "ok" を返してサーバを止める
+//
+// 描画は1本のワーカースレッドが1つの BatchRenderer で行う (キャッシュと優先度の管理を単純にするため.
+// エンジンの精度はインスタンスごとなので, ワーカーを増やしても精度は混ざらない).
+// interactive の要求は batch より先に, 同じ優先度なら到着順に処理する.
+// session を付けた要求は, 同じ session の待機中・描画中の要求を中止させる (描画中ならタイル単位で止まる).
+// 色付けと出力先だけが違う要求は CountCache の反復回数から色を付け直す. キャッシュにない要求でも,
+// 前回の描画を画素単位で平行移動しただけなら, 重なる部分は前回の反復回数を使い回す.
+//
+// 例: echo "render session=v1 re_target=-0.5 width_target=3 output=/tmp/a.png" | socat - UNIX-CONNECT:/tmp/mandel.sock
+class RenderServer {
+    public:
+    enum class Priority { Interactive = 0, Batch = 1 };
+
+    explicit RenderServer(size_t cache_capacity = 32);
+    ~RenderServer();
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    // socket_path で待ち受ける. stop() か shutdown を受け取るまで戻らない. 待ち受けに失敗したら false
+    bool serve(const std::string& socket_path);
+
+    // 待ち受けと全ての接続を閉じる. 待機中の要求は中止扱いになる
+    void stop();
+
+    // 1行の要求を処理して応答行を返す (改行は含まない). 描画が終わるまで待つ
+    std::string handle(const std::string& line);
+
+
+    private:
+    struct Request {
+        RenderJob job;
+        Priority priority;
+        std::string session;
+        std::string id;
+        uint64_t seq;
+        std::atomic<bool> cancel{false};
+        std::promise<std::string> reply;
+    };
+    using RequestPtr = std::shared_ptr<Request>;
+
+    // 接続ごとの記録. 接続のスレッドが終わるときに fd を閉じて finished にし, 次の accept で join して消す
+    struct Client {
+        int fd;
+        bool finished = false;
+        std::thread thread;
+    };
+
+    // 要求 line を解析してキューに入れ, 応答の future を返す. render 以外はすぐに応答が決まる
+    std::future<std::string> submit(const std::string& line);
+
+    // ワーカースレッド: キューから優先度順に取り出して描画する
+    void workerLoop();
+    std::string render(Request& request);
+
+    // 1つの接続を処理する. 要求の読み込みと応答の書き込みを別スレッドで行う
+    void connectionLoop(int fd);
+
+    // 接続のスレッドの本体. connectionLoop が戻ったら fd を閉じて client を finished にする
+    void runClient(Client* client);
+
+    BatchRenderer renderer;  // ワーカースレッドだけが使う
+    FrameVector<size_t> dist_counts;  // distance の要求用 (ワーカースレッドだけが使う)
+    FrameVector<float> dist_vec;
+    PannedCounts pan;  // 前回キャッシュに入れた描画 (ワーカースレッドだけが使う)
+
+    std::mutex mutex;  // 以下を保護する
+    CountCache cache;
+    std::condition_variable queue_cv;
+    std::vector<RequestPtr> queue;  // 待機中の要求
+    RequestPtr running;  // 描画中の要求
+    uint64_t next_seq = 0;
+    size_t cancelled = 0;
+    bool stopping = false;
+    int listen_fd = -1;
+    std::list<Client> clients;  // スレッドは自分の要素を指すので, アドレスの変わらない list に置く
+
+    std::thread worker;
+};
+
+#endif  // RENDERSERVER_HPP
@@ -0,0 +1,55 @@
+#ifndef RENDERWORKER_HPP
+#define RENDERWORKER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Mandelbrot.hpp"
+#include "RenderJob.hpp"
+
+// 分散描画のワーカー (./prg worker ADDRESS). RenderCoordinator に接続し,
+// 受け取ったジョブ (region 付きの RenderJob) の反復回数を計算して返す.
+//
+// プロトコル (1行のテキスト + 必要ならバイナリ):
+//   worker -> "hello pid=PID threads=N"
+//   coord  -> "job id=ID key=value ..."     RenderJob の toLine と同じ. 座標は文字列のまま (正確な値)
+//   worker -> "result id=ID pixels=N distance=0|1 seconds=S" の後に
+//             反復回数 N 個 (uint32, リトルエンディアン) と, distance=1 なら距離 N 個 (float32 のビット列)
+//             "cancelled id=ID" / "error id=ID MESSAGE"
+//   coord  -> "cancel id=ID"   (他のワーカーが先に終えた) / "quit"
+class RenderWorker {
+    public:
+    RenderWorker() = default;
+
+    // address に接続し, quit を受け取るか接続が切れるまでジョブを処理する. 接続できなければ false
+    bool run(const std::string& address);
+
+    // 反復回数・距離を送る形式にする (RenderCoordinator と共通)
+    static void encodeCounts(const FrameVector<size_t>& counts, std::vector<uint8_t>& out);
+    static void encodeDistances(const FrameVector<float>& dist, std::vector<uint8_t>& out);
+    static uint32_t decodeU32(const uint8_t* p);
+
+
+    private:
+    Mandelbrot engine;  // 描画スレッドだけが使う
+    FrameVector<size_t> count_vec;
+    FrameVector<float> dist_vec;
+    std::vector<uint8_t> payload;
+
+    std::mutex mutex;  // 以下を保護する
+    std::condition_variable cv;
+    std::string pending;  // 受け取ったまま描画していないジョブの行
+    std::string running_id;  // 描画中のジョブ
+    std::string cancelled_id;  // 描画を始める前に cancel されたジョブ (描画せずに cancelled を返す)
+    std::atomic<bool> cancel{false};
+    bool quitting = false;
+
+    // 描画スレッド: pending のジョブを順に描画して応答する. 書き込むのはこのスレッドだけ
+    void renderLoop(int fd);
+    std::string render(const std::string& id, const std::string& line, int fd);
+};
+
+#endif  // RENDERWORKER_HPP
@@ -0,0 +1,42 @@
+#ifndef SOCKET_HPP
+#define SOCKET_HPP
+
+#include <cstddef>
+#include <string>
+
+// RenderServer, RenderCoordinator, RenderWorker が使うソケットの小さなラッパ.
+// アドレスは '/' を含めば Unix ドメインソケットのパス, それ以外は "HOST:PORT" の TCP.
+
+// address で待ち受ける. 失敗したら -1. Unix ソケットの古いファイルは消してから bind する
+int listenSocket(const std::string& address, int backlog = 16);
+
+// address に接続する. 失敗したら -1
+int connectSocket(const std::string& address);
+
+// fd に data の size バイトを全て書き込む. 相手が切断していたら false
+bool writeAll(int fd, const void* data, size_t size);
+
+// fd に line と改行を書き込む. line の中の改行は空白にする. 相手が切断していたら false
+bool writeLine(int fd, const std::string& line);
+
+// 行とバイナリを混ぜて読む. 読み過ぎた分は次の読み込みに回す
+class SocketReader {
+    public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    // 改行までを line に読む (改行と末尾の '\r' は含まない). 切断されたら false
+    bool readLine(std::string& line);
+
+    // ちょうど size バイトを読む. 途中で切断されたら false
+    bool readBytes(void* data, size_t size);
+
+
+    private:
+    int fd;
+    std::string buffer;
+
+    // buffer に追加で読む. 切断されたら false
+    bool fill();
+};
+
+#endif  // SOCKET_HPP
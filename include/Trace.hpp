@@ -0,0 +1,134 @@
+// Trace.hpp
+// 描画ステージの計測. MANDEL_TRACE を定義したときだけ有効になり,
+// 定義しなければ MANDEL_TRACE_* マクロは空になって計測コードは残らない.
+//
+// - ステージ (makeCountVector, histogram, color, savePNG) とタイルごとの時間
+// - タイル・フレームごとの反復回数
+// - Linux では環境変数 MANDEL_TRACE_PERF=1 で perf_event_open のカウンタ
+//   (cycles, instructions, cache-misses) も記録する
+// 結果は Chrome trace / Perfetto の JSON と, フレームごとの1行サマリで出力する.
+
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+
+#ifdef MANDEL_TRACE
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace trace {
+
+// perf_event_open で読むハードウェアカウンタ
+struct PerfSample {
+    bool valid = false;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0;
+};
+
+// 1区間の記録 (Chrome trace の complete event "X")
+struct Event {
+    const char* name;  // 文字列リテラルのみ
+    int tid;
+    int64_t begin_ns, end_ns;
+    int64_t x, y;  // タイルの左上座標. タイル以外は -1
+    uint64_t iterations;
+    uint64_t max_count;
+    PerfSample perf;
+};
+
+// スレッドごとのイベントバッファ. 書き込むのは持ち主のスレッドだけ
+struct ThreadBuffer {
+    int tid;
+    std::vector<Event> events;
+    size_t frame_begin = 0;  // 現在のフレームの最初のイベント
+};
+
+class Recorder {
+    public:
+    static Recorder& instance();
+
+    // 呼び出したスレッドのバッファ
+    ThreadBuffer& threadBuffer();
+
+    // 現在時刻 [ns] (記録開始からの経過時間)
+    int64_t now() const;
+
+    // 呼び出したスレッドのカウンタ値. 無効なら valid = false
+    PerfSample readPerf();
+
+    void beginFrame(size_t frame);
+
+    // フレームのサマリを1行で os に出力する
+    void endFrame(size_t frame, size_t pixels, std::ostream& os);
+
+    // 記録済みの全イベントを Chrome trace 形式で保存
+    bool writeChromeTrace(const std::string& filename) const;
+
+
+    private:
+    Recorder();
+
+    int64_t origin_ns;
+    bool perf_enabled;
+    int64_t frame_begin_ns = 0;
+    mutable std::mutex mutex;  // buffers の登録と読み出し用
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+};
+
+// スコープの開始から終了までを1イベントとして記録する
+class Scope {
+    public:
+    explicit Scope(const char* name, int64_t x = -1, int64_t y = -1);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    // count_buf (1行 stride 画素) の [x0, x1) x [y0, y1) の反復回数を加える
+    void addCounts(const size_t* count_buf, size_t stride, size_t x0, size_t y0, size_t x1, size_t y1) {
+        for (size_t y = y0; y < y1; y++) {
+            for (size_t x = x0; x < x1; x++) {
+                size_t n = count_buf[y * stride + x];
+                this->event.iterations += n;
+                if (n > this->event.max_count) this->event.max_count = n;
+            }
+        }
+    }
+
+
+    private:
+    Event event;
+};
+
+}  // namespace trace
+
+
+#define MANDEL_TRACE_CONCAT_(a, b) a##b
+#define MANDEL_TRACE_CONCAT(a, b) MANDEL_TRACE_CONCAT_(a, b)
+#define MANDEL_TRACE_SCOPE(name) trace::Scope MANDEL_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define MANDEL_TRACE_TILE(var, x, y) trace::Scope var("tile", (x), (y))
+#define MANDEL_TRACE_COUNTS(var, buf, stride, x0, y0, x1, y1) (var).addCounts((buf), (stride), (x0), (y0), (x1), (y1))
+#define MANDEL_TRACE_FRAME_BEGIN(frame) trace::Recorder::instance().beginFrame(frame)
+#define MANDEL_TRACE_FRAME_END(frame, pixels) trace::Recorder::instance().endFrame((frame), (pixels), std::cout)
+#define MANDEL_TRACE_WRITE(filename) trace::Recorder::instance().writeChromeTrace(filename)
+
+#else
+
+#define MANDEL_TRACE_SCOPE(name) ((void)0)
+#define MANDEL_TRACE_TILE(var, x, y) ((void)0)
+#define MANDEL_TRACE_COUNTS(var, buf, stride, x0, y0, x1, y1) ((void)0)
+#define MANDEL_TRACE_FRAME_BEGIN(frame) ((void)0)
+#define MANDEL_TRACE_FRAME_END(frame, pixels) ((void)0)
+#define MANDEL_TRACE_WRITE(filename) ((void)0)
+
+#endif  // MANDEL_TRACE
+
+#endif  // TRACE_HPP
@@ -0,0 +1,39 @@
+#ifndef ZOOMCHECKPOINT_HPP
+#define ZOOMCHECKPOINT_HPP
+
+#include <string>
+
+// ズームアニメーション (main.cpp) の途中経過. 1行1項目の "key=value" で保存する.
+// 複素平面上の値は toExactString の文字列で持つので, 読み直しても mpfr の値は変わらない.
+//
+//   next_frame     次に描画するフレーム. これより前のフレームは保存済み
+//   width_target, height_target, mandel_count_max   next_frame のフレームのパラメタ
+//   それ以外       アニメーション全体の設定. 再開時に一致しなければチェックポイントを使わない
+//
+// 再開時の検証用で, ズームのパラメタは毎回フレーム 0 から同じ漸化式で計算し直す
+// (漸化式の計算は描画に比べて無視できる). 参照軌道などのキャッシュはこのツリーにはないので持たない
+struct ZoomCheckpoint {
+    size_t next_frame = 0;
+    size_t frames = 0;
+    size_t precision = 0;
+    size_t width_px = 0, height_px = 0;
+    std::string re_target, im_target;
+    std::string width_target_init;
+    std::string scale;
+    size_t mandel_count_max_init = 0;
+    std::string palette;  // パレットを区別する文字列 (変わっていれば再開しない)
+
+    std::string width_target, height_target;
+    size_t mandel_count_max = 0;
+
+    // filename を読む. ファイルがないか壊れていれば false
+    bool load(const std::string& filename);
+
+    // filename + ".tmp" に書いてから rename する (writeFileAtomic). 失敗したら false
+    bool save(const std::string& filename) const;
+
+    // 同じアニメーションの設定なら true (next_frame とフレームのパラメタは比べない)
+    bool sameRun(const ZoomCheckpoint& other) const;
+};
+
+#endif  // ZOOMCHECKPOINT_HPP
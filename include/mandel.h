@@ -0,0 +1,122 @@
+#ifndef MANDEL_H
+#define MANDEL_H
+
+// libmandel の C API. 描画エンジン (Mandelbrot) を他のプログラムから直接呼ぶためのもの.
+//
+// - 状態は全て mandel_renderer に持つ. ライブラリ全体の状態はないので, 別々の mandel_renderer なら
+//   複数のスレッドから同時に描画できる. 1つの mandel_renderer を他のスレッドから使ってよいのは
+//   mandel_cancel, mandel_progress, mandel_finished だけ
+// - 描画結果は呼び出し側のバッファ (1行 stride) に直接書き込む. ライブラリは画像全体のコピーを返さない
+// - 失敗した関数は mandel_status を返し, 説明は mandel_last_error で読める. C++ の例外は外に出さない
+//
+// ビューの設定は RenderJob (RenderJob.hpp) と同じ "key=value" のキーで行う (mandel_set).
+// 複素平面上の値は文字列のまま渡すので, mpfr の精度で正確に指定できる.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define MANDEL_API __declspec(dllexport)
+#else
+#define MANDEL_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ヘッダとライブラリの互換性の確認用. 互換性のない変更で上げる
+#define MANDEL_API_VERSION 1
+
+typedef struct mandel_renderer mandel_renderer;
+
+typedef enum {
+    MANDEL_OK = 0,
+    MANDEL_ERROR_INVALID_ARGUMENT = 1,  // 不明なキー, 不正な値, NULL, 小さすぎる stride
+    MANDEL_ERROR_CANCELLED = 2,         // mandel_cancel で中止した. バッファの内容は不完全
+    MANDEL_ERROR_OUT_OF_MEMORY = 3,
+    MANDEL_ERROR_INTERNAL = 4
+} mandel_status;
+
+// 直前の描画の集計
+typedef struct {
+    double seconds;         // 描画にかかった時間 (色付けを含む)
+    uint64_t iterations;    // 全画素の反復回数の合計
+    uint64_t pixels;
+    uint64_t tiles;
+    size_t precision;       // mpfr の10進の桁数
+    const char* backend;    // 実際に使った数値型 ("double", "long_double", "mpfr", "double_compact")
+} mandel_stats;
+
+// ライブラリの MANDEL_API_VERSION
+MANDEL_API int mandel_api_version(void);
+
+// 描画の状態を作る. 失敗したら NULL
+MANDEL_API mandel_renderer* mandel_create(void);
+MANDEL_API void mandel_destroy(mandel_renderer* r);
+
+// RenderJob のキー (re_target, width_px, mandel_count_max, palette, backend, formula, region, ...) を設定する.
+// output と cycle_* は使わない
+MANDEL_API mandel_status mandel_set(mandel_renderer* r, const char* key, const char* value);
+
+// よく使う設定をまとめて行う. height は NULL なら width * height_px / width_px
+MANDEL_API mandel_status mandel_set_view(mandel_renderer* r, const char* re, const char* im,
+                                         const char* width, const char* height,
+                                         size_t width_px, size_t height_px);
+
+// 描画に使う OpenMP のスレッド数. 0 なら呼び出したスレッドの既定値
+MANDEL_API mandel_status mandel_set_threads(mandel_renderer* r, int threads);
+
+// enable が 0 でなければ, 前の描画の反復回数 (1画素 8 byte) を r に残し, 次の描画のビューが画素単位の平行移動だけなら
+// 新しく見えた帯だけを計算する (ドラッグ中の再描画用). mandel_render_counts と, distance でない mandel_render_rgb で使う.
+// mandel_stats の pixels と iterations は計算した帯の分だけになる. 既定は 0
+MANDEL_API mandel_status mandel_set_pan_reuse(mandel_renderer* r, int enable);
+
+// 出力バッファの大きさ (region を指定したときは領域の大きさ)
+MANDEL_API size_t mandel_output_width(const mandel_renderer* r);
+MANDEL_API size_t mandel_output_height(const mandel_renderer* r);
+
+// 反復回数を counts に書き込む. 画素 (x, y) は counts[y * stride + x] (stride は要素数, 幅以上).
+// 集合内の画素は mandel_count_max
+MANDEL_API mandel_status mandel_render_counts(mandel_renderer* r, uint32_t* counts, size_t stride);
+
+// palette, eq_hist (distance なら距離推定) で色を付けて rgb に書き込む.
+// 画素 (x, y) の R, G, B は rgb[y * stride + 3 * x + 0..2] (stride はバイト数, 幅 * 3 以上)
+MANDEL_API mandel_status mandel_render_rgb(mandel_renderer* r, uint8_t* rgb, size_t stride);
+
+// タイルが完了するたびに描画中のスレッドから呼ばれる関数. counts は mandel_render_counts_async に渡したバッファの
+// タイルの左上 (x0, y0) を指し, stride はそのバッファの stride. 複数のスレッドから同時に呼ばれることがある
+typedef void (*mandel_tile_callback)(void* user, size_t x0, size_t y0, size_t width, size_t height,
+                                     const uint32_t* counts, size_t stride);
+
+// mandel_render_counts を別スレッドで始めてすぐに返る. 完了したタイルから callback (NULL でもよい) に渡す.
+// counts は mandel_wait が返るまで有効にしておくこと. 描画中に r の設定を変えても, この描画には影響しない
+MANDEL_API mandel_status mandel_render_counts_async(mandel_renderer* r, uint32_t* counts, size_t stride,
+                                                    mandel_tile_callback callback, void* user);
+
+// 非同期の描画が終わるのを待つ. 全て計算したら MANDEL_OK, 中止したら MANDEL_ERROR_CANCELLED.
+// 非同期の描画がなければ MANDEL_OK
+MANDEL_API mandel_status mandel_wait(mandel_renderer* r);
+
+// 非同期の描画の進み具合 (完了したタイルの割合, 0.0 ~ 1.0). 描画していなければ 1.0
+MANDEL_API double mandel_progress(const mandel_renderer* r);
+
+// 非同期の描画が終わっていれば (中止を含む) 1
+MANDEL_API int mandel_finished(const mandel_renderer* r);
+
+// 描画中の r を中止する. 他のスレッドから呼んでよい. 次の描画の開始時に解除される
+MANDEL_API void mandel_cancel(mandel_renderer* r);
+
+// 直前の描画の集計 (非同期の描画は mandel_wait の後). 文字列は r が次に描画するまで有効
+MANDEL_API mandel_status mandel_get_stats(const mandel_renderer* r, mandel_stats* stats);
+
+// 直前に失敗した関数のエラーの説明 (なければ ""). r が NULL なら ""
+MANDEL_API const char* mandel_last_error(const mandel_renderer* r);
+
+MANDEL_API const char* mandel_status_string(mandel_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MANDEL_H
@@ -1,11 +1,32 @@
+#ifndef UTIL_HPP
+#define UTIL_HPP
+
 #include <iostream>
+#include <string>
+#include <vector>
 #include <omp.h>
 #include <png.h>
 #include "Color.hpp"
+#include "FrameBuffer.hpp"
 
 void omp_info();
 
-bool savePNG(const std::string& filename, const std::vector<Color>& img, size_t width_px, size_t height_px);
+bool savePNG(const std::string& filename, const FrameVector<Color>& img, size_t width_px, size_t height_px);
+
+// savePNG と同じ. filename + ".tmp" に書いて fsync してから rename するので, 途中で止まっても壊れた filename は残らない.
+// 失敗したら .tmp は消す. ディスクへの同期を待つので, 再開のために残す連番 (zoom のフレーム) だけに使う
+bool savePNGAtomic(const std::string& filename, const FrameVector<Color>& img, size_t width_px, size_t height_px);
+
+// filename が最後まで読める width_px x height_px の PNG なら true
+bool verifyPNG(const std::string& filename, size_t width_px, size_t height_px);
+
+// data を filename + ".tmp" に書いて fsync してから filename に rename する
+bool writeFileAtomic(const std::string& filename, const std::string& data);
+
+// s を delim で分割する. 空の要素は捨てる
+std::vector<std::string> splitString(const std::string& s, char delim);
 
 // ffmpeg -framerate 30 -i output%d.png -c:v libx264 -pix_fmt yuv420p output.mp4
-//bool makeMP4(const std::string& filename, )
\ No newline at end of file
+//bool makeMP4(const std::string& filename, )
+
+#endif  // UTIL_HPP
@@ -0,0 +1,90 @@
+#include "AsyncRender.hpp"
+#include <algorithm>
+#include <omp.h>
+
+
+AsyncRender::AsyncRender(const Mandelbrot& engine, TileSink on_tile, bool queue_tiles, int threads)
+    : engine(engine), on_tile(std::move(on_tile)), queue_tiles(queue_tiles), threads(threads), tile_count(engine.tileCount()) {
+    if (this->queue_tiles) this->slots = std::make_unique<Slot[]>(this->tile_count);
+    this->future = this->promise.get_future().share();
+    this->thread = std::thread(&AsyncRender::run, this);
+}
+
+AsyncRender::~AsyncRender() {
+    this->cancel();
+    if (this->thread.joinable()) this->thread.join();
+}
+
+void AsyncRender::run() {
+    if (this->threads > 0) omp_set_num_threads(this->threads);  // このスレッドの並列領域のスレッド数
+    TileSink sink = [this](size_t x0, size_t y0, size_t w, size_t h, const size_t* counts, size_t stride) {
+        if (this->on_tile) this->on_tile(x0, y0, w, h, counts, stride);
+        if (this->queue_tiles) {
+            Slot& slot = this->slots[this->tail.fetch_add(1, std::memory_order_relaxed)];
+            slot.tile.x0 = x0;
+            slot.tile.y0 = y0;
+            slot.tile.width = w;
+            slot.tile.height = h;
+            slot.tile.counts.resize(w * h);
+            for (size_t y = 0; y < h; y++) {
+                std::copy(counts + y * stride, counts + y * stride + w, slot.tile.counts.begin() + y * w);
+            }
+            slot.ready.store(true, std::memory_order_release);
+        }
+        this->done.fetch_add(1, std::memory_order_release);
+    };
+
+    try {
+        bool complete = this->engine.makeCountTiles(sink, &this->cancelled);
+        this->running.store(false, std::memory_order_release);
+        this->promise.set_value(complete);
+    } catch (...) {
+        this->running.store(false, std::memory_order_release);
+        this->promise.set_exception(std::current_exception());
+    }
+}
+
+bool AsyncRender::tryPop(Tile& tile) {
+    if (!this->queue_tiles || this->head >= this->tile_count) return false;
+    Slot& slot = this->slots[this->head];
+    if (!slot.ready.load(std::memory_order_acquire)) return false;
+    tile = std::move(slot.tile);
+    this->head++;
+    return true;
+}
+
+void AsyncRender::cancel() {
+    this->cancelled.store(true);
+}
+
+bool AsyncRender::isCancelled() const {
+    return this->cancelled.load();
+}
+
+size_t AsyncRender::tilesDone() const {
+    return this->done.load(std::memory_order_acquire);
+}
+
+size_t AsyncRender::tileCount() const {
+    return this->tile_count;
+}
+
+double AsyncRender::progress() const {
+    return this->tile_count ? static_cast<double>(this->tilesDone()) / this->tile_count : 1.0;
+}
+
+bool AsyncRender::finished() const {
+    return !this->running.load(std::memory_order_acquire);
+}
+
+bool AsyncRender::wait() {
+    return this->future.get();
+}
+
+std::shared_future<bool> AsyncRender::getFuture() const {
+    return this->future;
+}
+
+const Mandelbrot& AsyncRender::getEngine() const {
+    return this->engine;
+}
@@ -0,0 +1,212 @@
+#include "BatchRenderer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <tuple>
+#include "util.hpp"
+
+
+namespace {
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// "dir/name.png" の k 番目のフレーム "dir/name_0000.png"
+std::string cycleFrameName(const std::string& output, size_t k) {
+    size_t slash = output.find_last_of('/');
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = output.size();
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "_%04zu", k);
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+// 画素を rgb24 (1画素 3 byte) で os に書く
+bool writeRGB(std::ostream& os, const FrameVector<Color>& img) {
+    std::vector<char> row;
+    row.reserve(3 * 4096);
+    for (size_t i = 0; i < img.size(); i += 4096) {
+        size_t n = std::min<size_t>(4096, img.size() - i);
+        row.resize(3 * n);
+        for (size_t j = 0; j < n; j++) {
+            row[3 * j] = static_cast<char>(img[i + j][0]);
+            row[3 * j + 1] = static_cast<char>(img[i + j][1]);
+            row[3 * j + 2] = static_cast<char>(img[i + j][2]);
+        }
+        os.write(row.data(), row.size());
+    }
+    os.flush();
+    return static_cast<bool>(os);
+}
+
+}  // namespace
+
+
+void BatchRenderer::sortJobs(std::vector<RenderJob>& jobs) {
+    std::vector<size_t> precs(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) precs[i] = jobs[i].resolvePrecision();
+
+    std::vector<size_t> order(jobs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        const RenderJob& ja = jobs[a];
+        const RenderJob& jb = jobs[b];
+        return std::make_tuple(precs[a], std::cref(ja.palette), ja.width_px, ja.height_px, ja.mandel_count_max, ja.backend)
+             < std::make_tuple(precs[b], std::cref(jb.palette), jb.width_px, jb.height_px, jb.mandel_count_max, jb.backend);
+    });
+
+    std::vector<RenderJob> sorted;
+    sorted.reserve(jobs.size());
+    for (size_t i : order) sorted.push_back(std::move(jobs[i]));
+    jobs.swap(sorted);
+}
+
+size_t BatchRenderer::run(std::vector<RenderJob> jobs, std::ostream& log) {
+    sortJobs(jobs);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const RenderJob& job = jobs[i];
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = false;
+        std::string error;
+        try {
+            ok = this->render(job);
+            if (!ok) error = "Failed to save PNG";
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        log << "[" << i + 1 << "/" << jobs.size() << "] " << job.output << ": ";
+        if (ok) {
+            log << seconds << " s (" << Mandelbrot::backendName(this->engine.resolveBackend())
+                << ", precision " << this->engine.getPrecision() << ")" << std::endl;
+        } else {
+            log << "FAILED: " << error << std::endl;
+            failed++;
+        }
+    }
+    return failed;
+}
+
+bool BatchRenderer::render(const RenderJob& job) {
+    if (job.output.empty()) throw std::invalid_argument("output is not set");
+
+    job.apply(this->engine);
+    bool counts_file = !job.counts_output.empty() || !job.counts_input.empty();
+    if (job.distance) {
+        if (counts_file) throw std::invalid_argument("counts_output / counts_input are not supported with distance");
+        this->engine.makeDistanceVector(this->count_vec, this->dist_vec, job.disk_fill);
+        return this->colorize(job, this->count_vec, this->dist_vec);
+    }
+    if (job.fused && job.cycle_frames == 0 && !counts_file) {
+        // 反復回数の画像を作らず, タイルごとに色を付けて color_vec に書き込む
+        this->applyPalette(job);
+        std::vector<double> brightness_table;
+        if (job.eq_hist) brightness_table = this->engine.makeSampledBrightnessTable();
+        this->engine.makeColorTiles(this->engine.makeColorTable(brightness_table, job.eq_hist), this->color_vec);
+        return savePNG(job.output, this->color_vec, this->engine.regionWidth(), this->engine.regionHeight());
+    }
+    if (job.counts_input.empty()) {
+        this->engine.makeIterationField(this->field);
+    } else {
+        if (!this->field.load(job.counts_input)) throw std::runtime_error("Cannot read counts: " + job.counts_input);
+        if (this->field.getWidth() != this->engine.regionWidth() || this->field.getHeight() != this->engine.regionHeight()
+                || this->field.getMandelCountMax() != this->engine.getMandelCountMax()) {
+            throw std::invalid_argument("Counts do not match the job: " + job.counts_input);
+        }
+    }
+    if (!job.counts_output.empty() && !this->field.save(job.counts_output)) {
+        throw std::runtime_error("Cannot write counts: " + job.counts_output);
+    }
+    return this->colorize(job, this->field);
+}
+
+bool BatchRenderer::colorize(const RenderJob& job, const IterationView& counts) {
+    if (job.output.empty()) throw std::invalid_argument("output is not set");
+    if (job.cycle_frames > 0) return this->colorizeCycle(job, counts);
+    this->applyPalette(job);
+
+    if (job.eq_hist) this->brightness_table = this->engine.makeBrightnessTable(counts);
+    this->engine.makeColorVector(counts, this->brightness_table, job.eq_hist, this->color_vec);
+    return savePNG(job.output, this->color_vec, this->engine.regionWidth(), this->engine.regionHeight());
+}
+
+bool BatchRenderer::colorize(const RenderJob& job, const IterationView& counts, const FrameVector<float>& dist) {
+    if (job.output.empty()) throw std::invalid_argument("output is not set");
+    if (job.cycle_frames > 0) throw std::invalid_argument("cycle_frames is not supported with distance");
+    this->applyPalette(job);
+
+    this->engine.makeColorVector(counts, dist, this->color_vec);
+    return savePNG(job.output, this->color_vec, this->engine.regionWidth(), this->engine.regionHeight());
+}
+
+bool BatchRenderer::colorizeCycle(const RenderJob& job, const IterationView& counts) {
+    this->applyPalette(job);
+    const Palette& base = this->paletteFor(job.palette);
+    const Palette& target = job.cycle_palette.empty() ? base : this->paletteFor(job.cycle_palette);
+    if (target.size() != base.size()) {
+        throw std::invalid_argument("cycle_palette must have as many colors as palette");
+    }
+
+    if (job.eq_hist) this->brightness_table = this->engine.makeBrightnessTable(counts);
+    std::vector<size_t> index_table = this->engine.makePaletteIndexTable(this->brightness_table, job.eq_hist);
+    double shift = job.resolveCycleShift(base.size());
+    size_t width = this->engine.regionWidth(), height = this->engine.regionHeight();
+
+    // ".rgb" なら全フレームを1つのファイルに続けて書く (ffmpeg -f rawvideo -pix_fmt rgb24 で読める)
+    std::ofstream raw;
+    bool to_raw = endsWith(job.output, ".rgb");
+    if (to_raw) {
+        raw.open(job.output, std::ios::binary | std::ios::trunc);
+        if (!raw) return false;
+    }
+
+    std::vector<Color> color_table(index_table.size());
+    bool saved = true;
+    std::thread writer;
+    // 色付けが例外を投げても, 保存中のスレッドを join してから投げ直す (joinable な std::thread の破棄は terminate)
+    try {
+        for (size_t k = 0; k < job.cycle_frames; k++) {
+            // t = k / cycle_frames なので t = 1 のフレームは出力しない. t = 1 が最初のフレームと同じ色になるのは,
+            // cycle_palette がなく, shift がパレットの色数の整数倍のときだけ. そのときは繰り返し再生しても切れ目がない
+            double t = static_cast<double>(k) / job.cycle_frames;
+            Palette pal = Palette::interpolate(base, target, t).rotated(shift * t);
+            for (size_t n = 0; n < index_table.size(); n++) {
+                color_table[n] = index_table[n] == Mandelbrot::palette_black ? Color(0, 0, 0) : pal[index_table[n]];
+            }
+            this->engine.remapColors(counts, color_table, this->color_vec);
+
+            // 前のフレームの保存を待ってから, このフレームの保存を始める
+            if (writer.joinable()) writer.join();
+            if (!saved) break;
+            this->color_vec.swap(this->cycle_vec);
+            writer = std::thread([&, k]() {
+                saved = to_raw ? writeRGB(raw, this->cycle_vec)
+                               : savePNG(cycleFrameName(job.output, k), this->cycle_vec, width, height);
+            });
+        }
+    } catch (...) {
+        if (writer.joinable()) writer.join();
+        throw;
+    }
+    if (writer.joinable()) writer.join();
+    return saved;
+}
+
+void BatchRenderer::applyPalette(const RenderJob& job) {
+    if (job.palette != this->current_palette) {
+        this->engine.setPalette(this->paletteFor(job.palette));
+        this->current_palette = job.palette;
+    }
+}
+
+const Palette& BatchRenderer::paletteFor(const std::string& spec) {
+    auto it = this->palettes.find(spec);
+    if (it == this->palettes.end()) it = this->palettes.emplace(spec, Palette::fromSpec(spec)).first;
+    return it->second;
+}
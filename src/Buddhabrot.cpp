@@ -0,0 +1,338 @@
+#include "Buddhabrot.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <omp.h>
+#include "Trace.hpp"
+#include "util.hpp"
+
+
+namespace {
+
+// 独立な提案をサンプルする範囲. |c| > 2 の c は z_1 で発散する
+constexpr double domain_min = -2.0, domain_size = 4.0;
+
+// R2 列 (平面の低食い違い列) の係数. 1 / g, 1 / g^2 (g は x^3 = x + 1 の実根) を 2^64 倍した固定小数点.
+// 番号 k の点は frac(0.5 + a k) で, 番号が大きくても double の fmod のように桁落ちしない
+constexpr uint64_t r2_a1 = static_cast<uint64_t>(0.7548776662466927 * 0x1p64);
+constexpr uint64_t r2_a2 = static_cast<uint64_t>(0.5698402909980532 * 0x1p64);
+constexpr uint64_t r2_half = 1ull << 63;
+
+const char checkpoint_magic[] = "MBUD1\n";
+
+double parseDouble(const std::string& key, const std::string& value) {
+    size_t pos = 0;
+    double x = 0.0;
+    try {
+        x = std::stod(value, &pos);
+    } catch (const std::logic_error&) {
+        pos = 0;
+    }
+    if (pos == 0 || pos != value.size() || !std::isfinite(x)) {
+        throw std::invalid_argument("Invalid value for " + key + ": " + value);
+    }
+    return x;
+}
+
+size_t parseCount(const std::string& key, const std::string& value) {
+    size_t pos = 0;
+    unsigned long long n = 0;
+    try {
+        n = std::stoull(value, &pos);
+    } catch (const std::logic_error&) {
+        pos = 0;
+    }
+    if (pos == 0 || pos != value.size()) throw std::invalid_argument("Invalid value for " + key + ": " + value);
+    return n;
+}
+
+// 主カージオイドと周期 2 の円の内側. 発散しないので軌道を計算しなくてよい
+bool inMainBulbs(double re, double im) {
+    double q = (re - 0.25) * (re - 0.25) + im * im;
+    if (q * (q + (re - 0.25)) <= 0.25 * im * im) return true;
+    return (re + 1.0) * (re + 1.0) + im * im <= 0.0625;
+}
+
+}  // namespace
+
+
+void Buddhabrot::Options::set(const std::string& key, const std::string& value) {
+    if (key == "re_target") this->re_target = parseDouble(key, value);
+    else if (key == "im_target") this->im_target = parseDouble(key, value);
+    else if (key == "width_target") this->width_target = parseDouble(key, value);
+    else if (key == "height_target") this->height_target = parseDouble(key, value);
+    else if (key == "width_px") this->width_px = parseCount(key, value);
+    else if (key == "height_px") this->height_px = parseCount(key, value);
+    else if (key == "mandel_count_max") this->mandel_count_max = parseCount(key, value);
+    else if (key == "mandel_count_min") this->mandel_count_min = parseCount(key, value);
+    else if (key == "samples") this->samples = parseCount(key, value);
+    else if (key == "round_samples") this->round_samples = parseCount(key, value);
+    else if (key == "mutation_probability") this->mutation_probability = parseDouble(key, value);
+    else if (key == "seed") this->seed = parseCount(key, value);
+    else if (key == "checkpoint") this->checkpoint = value;
+    else throw std::invalid_argument("Unknown key: " + key);
+}
+
+std::string Buddhabrot::Options::toLine() const {
+    std::ostringstream oss;
+    oss.precision(17);
+    oss << "re_target=" << this->re_target
+        << " im_target=" << this->im_target
+        << " width_target=" << this->width_target
+        << " height_target=" << this->height_target
+        << " width_px=" << this->width_px
+        << " height_px=" << this->height_px
+        << " mandel_count_max=" << this->mandel_count_max
+        << " mandel_count_min=" << this->mandel_count_min
+        << " mutation_probability=" << this->mutation_probability
+        << " seed=" << this->seed;
+    return oss.str();
+}
+
+
+Buddhabrot::Buddhabrot(const Options& options) : options(options) {
+    if (options.width_px == 0 || options.height_px == 0 || options.width_target <= 0.0 || options.height_target < 0.0) {
+        throw std::invalid_argument("Buddhabrot: empty view");
+    }
+    if (options.width_px * options.height_px > std::numeric_limits<uint32_t>::max()) {
+        throw std::invalid_argument("Buddhabrot: image is too large");
+    }
+    if (options.round_samples == 0 || options.mandel_count_min >= options.mandel_count_max) {
+        throw std::invalid_argument("Buddhabrot: invalid round_samples or mandel_count_min");
+    }
+    double height = options.height_target > 0.0
+                  ? options.height_target
+                  : options.width_target * options.height_px / options.width_px;
+    this->re_min = options.re_target - options.width_target / 2;
+    this->im_max = options.im_target + height / 2;
+    this->px_re = options.width_target / options.width_px;
+    this->px_im = height / options.height_px;
+    this->density.assign(options.width_px * options.height_px, 0.0);
+}
+
+void Buddhabrot::orbit(double c_re, double c_im, std::vector<uint32_t>& hits) const {
+    hits.clear();
+    if (inMainBulbs(c_re, c_im)) return;
+
+    // 発散するか確かめてから軌道をたどり直す (発散しない c の軌道は捨てるので, 先に記録しない)
+    double zr = 0.0, zi = 0.0;
+    size_t n = 0;
+    for (; n < this->options.mandel_count_max; n++) {
+        double zr2 = zr * zr, zi2 = zi * zi;
+        if (zr2 + zi2 > 4.0) break;
+        zi = 2.0 * zr * zi + c_im;
+        zr = zr2 - zi2 + c_re;
+    }
+    if (n >= this->options.mandel_count_max || n < this->options.mandel_count_min) return;
+
+    zr = 0.0;
+    zi = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double t = zr * zr - zi * zi + c_re;
+        zi = 2.0 * zr * zi + c_im;
+        zr = t;
+        double fx = (zr - this->re_min) / this->px_re;
+        double fy = (this->im_max - zi) / this->px_im;
+        if (fx >= 0.0 && fy >= 0.0 && fx < this->options.width_px && fy < this->options.height_px) {
+            hits.push_back(static_cast<uint32_t>(static_cast<size_t>(fy) * this->options.width_px + static_cast<size_t>(fx)));
+        }
+    }
+}
+
+void Buddhabrot::runChain(Chain& chain, size_t steps, Stats& stats) const {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    // 近くへの提案の半径 [表示範囲の幅の 1e-4 倍, 1e-1 倍]
+    const double r_max = 0.1 * this->options.width_target;
+    const double log_ratio = std::log(1e3);
+
+    auto independent = [&](double& re, double& im) {
+        chain.r2_x += r2_a1;
+        chain.r2_y += r2_a2;
+        re = domain_min + domain_size * std::ldexp(static_cast<double>(chain.r2_x >> 11), -53);
+        im = domain_min + domain_size * std::ldexp(static_cast<double>(chain.r2_y >> 11), -53);
+    };
+
+    size_t step = 0;
+    // 連鎖の始点: 表示範囲を通る c が見つかるまで独立にサンプルする (見つからなければこのラウンドは何も足さない)
+    while (chain.hits.empty() && step < steps) {
+        independent(chain.c_re, chain.c_im);
+        this->orbit(chain.c_re, chain.c_im, chain.hits);
+        step++;
+        stats.samples++;
+    }
+    if (!chain.hits.empty()) stats.contributing++;
+
+    for (; step < steps; step++) {
+        double re, im;
+        if (uniform(chain.rng) < this->options.mutation_probability) {
+            double r = r_max * std::exp(-log_ratio * uniform(chain.rng));
+            double theta = 2.0 * M_PI * uniform(chain.rng);
+            re = chain.c_re + r * std::cos(theta);
+            im = chain.c_im + r * std::sin(theta);
+        } else {
+            independent(re, im);
+        }
+        this->orbit(re, im, chain.proposal_hits);
+        stats.samples++;
+
+        // 受理確率 min(1, f(c') / f(c)). f(c') = 0 なら必ず棄却
+        if (!chain.proposal_hits.empty()) {
+            stats.contributing++;
+            double ratio = static_cast<double>(chain.proposal_hits.size()) / chain.hits.size();
+            if (ratio >= 1.0 || uniform(chain.rng) < ratio) {
+                chain.c_re = re;
+                chain.c_im = im;
+                chain.hits.swap(chain.proposal_hits);
+                stats.accepted++;
+            }
+        }
+
+        // 今の c の軌道を重み 1 / f(c) で加える
+        float w = 1.0f / chain.hits.size();
+        for (uint32_t p : chain.hits) chain.acc[p] += w;
+    }
+}
+
+void Buddhabrot::reduce(std::vector<Chain>& chains) {
+    MANDEL_TRACE_SCOPE("reduce");
+    const size_t n = this->density.size();
+    const size_t chunk = 1 << 16;
+    const size_t chunks = (n + chunk - 1) / chunk;
+
+    // 段ごとに chains[t] += chains[t + half] (half = 1, 2, 4, ...). 1段の中のペアと区間は並列に足す
+    for (size_t half = 1; half < chains.size(); half *= 2) {
+        size_t pairs = (chains.size() + 2 * half - 1 - half) / (2 * half);
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (size_t p = 0; p < pairs; p++) {
+            for (size_t k = 0; k < chunks; k++) {
+                FrameVector<float>& dst = chains[2 * half * p].acc;
+                const FrameVector<float>& src = chains[2 * half * p + half].acc;
+                for (size_t i = k * chunk; i < std::min(n, (k + 1) * chunk); i++) dst[i] += src[i];
+            }
+        }
+    }
+
+    const FrameVector<float>& total = chains[0].acc;
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++) this->density[i] += total[i];
+}
+
+bool Buddhabrot::render(std::ostream& log) {
+    auto t0 = std::chrono::steady_clock::now();
+    this->stats = Stats();
+    if (!this->options.checkpoint.empty() && this->loadCheckpoint()) {
+        log << "resuming from " << this->samples_done << " samples" << std::endl;
+    }
+
+    size_t threads = omp_get_max_threads();
+    std::vector<Chain> chains(threads);
+    bool saved = true;
+
+    while (this->samples_done < this->options.samples) {
+        MANDEL_TRACE_SCOPE("round");
+        size_t round = std::min(this->options.round_samples, this->options.samples - this->samples_done);
+        std::vector<Stats> thread_stats(threads);
+
+        #pragma omp parallel num_threads(threads)
+        {
+            size_t t = omp_get_thread_num();
+            Chain& chain = chains[t];
+            // ラウンドごとに連鎖を始め直す. 乱数と R2 列の位置はサンプル数とスレッドで決まるので, 再開しても同じ列になる
+            chain.rng.seed(this->options.seed * 0x9E3779B97F4A7C15ull + this->samples_done * 31 + t);
+            // スレッド t は R2 列の番号 samples_done + t * round から使うので, 連鎖どうしで点が重ならない
+            uint64_t r2_index = this->samples_done + t * round;
+            chain.r2_x = r2_half + r2_a1 * r2_index;
+            chain.r2_y = r2_half + r2_a2 * r2_index;
+            chain.hits.clear();
+            chain.acc.resize(this->density.size());
+            std::fill(chain.acc.begin(), chain.acc.end(), 0.0f);  // バッファはこのスレッドで初期化する (first touch)
+
+            size_t steps = round / threads + (t < round % threads ? 1 : 0);
+            this->runChain(chain, steps, thread_stats[t]);
+        }
+
+        this->reduce(chains);
+        this->samples_done += round;
+        for (const Stats& s : thread_stats) {
+            this->stats.samples += s.samples;
+            this->stats.contributing += s.contributing;
+            this->stats.accepted += s.accepted;
+        }
+
+        log << "samples: " << this->samples_done << "/" << this->options.samples
+            << " (contributing " << 100.0 * this->stats.contributing / std::max<size_t>(1, this->stats.samples) << "%"
+            << ", accepted " << 100.0 * this->stats.accepted / std::max<size_t>(1, this->stats.samples) << "%)" << std::endl;
+        if (!this->options.checkpoint.empty() && !this->saveCheckpoint()) {
+            std::cerr << "Failed to save checkpoint: " << this->options.checkpoint << std::endl;
+            saved = false;
+        }
+    }
+
+    this->stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return saved;
+}
+
+void Buddhabrot::makeColorVector(const Palette& palette, double gamma, FrameVector<Color>& color_vec) const {
+    color_vec.resize(this->density.size());
+    if (palette.empty()) throw std::invalid_argument("Buddhabrot: empty palette");
+
+    // 少数の画素に集まる密度で全体が暗くならないよう, 0 でない密度の上位 0.1% を上限にする
+    std::vector<double> nonzero;
+    for (double d : this->density) if (d > 0.0) nonzero.push_back(d);
+    double limit = 1.0;
+    if (!nonzero.empty()) {
+        size_t k = std::min(nonzero.size() - 1, static_cast<size_t>(nonzero.size() * 0.999));
+        std::nth_element(nonzero.begin(), nonzero.begin() + k, nonzero.end());
+        limit = nonzero[k];
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < this->density.size(); i++) {
+        double v = std::pow(std::min(1.0, this->density[i] / limit), gamma);
+        color_vec[i] = palette[static_cast<size_t>(v * (palette.size() - 1))];
+    }
+}
+
+bool Buddhabrot::saveCheckpoint() const {
+    std::string data = checkpoint_magic;
+    data += this->options.toLine() + "\n";
+    data += "samples_done=" + std::to_string(this->samples_done) + "\n";
+    size_t offset = data.size();
+    data.resize(offset + this->density.size() * sizeof(double));
+    std::memcpy(&data[offset], this->density.data(), this->density.size() * sizeof(double));
+    data += "end\n";
+    return writeFileAtomic(this->options.checkpoint, data);
+}
+
+bool Buddhabrot::loadCheckpoint() {
+    std::ifstream ifs(this->options.checkpoint, std::ios::binary);
+    if (!ifs) return false;
+    std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    // 見出し, 設定の行, サンプル数の行, 密度, "end\n"
+    std::string magic = checkpoint_magic;
+    if (data.compare(0, magic.size(), magic) != 0) return false;
+    size_t line_end = data.find('\n', magic.size());
+    if (line_end == std::string::npos || data.substr(magic.size(), line_end - magic.size()) != this->options.toLine()) {
+        return false;
+    }
+    size_t count_end = data.find('\n', line_end + 1);
+    std::string count_line = data.substr(line_end + 1, count_end - line_end - 1);
+    if (count_end == std::string::npos || count_line.compare(0, 13, "samples_done=") != 0) return false;
+
+    size_t bytes = this->density.size() * sizeof(double);
+    if (data.size() != count_end + 1 + bytes + 4 || data.compare(data.size() - 4, 4, "end\n") != 0) return false;
+    try {
+        this->samples_done = parseCount("samples_done", count_line.substr(13));
+    } catch (const std::invalid_argument&) {
+        return false;
+    }
+    std::memcpy(this->density.data(), &data[count_end + 1], bytes);
+    return true;
+}
@@ -0,0 +1,157 @@
+#include "CostEstimator.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "Precision.hpp"
+
+
+namespace {
+
+// mpfr の速さの尺度: 語数 (64 bit) + 2 (語数によらない手間)
+double mpfrWeight(size_t precision) {
+    double limbs = std::ceil(static_cast<double>(digitsToBits(precision)) / 64.0);
+    return limbs + 2.0;
+}
+
+// セル (cols x rows で width x height を覆う) の値 cells を, 矩形 [x0, x1) x [y0, y1) に重なる面積で按分して足す
+double rectSum(const std::vector<double>& cells, size_t cols, size_t rows, size_t width, size_t height,
+               size_t x0, size_t y0, size_t x1, size_t y1) {
+    if (x0 >= x1 || y0 >= y1 || cells.empty()) return 0.0;
+    double cell_w = static_cast<double>(width) / cols, cell_h = static_cast<double>(height) / rows;
+    // [lo, hi) とセル k の重なりの割合
+    auto overlap = [](double lo, double hi, size_t k, double size) {
+        double a = std::max(lo, k * size), b = std::min(hi, (k + 1) * size);
+        return b > a ? (b - a) / size : 0.0;
+    };
+    size_t i0 = static_cast<size_t>(x0 / cell_w), i1 = std::min(cols, static_cast<size_t>(std::ceil(x1 / cell_w)));
+    size_t j0 = static_cast<size_t>(y0 / cell_h), j1 = std::min(rows, static_cast<size_t>(std::ceil(y1 / cell_h)));
+    double sum = 0.0;
+    for (size_t j = j0; j < j1; j++) {
+        double fy = overlap(static_cast<double>(y0), static_cast<double>(y1), j, cell_h);
+        if (fy == 0.0) continue;
+        for (size_t i = i0; i < i1; i++) {
+            sum += cells[j * cols + i] * fy * overlap(static_cast<double>(x0), static_cast<double>(x1), i, cell_w);
+        }
+    }
+    return sum;
+}
+
+}  // namespace
+
+
+double CostEstimator::Calibration::rate(Backend backend, size_t precision) const {
+    auto it = this->rates.find(Mandelbrot::backendName(backend));
+    if (it == this->rates.end()) throw std::invalid_argument("No calibration for backend " + Mandelbrot::backendName(backend));
+    return backend == Backend::Mpfr ? it->second / mpfrWeight(precision) : it->second;
+}
+
+double CostEstimator::Estimate::costOfRect(size_t x0, size_t y0, size_t x1, size_t y1) const {
+    return rectSum(this->cell_cost, this->probe_width, this->probe_height, this->width_px, this->height_px,
+                   x0, y0, std::min(x1, this->width_px), std::min(y1, this->height_px));
+}
+
+CostEstimator::CostEstimator() : calibration() {}
+
+CostEstimator::CostEstimator(const Calibration& calibration) : calibration(calibration) {}
+
+const CostEstimator::Calibration& CostEstimator::getCalibration() const {
+    return this->calibration;
+}
+
+CostEstimator::Calibration CostEstimator::calibrate(std::istream& bench_json) {
+    namespace pt = boost::property_tree;
+    pt::ptree root;
+    try {
+        pt::read_json(bench_json, root);
+    } catch (const pt::json_parser_error& e) {
+        throw std::invalid_argument(std::string("bench JSON: ") + e.what());
+    }
+    auto results = root.get_child_optional("results");
+    if (!results) throw std::invalid_argument("bench JSON: \"results\" is missing");
+
+    std::map<std::string, std::vector<double>> samples;
+    for (const auto& item : *results) {
+        const pt::ptree& r = item.second;
+        std::string backend = r.get<std::string>("backend", "");
+        double iterations = r.get<double>("iterations", 0.0), iterate_s = r.get<double>("iterate_s", 0.0);
+        double threads = r.get<double>("threads", 1.0);
+        if (backend.empty() || iterations <= 0.0 || iterate_s <= 0.0 || threads <= 0.0) continue;
+        double rate = iterations / (iterate_s * threads);
+        if (backend == "mpfr") rate *= mpfrWeight(r.get<size_t>("precision", 50));
+        samples[backend].push_back(rate);
+    }
+
+    Calibration calibration;
+    for (auto& [backend, rates] : samples) {
+        std::sort(rates.begin(), rates.end());
+        calibration.rates[backend] = rates[rates.size() / 2];
+    }
+    return calibration;
+}
+
+CostEstimator::Calibration CostEstimator::calibrateFile(const std::string& filename) {
+    std::ifstream ifs(filename);
+    if (!ifs) throw std::invalid_argument("Cannot open " + filename);
+    return calibrate(ifs);
+}
+
+CostEstimator::Estimate CostEstimator::estimate(const Mandelbrot& engine, int threads, size_t probe_px) const {
+    if (threads < 1) throw std::invalid_argument("threads must be positive");
+    if (probe_px == 0) throw std::invalid_argument("probe size must be positive");
+    size_t width = engine.getWidthPx(), height = engine.getHeightPx();
+    Backend backend = engine.resolveBackend();
+
+    Estimate e;
+    e.backend = Mandelbrot::backendName(backend);
+    e.precision = engine.getPrecision();
+    e.threads = threads;
+    e.width_px = width;
+    e.height_px = height;
+    e.probe_width = std::min(probe_px, width);
+    e.probe_height = std::clamp<size_t>(static_cast<size_t>(std::lround(static_cast<double>(e.probe_width) * height / width)),
+                                        1, height);
+
+    // 画像全体を小さく描く. 画素間隔が大きくなっても本番と同じ数値型で計算する
+    Mandelbrot probe = engine;
+    probe.clearRegion();
+    probe.setWidthPx(e.probe_width);
+    probe.setHeightPx(e.probe_height);
+    probe.setBackend(backend);
+    auto t0 = std::chrono::steady_clock::now();
+    FrameVector<size_t> counts = probe.makeCountVector();
+    e.probe_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // probe の1画素が代表する本番の画素数を掛ける
+    double cell_px = static_cast<double>(width) / e.probe_width * static_cast<double>(height) / e.probe_height;
+    size_t count_max = engine.getMandelCountMax();
+    e.cell_cost.resize(counts.size());
+    std::vector<double> interior(counts.size());
+    for (size_t i = 0; i < counts.size(); i++) {
+        e.cell_cost[i] = static_cast<double>(counts[i]) * cell_px;
+        interior[i] = counts[i] >= count_max ? cell_px : 0.0;
+    }
+
+    size_t x0 = engine.regionX0(), y0 = engine.regionY0(), x1 = engine.regionX1(), y1 = engine.regionY1();
+    e.pixels = static_cast<uint64_t>(x1 - x0) * (y1 - y0);
+    e.iterations = static_cast<uint64_t>(std::llround(e.costOfRect(x0, y0, x1, y1)));
+    double interior_px = rectSum(interior, e.probe_width, e.probe_height, width, height, x0, y0, x1, y1);
+    e.interior_fraction = e.pixels > 0 ? interior_px / e.pixels : 0.0;
+
+    // スレッドで均等に分けた時間と, 1番重いセルを1スレッドで計算する時間の長い方
+    double rate = this->calibration.rate(backend, e.precision);
+    double heaviest = 0.0;
+    double cell_w = static_cast<double>(width) / e.probe_width, cell_h = static_cast<double>(height) / e.probe_height;
+    for (size_t j = 0; j < e.probe_height; j++) {
+        for (size_t i = 0; i < e.probe_width; i++) {
+            size_t cx0 = std::max(x0, static_cast<size_t>(i * cell_w)), cx1 = std::min(x1, static_cast<size_t>(std::ceil((i + 1) * cell_w)));
+            size_t cy0 = std::max(y0, static_cast<size_t>(j * cell_h)), cy1 = std::min(y1, static_cast<size_t>(std::ceil((j + 1) * cell_h)));
+            heaviest = std::max(heaviest, e.costOfRect(cx0, cy0, cx1, cy1));
+        }
+    }
+    e.seconds = std::max(static_cast<double>(e.iterations) / threads, heaviest) / rate;
+    return e;
+}
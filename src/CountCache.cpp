@@ -0,0 +1,44 @@
+#include "CountCache.hpp"
+
+
+std::string CountCache::keyOf(const RenderJob& job) {
+    RenderJob view = job;
+    view.palette.clear();
+    view.eq_hist = false;
+    view.fused = false;  // 色付けの方法だけの違い
+    view.output.clear();
+    view.cycle_frames = 0;  // パレットの循環も色付けだけの違い
+    view.cycle_shift = "auto";
+    view.cycle_palette.clear();
+    view.precision = std::to_string(job.resolvePrecision());  // "auto" と同じ桁数の指定を同一視する
+    return view.toLine();
+}
+
+CountCache::CountField CountCache::find(const std::string& key) {
+    auto it = this->index.find(key);
+    if (it == this->index.end()) {
+        this->misses++;
+        return nullptr;
+    }
+    this->hits++;
+    this->entries.splice(this->entries.begin(), this->entries, it->second);
+    return it->second->second;
+}
+
+void CountCache::insert(const std::string& key, CountField counts) {
+    if (this->capacity == 0) return;
+
+    auto it = this->index.find(key);
+    if (it != this->index.end()) {
+        it->second->second = counts;
+        this->entries.splice(this->entries.begin(), this->entries, it->second);
+        return;
+    }
+
+    this->entries.emplace_front(key, counts);
+    this->index[key] = this->entries.begin();
+    if (this->entries.size() > this->capacity) {
+        this->index.erase(this->entries.back().first);
+        this->entries.pop_back();
+    }
+}
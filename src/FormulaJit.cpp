@@ -0,0 +1,410 @@
+#include "FormulaJit.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace {
+
+// 生成するソースの共通部分. 複素数 C<T> と実数 T を混ぜた演算を多重定義で選ぶので,
+// 実数の定数や re(), im() の結果は複素数にせずに計算される
+const char* source_prelude = R"(// mandel-cpp の FormulaJit が生成したソース
+#include <cstddef>
+
+namespace {
+
+template <typename T> struct C { T re, im; };
+
+template <typename T> inline C<T> operator+(C<T> a, C<T> b) { return {a.re + b.re, a.im + b.im}; }
+template <typename T> inline C<T> operator+(C<T> a, T b) { return {a.re + b, a.im}; }
+template <typename T> inline C<T> operator+(T a, C<T> b) { return {a + b.re, b.im}; }
+template <typename T> inline C<T> operator-(C<T> a, C<T> b) { return {a.re - b.re, a.im - b.im}; }
+template <typename T> inline C<T> operator-(C<T> a, T b) { return {a.re - b, a.im}; }
+template <typename T> inline C<T> operator-(T a, C<T> b) { return {a - b.re, -b.im}; }
+template <typename T> inline C<T> operator-(C<T> a) { return {-a.re, -a.im}; }
+template <typename T> inline C<T> operator*(C<T> a, C<T> b) { return {a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re}; }
+template <typename T> inline C<T> operator*(C<T> a, T b) { return {a.re * b, a.im * b}; }
+template <typename T> inline C<T> operator*(T a, C<T> b) { return {a * b.re, a * b.im}; }
+template <typename T> inline C<T> operator/(C<T> a, C<T> b) {
+    T d = b.re * b.re + b.im * b.im;
+    return {(a.re * b.re + a.im * b.im) / d, (a.im * b.re - a.re * b.im) / d};
+}
+template <typename T> inline C<T> operator/(C<T> a, T b) { return {a.re / b, a.im / b}; }
+template <typename T> inline C<T> operator/(T a, C<T> b) { return C<T>{a, T(0)} / b; }
+
+template <typename T> inline C<T> conj_(C<T> a) { return {a.re, -a.im}; }
+template <typename T> inline T conj_(T a) { return a; }
+template <typename T> inline C<T> abs_(C<T> a) { return {a.re < 0 ? -a.re : a.re, a.im < 0 ? -a.im : a.im}; }
+template <typename T> inline T abs_(T a) { return a < 0 ? -a : a; }
+template <typename T> inline C<T> cpx(C<T> a) { return a; }
+template <typename T> inline C<T> cpx(T a) { return {a, T(0)}; }
+
+// x^N. Formula.hpp の ipow と同じく squaring と乗算を並べる
+template <unsigned N, typename X> inline X pw(X x) {
+    if constexpr (N == 1) {
+        return x;
+    } else if constexpr (N % 2 == 0) {
+        X h = pw<N / 2>(x);
+        return h * h;
+    } else {
+        X h = pw<N / 2>(x);
+        return h * h * x;
+    }
+}
+
+)";
+
+// 改行を空白にする. 式は生成するソースのコメントや例外のメッセージに1行として入れる
+std::string oneLine(const std::string& s) {
+    std::string out = s;
+    for (char& ch : out) {
+        if (ch == '\n' || ch == '\r') ch = ' ';
+    }
+    return out;
+}
+
+// 式を生成するソースの式に変換する再帰下降の構文解析. 値ごとに実数か (虚部が 0 と分かっているか) を持つ
+class Parser {
+    public:
+    explicit Parser(const std::string& text) : text(text) {}
+
+    // ';' で区切られた各ステップの式 (複素数)
+    std::vector<std::string> parseSteps() {
+        std::vector<std::string> steps;
+        for (;;) {
+            Value v = this->parseSum();
+            steps.push_back(v.real ? "cpx<T>(" + v.code + ")" : v.code);
+            this->skipSpace();
+            if (this->pos >= this->text.size()) break;
+            if (this->text[this->pos] != ';') this->fail("unexpected character");
+            this->pos++;
+        }
+        return steps;
+    }
+
+
+    private:
+    struct Value {
+        std::string code;
+        bool real;
+    };
+
+    const std::string& text;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::invalid_argument("Invalid expression \"" + oneLine(this->text) + "\" at " + std::to_string(this->pos) + ": " + message);
+    }
+
+    void skipSpace() {
+        while (this->pos < this->text.size() && std::isspace(static_cast<unsigned char>(this->text[this->pos]))) this->pos++;
+    }
+
+    bool accept(char ch) {
+        this->skipSpace();
+        if (this->pos < this->text.size() && this->text[this->pos] == ch) {
+            this->pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char ch) {
+        if (!this->accept(ch)) this->fail(std::string("expected '") + ch + "'");
+    }
+
+    // sum := product (('+' | '-') product)*
+    Value parseSum() {
+        Value v = this->parseProduct();
+        for (;;) {
+            char op;
+            if (this->accept('+')) op = '+';
+            else if (this->accept('-')) op = '-';
+            else return v;
+            Value rhs = this->parseProduct();
+            v = {"(" + v.code + " " + op + " " + rhs.code + ")", v.real && rhs.real};
+        }
+    }
+
+    // product := unary (('*' | '/') unary)*
+    Value parseProduct() {
+        Value v = this->parseUnary();
+        for (;;) {
+            char op;
+            if (this->accept('*')) op = '*';
+            else if (this->accept('/')) op = '/';
+            else return v;
+            Value rhs = this->parseUnary();
+            v = {"(" + v.code + " " + op + " " + rhs.code + ")", v.real && rhs.real};
+        }
+    }
+
+    // unary := ('-' | '+') unary | power
+    Value parseUnary() {
+        if (this->accept('-')) {
+            Value v = this->parseUnary();
+            return {"(-" + v.code + ")", v.real};
+        }
+        if (this->accept('+')) return this->parseUnary();
+        return this->parsePower();
+    }
+
+    // power := primary ('^' 整数)*
+    Value parsePower() {
+        Value v = this->parsePrimary();
+        while (this->accept('^')) {
+            this->skipSpace();
+            size_t begin = this->pos;
+            while (this->pos < this->text.size() && std::isdigit(static_cast<unsigned char>(this->text[this->pos]))) this->pos++;
+            if (begin == this->pos) this->fail("expected an integer exponent");
+            unsigned long n = std::stoul(this->text.substr(begin, this->pos - begin));
+            if (n < 1 || n > 64) this->fail("exponent must be in [1, 64]");
+            v = {"pw<" + std::to_string(n) + ">(" + v.code + ")", v.real};
+        }
+        return v;
+    }
+
+    // primary := 数 | z | c | i | 関数 '(' sum ')' | '(' sum ')'
+    Value parsePrimary() {
+        this->skipSpace();
+        if (this->pos >= this->text.size()) this->fail("unexpected end");
+        char ch = this->text[this->pos];
+        if (std::isdigit(static_cast<unsigned char>(ch)) || ch == '.') return this->parseNumber();
+        if (this->accept('(')) {
+            Value v = this->parseSum();
+            this->expect(')');
+            return v;
+        }
+        if (!std::isalpha(static_cast<unsigned char>(ch))) this->fail("unexpected character");
+
+        size_t begin = this->pos;
+        while (this->pos < this->text.size() && std::isalnum(static_cast<unsigned char>(this->text[this->pos]))) this->pos++;
+        std::string name = this->text.substr(begin, this->pos - begin);
+        if (name == "z") return {"z", false};
+        if (name == "c") return {"c", false};
+        if (name == "i") return {"C<T>{T(0), T(1)}", false};
+        if (name != "conj" && name != "abs" && name != "re" && name != "im") {
+            this->pos = begin;
+            this->fail("unknown name \"" + name + "\"");
+        }
+
+        this->expect('(');
+        Value arg = this->parseSum();
+        this->expect(')');
+        if (name == "conj") return {"conj_(" + arg.code + ")", arg.real};
+        if (name == "abs") return {"abs_(" + arg.code + ")", arg.real};
+        if (name == "re") return {arg.real ? arg.code : "(" + arg.code + ").re", true};
+        return {arg.real ? "T(0)" : "(" + arg.code + ").im", true};
+    }
+
+    // 10進の実数. ソースには long double のリテラルとして書き, T に変換する
+    Value parseNumber() {
+        size_t begin = this->pos;
+        auto digits = [&]() {
+            size_t start = this->pos;
+            while (this->pos < this->text.size() && std::isdigit(static_cast<unsigned char>(this->text[this->pos]))) this->pos++;
+            return this->pos - start;
+        };
+        size_t n = digits();
+        if (this->pos < this->text.size() && this->text[this->pos] == '.') {
+            this->pos++;
+            n += digits();
+        }
+        if (n == 0) this->fail("invalid number");
+        if (this->pos < this->text.size() && (this->text[this->pos] == 'e' || this->text[this->pos] == 'E')) {
+            this->pos++;
+            if (this->pos < this->text.size() && (this->text[this->pos] == '+' || this->text[this->pos] == '-')) this->pos++;
+            if (digits() == 0) this->fail("invalid exponent");
+        }
+        return {"T(" + this->text.substr(begin, this->pos - begin) + "L)", true};
+    }
+};
+
+// FNV-1a (64 bit) の16進表記
+std::string hashHex(const std::string& s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char ch : s) {
+        h ^= ch;
+        h *= 1099511628211ULL;
+    }
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    return buf;
+}
+
+// sh の単一引用符で囲む
+std::string shellQuote(const std::string& s) {
+    std::string out = "'";
+    for (char ch : s) {
+        if (ch == '\'') out += "'\\''";
+        else out += ch;
+    }
+    return out + "'";
+}
+
+std::string compilerCommand() {
+    const char* cxx = std::getenv("MANDEL_JIT_CXX");
+    return std::string(cxx && *cxx ? cxx : "c++") + " -std=c++17 -O2 -fPIC -shared";
+}
+
+// dir を自分だけが書き込めるディレクトリとして用意する. 親は作り, dir は 0700 で作る.
+// 既にあれば, シンボリックリンクでなく, 自分が所有し, グループと他人が書き込めないことを確かめる.
+// 他人が置いた共有ライブラリを dlopen しないため
+void preparePrivateDirectory(const std::filesystem::path& dir) {
+    std::error_code ec;
+    if (dir.has_parent_path()) std::filesystem::create_directories(dir.parent_path(), ec);
+    if (ec) throw std::runtime_error("Cannot create " + dir.parent_path().string() + ": " + ec.message());
+    if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Cannot create " + dir.string() + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::lstat(dir.c_str(), &st) != 0) {
+        throw std::runtime_error("Cannot stat " + dir.string() + ": " + std::strerror(errno));
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        throw std::runtime_error("Refusing JIT cache " + dir.string() + ": not a private directory owned by the current user");
+    }
+}
+
+}  // namespace
+
+
+std::string FormulaJit::generateSource(const std::string& expression) {
+    std::vector<std::string> steps = Parser(expression).parseSteps();
+
+    std::ostringstream src;
+    src << source_prelude
+        << "// " << oneLine(expression) << "\n"
+        << "template <typename T>\n"
+        << "void row(const T* re, T im, size_t n, int julia, T k_re, T k_im, T bailout2, size_t count_max, size_t* counts) {\n"
+        << "    for (size_t x = 0; x < n; x++) {\n"
+        << "        C<T> p{re[x], im};\n"
+        << "        C<T> z = julia ? p : C<T>{T(0), T(0)};\n"
+        << "        C<T> c = julia ? C<T>{k_re, k_im} : p;\n"
+        << "        size_t it = 0;\n"
+        << "        while (it < count_max) {\n";
+    // hybrid のステップは展開し, ステップごとに脱出と上限を調べる
+    for (size_t k = 0; k < steps.size(); k++) {
+        src << "            z = " << steps[k] << ";\n"
+            << "            if (z.re * z.re + z.im * z.im > bailout2) break;\n"
+            << "            if (++it >= count_max) break;\n";
+    }
+    src << "        }\n"
+        << "        counts[x] = it;\n"
+        << "    }\n"
+        << "}\n"
+        << "\n"
+        << "}  // namespace\n"
+        << "\n"
+        << "extern \"C\" void mandel_jit_row_double(const double* re, double im, size_t n, int julia, double k_re, double k_im,\n"
+        << "                                       double bailout2, size_t count_max, size_t* counts) {\n"
+        << "    row<double>(re, im, n, julia, k_re, k_im, bailout2, count_max, counts);\n"
+        << "}\n"
+        << "\n"
+        << "extern \"C\" void mandel_jit_row_long_double(const long double* re, long double im, size_t n, int julia,\n"
+        << "                                            long double k_re, long double k_im, long double bailout2,\n"
+        << "                                            size_t count_max, size_t* counts) {\n"
+        << "    row<long double>(re, im, n, julia, k_re, k_im, bailout2, count_max, counts);\n"
+        << "}\n";
+    return src.str();
+}
+
+std::string FormulaJit::cacheDirectory() {
+    const char* dir = std::getenv("MANDEL_JIT_CACHE");
+    if (dir && *dir) return dir;
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/mandel-jit";
+    const char* home = std::getenv("HOME");
+    if (home && *home) return std::string(home) + "/.cache/mandel-jit";
+    // 共有の一時ディレクトリでは, ユーザごとの名前にする (load で自分だけのディレクトリか確かめる)
+    return (std::filesystem::temp_directory_path() / ("mandel-jit-" + std::to_string(::geteuid()))).string();
+}
+
+std::shared_ptr<const FormulaJit> FormulaJit::load(const std::string& expression) {
+    std::string source = generateSource(expression);
+    std::string command = compilerCommand();
+    std::string key = hashHex(command + "\n" + source);
+
+    // 同じ式の読み込み済みのライブラリを共有する. コンパイルも含めて排他する
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const FormulaJit>> loaded;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (auto jit = loaded[key].lock()) return jit;
+
+    std::filesystem::path dir = cacheDirectory();
+    std::string base = (dir / key).string();
+    std::string library = base + ".so";
+    preparePrivateDirectory(dir);
+    if (!std::filesystem::exists(library)) {
+        std::error_code ec;
+        {
+            std::ofstream ofs(base + ".cpp", std::ios::trunc);
+            ofs << source;
+            if (!ofs) throw std::runtime_error("Cannot write " + base + ".cpp");
+        }
+        // 別のプロセスが同じ式をコンパイルしていてもよいように, 一時ファイルに出力してから置き換える
+        std::string tmp = library + ".tmp" + std::to_string(getpid());
+        std::string log = base + ".log";
+        std::string cmd = command + " -o " + shellQuote(tmp) + " " + shellQuote(base + ".cpp") + " > " + shellQuote(log) + " 2>&1";
+        if (std::system(cmd.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            // コンパイラの出力は複数行なので log に残し, メッセージには入れない
+            throw std::runtime_error("Failed to compile expression \"" + oneLine(expression) + "\": " + command + " (see " + log + ")");
+        }
+        std::remove(log.c_str());
+        std::filesystem::rename(tmp, library, ec);
+        if (ec) {
+            std::remove(tmp.c_str());
+            throw std::runtime_error("Cannot rename " + tmp + ": " + ec.message());
+        }
+    }
+
+    std::shared_ptr<FormulaJit> jit(new FormulaJit(expression, library));
+    loaded[key] = jit;
+    return jit;
+}
+
+FormulaJit::FormulaJit(const std::string& expression, const std::string& library_path)
+    : expression(expression), library_path(library_path) {
+    this->handle = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!this->handle) throw std::runtime_error("Cannot load " + library_path + ": " + dlerror());
+    this->row_double = reinterpret_cast<RowFunction<double>>(dlsym(this->handle, "mandel_jit_row_double"));
+    this->row_long_double = reinterpret_cast<RowFunction<long double>>(dlsym(this->handle, "mandel_jit_row_long_double"));
+    if (!this->row_double || !this->row_long_double) {
+        dlclose(this->handle);
+        throw std::runtime_error("Missing row functions in " + library_path);
+    }
+}
+
+FormulaJit::~FormulaJit() {
+    if (this->handle) dlclose(this->handle);
+}
+
+const std::string& FormulaJit::getExpression() const {
+    return this->expression;
+}
+
+const std::string& FormulaJit::getLibraryPath() const {
+    return this->library_path;
+}
+
+FormulaJit::RowFunction<double> FormulaJit::rowDouble() const {
+    return this->row_double;
+}
+
+FormulaJit::RowFunction<long double> FormulaJit::rowLongDouble() const {
+    return this->row_long_double;
+}
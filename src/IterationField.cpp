@@ -0,0 +1,240 @@
+#include "IterationField.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <zlib.h>
+#include "util.hpp"
+
+
+namespace {
+
+constexpr char magic[4] = {'M', 'I', 'T', 'F'};
+constexpr uint8_t format_version = 1;
+constexpr size_t header_bytes = 4 + 4 + 8 * 3;
+
+void putU64(std::vector<uint8_t>& out, uint64_t v) {
+    for (int k = 0; k < 8; k++) out.push_back(static_cast<uint8_t>(v >> (8 * k)));
+}
+
+uint64_t getU64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int k = 0; k < 8; k++) v |= static_cast<uint64_t>(p[k]) << (8 * k);
+    return v;
+}
+
+// data (size byte) を deflate して out の末尾に足す. flush が Z_FINISH なら最後
+bool deflateInto(z_stream& zs, const uint8_t* data, size_t size, int flush, std::vector<uint8_t>& out) {
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = static_cast<uInt>(size);
+    do {
+        uint8_t chunk[65536];
+        zs.next_out = chunk;
+        zs.avail_out = sizeof(chunk);
+        int ret = deflate(&zs, flush);
+        if (ret == Z_STREAM_ERROR) return false;
+        out.insert(out.end(), chunk, chunk + (sizeof(chunk) - zs.avail_out));
+    } while (zs.avail_out == 0);
+    return zs.avail_in == 0;
+}
+
+// 次の size byte を data に inflate する
+bool inflateInto(z_stream& zs, uint8_t* data, size_t size) {
+    zs.next_out = data;
+    zs.avail_out = static_cast<uInt>(size);
+    while (zs.avail_out > 0) {
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) break;
+        if (ret != Z_OK) return false;
+    }
+    return zs.avail_out == 0;
+}
+
+}  // namespace
+
+
+size_t IterationField::elementBytes(size_t mandel_count_max) {
+    // 発散した画素の反復回数は mandel_count_max - 1 以下
+    return mandel_count_max <= 65536 ? 2 : 4;
+}
+
+void IterationField::reset(size_t width, size_t height, size_t mandel_count_max) {
+    this->width = width;
+    this->height = height;
+    this->mandel_count_max = mandel_count_max;
+    this->elem_bytes = elementBytes(mandel_count_max);
+    size_t n = width * height;
+    if (this->elem_bytes == 2) {
+        this->c16.resize(n);
+        this->c32 = FrameVector<uint32_t>();
+    } else {
+        this->c32.resize(n);
+        this->c16 = FrameVector<uint16_t>();
+    }
+    this->flags.resize((n + 31) / 32);
+}
+
+void IterationField::assign(const FrameVector<size_t>& counts, size_t width, size_t height, size_t mandel_count_max) {
+    this->reset(width, height, mandel_count_max);
+    std::fill(this->flags.begin(), this->flags.end(), 0u);
+    this->storeTile(0, 0, width, height, counts.data(), width);
+}
+
+void IterationField::toCounts(FrameVector<size_t>& counts) const {
+    counts.resize(this->size());
+    #pragma omp parallel for
+    for (size_t i = 0; i < counts.size(); i++) counts[i] = this->count(i);
+}
+
+void IterationField::storeTile(size_t x0, size_t y0, size_t w, size_t h, const size_t* src, size_t stride) {
+    for (size_t y = 0; y < h; y++) {
+        const size_t* row = src + y * stride;
+        size_t begin = (y0 + y) * this->width + x0;
+        for (size_t x = 0; x < w; x++) {
+            size_t n = row[x] >= this->mandel_count_max ? 0 : row[x];
+            if (this->elem_bytes == 2) this->c16[begin + x] = static_cast<uint16_t>(n);
+            else this->c32[begin + x] = static_cast<uint32_t>(n);
+        }
+
+        // フラグは語ごとにまとめて, この行の自分のビットだけを atomic に書き換える
+        for (size_t i = begin; i < begin + w;) {
+            size_t word = i / 32;
+            size_t end = std::min(begin + w, (word + 1) * 32);
+            uint32_t mask = 0, bits = 0;
+            for (; i < end; i++) {
+                uint32_t bit = 1u << (i % 32);
+                mask |= bit;
+                if (row[i - begin] >= this->mandel_count_max) bits |= bit;
+            }
+            __atomic_fetch_and(&this->flags[word], ~mask, __ATOMIC_RELAXED);
+            if (bits) __atomic_fetch_or(&this->flags[word], bits, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void IterationField::clearRows(size_t y0, size_t y1) {
+    size_t begin = y0 * this->width, end = y1 * this->width;
+    if (this->elem_bytes == 2) std::fill(this->c16.begin() + begin, this->c16.begin() + end, uint16_t(0));
+    else std::fill(this->c32.begin() + begin, this->c32.begin() + end, 0u);
+    // 他の行と共有する端の語は storeTile が atomic に書くので触らない
+    size_t word0 = (begin + 31) / 32, word1 = end / 32;
+    if (word0 < word1) std::fill(this->flags.begin() + word0, this->flags.begin() + word1, 0u);
+}
+
+size_t IterationField::bytes() const {
+    return this->size() * this->elem_bytes + this->flags.size() * sizeof(uint32_t);
+}
+
+std::vector<uint8_t> IterationField::compress(int level) const {
+    std::vector<uint8_t> out(magic, magic + 4);
+    out.push_back(format_version);
+    out.push_back(static_cast<uint8_t>(this->elem_bytes));
+    out.push_back(0);
+    out.push_back(0);
+    putU64(out, this->width);
+    putU64(out, this->height);
+    putU64(out, this->mandel_count_max);
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK) return {};
+
+    // 集合内のフラグ (リトルエンディアン)
+    std::vector<uint8_t> row;
+    row.reserve(this->flags.size() * 4);
+    for (uint32_t word : this->flags) {
+        for (int k = 0; k < 4; k++) row.push_back(static_cast<uint8_t>(word >> (8 * k)));
+    }
+    bool ok = deflateInto(zs, row.data(), row.size(), Z_NO_FLUSH, out);
+
+    // 行ごとの差分. 1行をバイト面 (下位 byte の並び, 上位 byte の並び, ...) に分ける
+    size_t eb = this->elem_bytes;
+    row.resize(this->width * eb);
+    for (size_t y = 0; ok && y < this->height; y++) {
+        uint32_t prev = 0;
+        for (size_t x = 0; x < this->width; x++) {
+            size_t i = y * this->width + x;
+            uint32_t v = this->interior(i) ? prev : (eb == 2 ? this->c16[i] : this->c32[i]);
+            uint32_t d = v - prev;
+            for (size_t k = 0; k < eb; k++) row[k * this->width + x] = static_cast<uint8_t>(d >> (8 * k));
+            prev = v;
+        }
+        ok = deflateInto(zs, row.data(), row.size(), Z_NO_FLUSH, out);
+    }
+    ok = ok && deflateInto(zs, nullptr, 0, Z_FINISH, out);
+    deflateEnd(&zs);
+    if (!ok) return {};
+    return out;
+}
+
+bool IterationField::decompress(const std::vector<uint8_t>& data) {
+    if (data.size() < header_bytes || std::memcmp(data.data(), magic, 4) != 0 || data[4] != format_version) return false;
+    size_t eb = data[5];
+    uint64_t width = getU64(data.data() + 8), height = getU64(data.data() + 16);
+    uint64_t mandel_count_max = getU64(data.data() + 24);
+    if (eb != elementBytes(mandel_count_max)) return false;
+    // 壊れたヘッダで巨大な確保や空回りをしない. 片方だけが 0 の大きさは作らない
+    const uint64_t limit = uint64_t(1) << 40;
+    if ((width == 0) != (height == 0)) return false;
+    if (width > limit || height > limit || (width != 0 && height > limit / width)) return false;
+    // deflate の圧縮率は最大で約 1032 倍なので, それより大きく展開されるヘッダは壊れている
+    uint64_t pixels = width * height;
+    uint64_t raw_bytes = (pixels + 31) / 32 * 4 + pixels * eb;
+    if (raw_bytes / 1032 > data.size() - header_bytes) return false;
+
+    IterationField field;
+    try {
+        field.reset(width, height, mandel_count_max);
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return false;
+    zs.next_in = const_cast<Bytef*>(data.data() + header_bytes);
+    zs.avail_in = static_cast<uInt>(data.size() - header_bytes);
+
+    std::vector<uint8_t> row(field.flags.size() * 4);
+    bool ok = inflateInto(zs, row.data(), row.size());
+    for (size_t w = 0; ok && w < field.flags.size(); w++) {
+        const uint8_t* p = row.data() + w * 4;
+        field.flags[w] = static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+                       | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    row.resize(width * eb);
+    for (size_t y = 0; ok && y < height; y++) {
+        ok = inflateInto(zs, row.data(), row.size());
+        uint32_t prev = 0;
+        for (size_t x = 0; ok && x < width; x++) {
+            uint32_t d = 0;
+            for (size_t k = 0; k < eb; k++) d |= static_cast<uint32_t>(row[k * width + x]) << (8 * k);
+            uint32_t v = prev + d;
+            if (eb == 2) v &= 0xffff;
+            size_t i = y * width + x;
+            bool inside = field.interior(i);
+            if (eb == 2) field.c16[i] = static_cast<uint16_t>(inside ? 0 : v);
+            else field.c32[i] = inside ? 0 : v;
+            prev = v;
+        }
+    }
+    inflateEnd(&zs);
+    if (!ok) return false;
+    *this = std::move(field);
+    return true;
+}
+
+bool IterationField::save(const std::string& filename, int level) const {
+    std::vector<uint8_t> data = this->compress(level);
+    if (data.empty()) return false;
+    return writeFileAtomic(filename, std::string(data.begin(), data.end()));
+}
+
+bool IterationField::load(const std::string& filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs) return false;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    return this->decompress(data);
+}
@@ -1,4 +1,8 @@
 #include "Mandelbrot.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
 
 void Mandelbrot::setAllParams(
     size_t precision,
@@ -36,7 +40,12 @@ void Mandelbrot::setComplexParams(
 // Setter
 void Mandelbrot::setPrecision(size_t precision) {
     this->precision = precision;
-    boost::multiprecision::mpfr_float::default_precision(this->precision);
+    // boost の既定精度は変えず, 保持している値をこの精度に丸め直す
+    for (Float* x : {&this->re_target, &this->im_target, &this->width_target, &this->height_target,
+                     &this->julia_re, &this->julia_im}) {
+        x->precision(static_cast<unsigned>(precision));
+    }
+    this->updateComplexRange();
 }
 
 void Mandelbrot::setWidthPx(size_t width_px) {
@@ -48,22 +57,22 @@ void Mandelbrot::setHeightPx(size_t height_px) {
 }
 
 void Mandelbrot::setReTarget(const Float& re_target) {
-    this->re_target = re_target;
+    this->re_target = makeFloat(re_target, this->precision);
     this->updateComplexRange();
 }
 
 void Mandelbrot::setImTarget(const Float& im_target) {
-    this->im_target = im_target;
+    this->im_target = makeFloat(im_target, this->precision);
     this->updateComplexRange();
 }
 
 void Mandelbrot::setWidthTarget(const Float& width_target) {
-    this->width_target = width_target;
+    this->width_target = makeFloat(width_target, this->precision);
     this->updateComplexRange();
 }
 
 void Mandelbrot::setHeightTarget(const Float& height_target) {
-    this->height_target = height_target;
+    this->height_target = makeFloat(height_target, this->precision);
     this->updateComplexRange();
 }
 
@@ -75,6 +84,55 @@ void Mandelbrot::setPalette(const Palette& palette) {
     this->palette = palette;
 }
 
+void Mandelbrot::setBackend(Backend backend) {
+    this->backend = backend;
+}
+
+void Mandelbrot::setFormula(Formula formula, unsigned degree) {
+    if (degree < 2 || degree > max_degree) {
+        throw std::invalid_argument("Unsupported degree: " + std::to_string(degree));
+    }
+    this->formula = formula;
+    this->degree = degree;
+}
+
+void Mandelbrot::setExpression(const std::string& expression) {
+    this->jit = expression.empty() ? nullptr : FormulaJit::load(expression);
+    this->expression = expression;
+}
+
+void Mandelbrot::setJuliaParam(const Float& julia_re, const Float& julia_im) {
+    this->julia_re = makeFloat(julia_re, this->precision);
+    this->julia_im = makeFloat(julia_im, this->precision);
+}
+
+void Mandelbrot::setRegion(size_t x0, size_t y0, size_t x1, size_t y1) {
+    if (x0 >= x1 || y0 >= y1) throw std::invalid_argument("Empty region");
+    this->region_x0 = x0;
+    this->region_y0 = y0;
+    this->region_x1 = x1;
+    this->region_y1 = y1;
+}
+
+void Mandelbrot::clearRegion() {
+    this->region_x0 = 0;
+    this->region_y0 = 0;
+    this->region_x1 = std::numeric_limits<size_t>::max();
+    this->region_y1 = std::numeric_limits<size_t>::max();
+}
+
+void Mandelbrot::setNumaFirstTouch(bool numa_first_touch) {
+    this->numa_first_touch = numa_first_touch;
+}
+
+void Mandelbrot::setPinning(Pinning pinning) {
+    this->pinning = pinning;
+}
+
+void Mandelbrot::setTileCosts(const std::vector<double>& tile_costs) {
+    this->tile_costs = tile_costs;
+}
+
 // Getter
 size_t Mandelbrot::getPrecision() const {
     return this->precision;
@@ -112,111 +170,978 @@ size_t Mandelbrot::getMandelCountMax() const {
     return this->mandel_count_max;
 }
 
-std::vector<size_t> Mandelbrot::makeCountVector() const {
-    std::vector<size_t> count_vec(this->width_px * this->height_px);
-    #pragma omp parallel for collapse(2)
-    for (size_t y = 0; y < this->height_px; y++) {
-        for (size_t x = 0; x < this->width_px; x++) {
-            Complex z = this->getComplexAt(x, y);
-            size_t n = this->mandelCount(z);
-            count_vec[y * this->width_px + x] = n;
+Backend Mandelbrot::getBackend() const {
+    return this->backend;
+}
+
+Formula Mandelbrot::getFormula() const {
+    return this->formula;
+}
+
+unsigned Mandelbrot::getDegree() const {
+    return this->degree;
+}
+
+const std::string& Mandelbrot::getExpression() const {
+    return this->expression;
+}
+
+Float Mandelbrot::getJuliaRe() const {
+    return this->julia_re;
+}
+
+Float Mandelbrot::getJuliaIm() const {
+    return this->julia_im;
+}
+
+size_t Mandelbrot::regionX0() const {
+    return std::min(this->region_x0, this->width_px);
+}
+
+size_t Mandelbrot::regionY0() const {
+    return std::min(this->region_y0, this->height_px);
+}
+
+size_t Mandelbrot::regionX1() const {
+    return std::max(this->regionX0(), std::min(this->region_x1, this->width_px));
+}
+
+size_t Mandelbrot::regionY1() const {
+    return std::max(this->regionY0(), std::min(this->region_y1, this->height_px));
+}
+
+size_t Mandelbrot::regionWidth() const {
+    return this->regionX1() - this->regionX0();
+}
+
+size_t Mandelbrot::regionHeight() const {
+    return this->regionY1() - this->regionY0();
+}
+
+size_t Mandelbrot::tileCount() const {
+    return ((this->regionWidth() + tile_size - 1) / tile_size) * ((this->regionHeight() + tile_size - 1) / tile_size);
+}
+
+bool Mandelbrot::getNumaFirstTouch() const {
+    return this->numa_first_touch;
+}
+
+Pinning Mandelbrot::getPinning() const {
+    return this->pinning;
+}
+
+std::shared_ptr<const Mandelbrot::RenderStats> Mandelbrot::loadStats() const {
+    return std::atomic_load(&this->last_stats);
+}
+
+std::vector<SocketStats> Mandelbrot::getSocketStats() const {
+    auto stats = this->loadStats();
+    return stats ? stats->sockets : std::vector<SocketStats>();
+}
+
+std::vector<uint64_t> Mandelbrot::getTileIterations() const {
+    auto stats = this->loadStats();
+    return stats ? stats->tile_iterations : std::vector<uint64_t>();
+}
+
+std::vector<double> Mandelbrot::tileCostsFrom(const Mandelbrot& prev) const {
+    auto stats = prev.loadStats();
+    if (!stats || stats->tile_iterations.empty()) return {};
+    const std::vector<uint64_t>& tile_iterations = stats->tile_iterations;
+    size_t prev_w = prev.regionWidth(), prev_h = prev.regionHeight();
+    size_t prev_tiles_x = (prev_w + tile_size - 1) / tile_size, prev_tiles_y = (prev_h + tile_size - 1) / tile_size;
+    if (tile_iterations.size() != prev_tiles_x * prev_tiles_y) return {};
+
+    // prev のタイルの 1画素あたりの重さ
+    std::vector<double> density(tile_iterations.size());
+    double total = 0.0;
+    for (size_t t = 0; t < density.size(); t++) {
+        size_t tw = std::min(tile_size, prev_w - (t % prev_tiles_x) * tile_size);
+        size_t th = std::min(tile_size, prev_h - (t / prev_tiles_x) * tile_size);
+        double pixels = static_cast<double>(tw * th);
+        density[t] = (static_cast<double>(tile_iterations[t]) + pixels) / pixels;
+        total += density[t] * pixels;
+    }
+    double mean = total / (static_cast<double>(prev_w) * prev_h);
+
+    // この画像の画素 (x, y) は prev の領域内の画素 (ox + x * rx, oy + y * ry)
+    mpfr_prec_t bits = digitsToBits(std::max(this->precision, prev.precision));
+    MpfrVar t(bits);
+    auto offset = [&](const Float& a, const Float& b, const Float& size, size_t px) {
+        mpfr_sub(t, a.backend().data(), b.backend().data(), MPFR_RNDN);
+        mpfr_mul_ui(t, t, px, MPFR_RNDN);
+        mpfr_div(t, t, size.backend().data(), MPFR_RNDN);
+        return mpfr_get_d(t, MPFR_RNDN);
+    };
+    auto ratio = [&](const Float& size, size_t px, const Float& prev_size, size_t prev_px) {
+        mpfr_div(t, size.backend().data(), prev_size.backend().data(), MPFR_RNDN);
+        return mpfr_get_d(t, MPFR_RNDN) * static_cast<double>(prev_px) / static_cast<double>(px);
+    };
+    double rx = ratio(this->width_target, this->width_px, prev.width_target, prev.width_px);
+    double ry = ratio(this->height_target, this->height_px, prev.height_target, prev.height_px);
+    double ox = offset(this->re_min, prev.re_min, prev.width_target, prev.width_px) - static_cast<double>(prev.regionX0());
+    double oy = offset(prev.im_max, this->im_max, prev.height_target, prev.height_px) - static_cast<double>(prev.regionY0());
+    if (!std::isfinite(rx) || !std::isfinite(ry) || !std::isfinite(ox) || !std::isfinite(oy)) return {};
+
+    size_t width = this->regionWidth(), height = this->regionHeight();
+    size_t tiles_x = (width + tile_size - 1) / tile_size, tiles_y = (height + tile_size - 1) / tile_size;
+    std::vector<double> costs(tiles_x * tiles_y);
+    for (size_t k = 0; k < costs.size(); k++) {
+        size_t x0 = this->regionX0() + (k % tiles_x) * tile_size, y0 = this->regionY0() + (k / tiles_x) * tile_size;
+        size_t x1 = std::min(x0 + tile_size, this->regionX1()), y1 = std::min(y0 + tile_size, this->regionY1());
+        // タイルを prev の画素の矩形に写し, 重なる prev のタイルの密度を面積で足す
+        double px0 = ox + x0 * rx, px1 = ox + x1 * rx, py0 = oy + y0 * ry, py1 = oy + y1 * ry;
+        double area = (px1 - px0) * (py1 - py0), covered = 0.0, sum = 0.0;
+        size_t i0 = static_cast<size_t>(std::clamp(px0, 0.0, static_cast<double>(prev_w)) / tile_size);
+        size_t j0 = static_cast<size_t>(std::clamp(py0, 0.0, static_cast<double>(prev_h)) / tile_size);
+        for (size_t j = j0; j < prev_tiles_y && j * tile_size < py1; j++) {
+            double fy = std::min(py1, static_cast<double>(std::min((j + 1) * tile_size, prev_h))) - std::max(py0, static_cast<double>(j * tile_size));
+            if (fy <= 0.0) continue;
+            for (size_t i = i0; i < prev_tiles_x && i * tile_size < px1; i++) {
+                double fx = std::min(px1, static_cast<double>(std::min((i + 1) * tile_size, prev_w))) - std::max(px0, static_cast<double>(i * tile_size));
+                if (fx <= 0.0) continue;
+                covered += fx * fy;
+                sum += density[j * prev_tiles_x + i] * fx * fy;
+            }
         }
+        double average = area > 0.0 ? (sum + std::max(0.0, area - covered) * mean) / area : mean;
+        costs[k] = average * static_cast<double>((x1 - x0) * (y1 - y0));
+    }
+    return costs;
+}
+
+Backend Mandelbrot::resolveBackend() const {
+    if (this->backend != Backend::Auto) return this->backend;
+
+    // 座標の大きさに対する画素間隔. 深いビューでは double に変換すると 0 になり mpfr が選ばれる
+    double pixel = std::max(toReal<double>(this->width_target) / this->width_px,
+                            toReal<double>(this->height_target) / this->height_px);
+    double magnitude = 1.0;
+    for (const Float* x : {&this->re_min, &this->re_max, &this->im_min, &this->im_max}) {
+        magnitude = std::max(magnitude, std::abs(toReal<double>(*x)));
+    }
+    if (this->formula == Formula::Julia) {
+        magnitude = std::max({magnitude, std::abs(toReal<double>(this->julia_re)), std::abs(toReal<double>(this->julia_im))});
+    }
+    double ratio = pixel / magnitude;
+
+    if (ratio >= std::ldexp(1.0, auto_guard_bits - std::numeric_limits<double>::digits)) {
+        return Backend::Double;
+    }
+    if (std::numeric_limits<long double>::digits > std::numeric_limits<double>::digits &&
+        ratio >= std::ldexp(1.0, auto_guard_bits - std::numeric_limits<long double>::digits)) {
+        return Backend::LongDouble;
+    }
+    return Backend::Mpfr;
+}
+
+std::string Mandelbrot::backendName(Backend backend) {
+    switch (backend) {
+        case Backend::Auto: return "auto";
+        case Backend::Double: return "double";
+        case Backend::LongDouble: return "long_double";
+        case Backend::Mpfr: return "mpfr";
+        case Backend::DoubleCompact: return "double_compact";
     }
+    return "unknown";
+}
+
+Backend Mandelbrot::backendFromName(const std::string& name) {
+    for (Backend b : {Backend::Auto, Backend::Double, Backend::LongDouble, Backend::Mpfr, Backend::DoubleCompact}) {
+        if (backendName(b) == name) return b;
+    }
+    throw std::invalid_argument("Unknown backend: " + name);
+}
+
+std::string Mandelbrot::formulaName(Formula formula) {
+    switch (formula) {
+        case Formula::Mandelbrot: return "mandelbrot";
+        case Formula::Julia: return "julia";
+    }
+    return "unknown";
+}
+
+Formula Mandelbrot::formulaFromName(const std::string& name) {
+    for (Formula f : {Formula::Mandelbrot, Formula::Julia}) {
+        if (formulaName(f) == name) return f;
+    }
+    throw std::invalid_argument("Unknown formula: " + name);
+}
+
+FrameVector<size_t> Mandelbrot::makeCountVector() const {
+    FrameVector<size_t> count_vec;
+    this->makeCountVector(count_vec);
     return count_vec;
 }
 
-std::vector<Color> Mandelbrot::makeColorVector(bool eq_hist) const {
-    std::vector<size_t> count_vec = this->makeCountVector();
-    std::vector<Color> color_vec(this->width_px * this->height_px);
+bool Mandelbrot::makeCountVector(FrameVector<size_t>& count_vec, const std::atomic<bool>* cancel) const {
+    count_vec.resize(this->regionWidth() * this->regionHeight());
+    return this->iterateTiles(count_vec.data(), nullptr, nullptr, nullptr, false, cancel);
+}
 
-    std::vector<size_t> hist = this->nHist();
-    std::vector<size_t> cdf = this->nCdf();
-    size_t total = cdf.back();
-    std::vector<Float> brightness_table(cdf.size());
-    for (size_t i = 0; i < cdf.size(); ++i) {
-        brightness_table[i] = Float(cdf[i]) / Float(total);  // 値は [0.0, 1.0]
+bool Mandelbrot::makeIterationField(IterationField& field, const std::atomic<bool>* cancel) const {
+    field.reset(this->regionWidth(), this->regionHeight(), this->mandel_count_max);
+    return this->iterateTiles(nullptr, nullptr, &field, nullptr, false, cancel);
+}
+
+bool Mandelbrot::makeDistanceVector(
+    FrameVector<size_t>& count_vec, FrameVector<float>& dist_vec,
+    bool disk_fill, const std::atomic<bool>* cancel
+) const {
+    count_vec.resize(this->regionWidth() * this->regionHeight());
+    dist_vec.resize(this->regionWidth() * this->regionHeight());
+    return this->iterateTiles(count_vec.data(), dist_vec.data(), nullptr, nullptr, disk_fill, cancel);
+}
+
+size_t Mandelbrot::placeThread(size_t thread) const {
+    const Topology& topology = Topology::host();
+    if (this->pinning != Pinning::None) pinCurrentThread(topology.cpuForThread(thread, this->pinning));
+    return topology.socketOfCpu(currentCpu());
+}
+
+template <typename Body>
+void Mandelbrot::forEachPixel(size_t pixels, Body body) const {
+    size_t width = this->regionWidth(), height = this->regionHeight();
+    if (!this->numa_first_touch || pixels != width * height) {
+        #pragma omp parallel for
+        for (size_t i = 0; i < pixels; i++) body(i);
+        return;
     }
 
-    #pragma omp parallel for
-    for (size_t i = 0; i < count_vec.size(); i++) {
-        if (eq_hist) color_vec[i] = this->nToColor_EqHist(count_vec[i], brightness_table);
-        else this->nToColor(count_vec[i]);
+    // color_vec も, 書き込んだスレッドのソケットに置かれる
+    std::vector<size_t> thread_socket(omp_get_max_threads(), 0);
+    std::unique_ptr<SocketPartition> partition;
+    #pragma omp parallel
+    {
+        size_t tid = omp_get_thread_num();
+        thread_socket[tid] = this->placeThread(tid);
+        #pragma omp barrier
+        #pragma omp single
+        {
+            thread_socket.resize(omp_get_num_threads());
+            partition = std::make_unique<SocketPartition>(thread_socket, height, tile_size);
+        }
+        auto [row0, row1] = partition->threadRows(tid);
+        for (size_t i = row0 * width; i < row1 * width; i++) body(i);
+    }
+}
+
+bool Mandelbrot::makeCountTiles(const TileSink& sink, const std::atomic<bool>* cancel) const {
+    return this->iterateTiles(nullptr, nullptr, nullptr, &sink, false, cancel);
+}
+
+bool Mandelbrot::panOffset(const Mandelbrot& prev, long& dx, long& dy) const {
+    auto same = [](const Float& a, const Float& b) { return mpfr_cmp(a.backend().data(), b.backend().data()) == 0; };
+    if (this->width_px != prev.width_px || this->height_px != prev.height_px) return false;
+    if (this->regionX0() != prev.regionX0() || this->regionY0() != prev.regionY0()) return false;
+    if (this->regionX1() != prev.regionX1() || this->regionY1() != prev.regionY1()) return false;
+    if (this->precision != prev.precision || this->mandel_count_max != prev.mandel_count_max) return false;
+    if (this->formula != prev.formula || this->degree != prev.degree) return false;
+    if (this->expression != prev.expression) return false;
+    if (this->formula == Formula::Julia && !(same(this->julia_re, prev.julia_re) && same(this->julia_im, prev.julia_im))) return false;
+    if (!same(this->width_target, prev.width_target) || !same(this->height_target, prev.height_target)) return false;
+    if (this->resolveBackend() != prev.resolveBackend()) return false;
+
+    // 中心の差 / 画素間隔 を mpfr で計算し, 整数に十分近いか調べる
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar t(bits);
+    auto offset = [&](const Float& now, const Float& before, const Float& size, size_t px, long& out) {
+        mpfr_sub(t, now.backend().data(), before.backend().data(), MPFR_RNDN);
+        mpfr_mul_ui(t, t, px, MPFR_RNDN);
+        mpfr_div(t, t, size.backend().data(), MPFR_RNDN);
+        double d = mpfr_get_d(t, MPFR_RNDN);
+        if (!std::isfinite(d) || std::abs(d) > 1e15) return false;
+        double r = std::round(d);
+        if (std::abs(d - r) > pan_tolerance_px) return false;
+        out = static_cast<long>(r);
+        return true;
+    };
+    long x = 0, y = 0;
+    if (!offset(this->re_target, prev.re_target, this->width_target, this->width_px, x)) return false;
+    if (!offset(this->im_target, prev.im_target, this->height_target, this->height_px, y)) return false;
+    // 画像の y は下向きなので, im が増える (ビューが上に動く) と前の画像の上の行が見える
+    dx = x;
+    dy = -y;
+    return true;
+}
+
+bool Mandelbrot::makeCountVectorPanned(PannedCounts& frame, const std::atomic<bool>* cancel) const {
+    size_t width = this->regionWidth(), height = this->regionHeight();
+    FrameVector<size_t>& count_vec = frame.counts;
+    long dx = 0, dy = 0;
+    bool reuse = frame.valid() && count_vec.size() == width * height && this->panOffset(*frame.view, dx, dy)
+              && static_cast<size_t>(std::abs(dx)) < width && static_cast<size_t>(std::abs(dy)) < height;
+    frame.view.reset();  // 書き換え中は無効
+    if (!reuse) {
+        if (!this->makeCountVector(count_vec, cancel)) return false;
+        frame.view = std::make_shared<const Mandelbrot>(*this);
+        return true;
+    }
+
+    // 残る画素をずらす. 読む行が書く行より先に来る向きに進めれば上書きしない
+    size_t keep_w = width - std::abs(dx);
+    size_t src_x = dx > 0 ? dx : 0, dst_x = dx > 0 ? 0 : -dx;
+    auto shiftRow = [&](size_t y) {
+        std::memmove(count_vec.data() + y * width + dst_x, count_vec.data() + (y + dy) * width + src_x, keep_w * sizeof(size_t));
+    };
+    if (dy >= 0) {
+        for (size_t y = 0; y + dy < height; y++) shiftRow(y);
+    } else {
+        for (size_t y = height; y-- > static_cast<size_t>(-dy);) shiftRow(y);
+    }
+
+    // 新しく見えた帯: 左右の列の帯 (全ての行) と, 上下の行の帯 (列の帯を除く). 座標は画像全体での画素
+    size_t x0 = this->regionX0(), y0 = this->regionY0();
+    size_t col0 = dx > 0 ? keep_w : 0, col1 = dx > 0 ? width : -dx;  // 領域内の列
+    size_t row0 = dy > 0 ? height - dy : 0, row1 = dy > 0 ? height : -dy;
+    struct Strip { size_t x0, y0, x1, y1; };
+    std::vector<Strip> strips;
+    if (dx != 0) strips.push_back({col0, 0, col1, height});
+    if (dy != 0) strips.push_back({dx > 0 ? 0 : col1, row0, dx > 0 ? col0 : width, row1});
+
+    // 集計は帯ごとの合計 (時間も帯の合計). 移動がなければ全て 0
+    std::vector<SocketStats> total(Topology::host().socketCount());
+    for (size_t k = 0; k < total.size(); k++) total[k].socket = k;
+    FrameVector<size_t> strip_vec;
+    bool done = true;
+    for (const Strip& s : strips) {
+        if (s.x0 >= s.x1 || s.y0 >= s.y1) continue;
+        Mandelbrot part = *this;
+        part.setRegion(x0 + s.x0, y0 + s.y0, x0 + s.x1, y0 + s.y1);
+        done = part.makeCountVector(strip_vec, cancel) && done;
+        size_t w = s.x1 - s.x0;
+        for (size_t y = s.y0; y < s.y1; y++) {
+            std::copy(strip_vec.data() + (y - s.y0) * w, strip_vec.data() + (y - s.y0 + 1) * w, count_vec.data() + y * width + s.x0);
+        }
+
+        std::vector<SocketStats> part_stats = part.getSocketStats();
+        for (size_t k = 0; k < std::min(total.size(), part_stats.size()); k++) {
+            total[k].threads = std::max(total[k].threads, part_stats[k].threads);
+            total[k].tiles += part_stats[k].tiles;
+            total[k].pixels += part_stats[k].pixels;
+            total[k].iterations += part_stats[k].iterations;
+            total[k].busy_s += part_stats[k].busy_s;
+            total[k].wall_s += part_stats[k].wall_s;
+            total[k].lane_slots += part_stats[k].lane_slots;
+            total[k].lane_active += part_stats[k].lane_active;
+        }
+    }
+    // 前の描画のタイルの反復回数は別のビューのものなので, タイルごとの反復回数は空にする
+    std::atomic_store(&this->last_stats, std::shared_ptr<const RenderStats>(new RenderStats{total, {}}));
+    if (!done || (cancel && cancel->load())) return false;
+    frame.view = std::make_shared<const Mandelbrot>(*this);
+    return true;
+}
+
+bool Mandelbrot::iterateTiles(size_t* count_buf, float* dist_buf, IterationField* field, const TileSink* sink,
+                              bool disk_fill, const std::atomic<bool>* cancel) const {
+    MANDEL_TRACE_SCOPE("makeCountVector");
+    using clock = std::chrono::steady_clock;
+    auto wall_begin = clock::now();
+    Backend backend = this->resolveBackend();
+    if (this->jit && backend == Backend::Mpfr) {
+        throw std::invalid_argument("Expression formulas support double and long_double only (the view needs mpfr)");
     }
+    if (this->jit && dist_buf) throw std::invalid_argument("Expression formulas do not support distance estimation");
+
+    // 画素ごとの計算量の偏りが大きいので, タイル単位で動的に割り当てる (setTileCosts があれば重さで固定に分ける).
+    // タイルは領域 (setRegion) の左上から並べ, バッファは領域の大きさ
+    size_t width = this->regionWidth(), height = this->regionHeight();
+    size_t tiles_x = (width + tile_size - 1) / tile_size;
+    size_t tiles_y = (height + tile_size - 1) / tile_size;
+    std::vector<size_t> thread_socket(omp_get_max_threads(), 0);
+    std::vector<SocketStats> thread_stats(thread_socket.size());
+    std::unique_ptr<SocketPartition> partition;
+    std::vector<std::atomic<size_t>> next_tile;  // NUMA モード: 帯ごとの次のタイル
+    size_t team = 1;
+    std::vector<uint64_t> tile_iterations(tiles_x * tiles_y, 0);
+    // setTileCosts があれば, タイルを番号順に重さの等しい連続した範囲に分けてスレッドに固定で割り当てる
+    bool by_cost = !this->numa_first_touch && this->tile_costs.size() == tiles_x * tiles_y;
+    std::vector<size_t> cost_bounds;  // スレッド k の範囲は [cost_bounds[k], cost_bounds[k + 1])
+
+    #pragma omp parallel
+    {
+        size_t tid = omp_get_thread_num();
+        if (tid == 0) team = omp_get_num_threads();
+        thread_socket[tid] = this->placeThread(tid);
+        SocketStats& stats = thread_stats[tid];
+        bool tiled = field || sink;
+        std::vector<size_t> tile_counts(tiled ? tile_size * tile_size : 0);  // field に詰めるか sink に渡す前のタイル
+
+        auto runTile = [&](size_t t) {
+            // omp for は途中で抜けられないので, 中止後のタイルは空回りさせる
+            if (cancel && cancel->load(std::memory_order_relaxed)) return;
+            size_t x0 = this->regionX0() + (t % tiles_x) * tile_size;
+            size_t y0 = this->regionY0() + (t / tiles_x) * tile_size;
+            size_t x1 = std::min(x0 + tile_size, this->regionX1()), y1 = std::min(y0 + tile_size, this->regionY1());
+            TileTarget out = tiled ? TileTarget{tile_counts.data(), nullptr, x0, y0, tile_size}
+                                   : TileTarget{count_buf, dist_buf, this->regionX0(), this->regionY0(), width};
+            out.stats = &stats;
+            auto begin = clock::now();
+            this->makeCountTile(backend, x0, y0, x1, y1, out, disk_fill);
+            if (field) {
+                field->storeTile(x0 - this->regionX0(), y0 - this->regionY0(), x1 - x0, y1 - y0, tile_counts.data(), tile_size);
+            } else if (sink) {
+                (*sink)(x0 - this->regionX0(), y0 - this->regionY0(), x1 - x0, y1 - y0, tile_counts.data(), tile_size);
+            }
+            stats.busy_s += std::chrono::duration<double>(clock::now() - begin).count();
+            stats.tiles++;
+            stats.pixels += (x1 - x0) * (y1 - y0);
+            uint64_t iterations = 0;
+            for (size_t y = y0; y < y1; y++) {
+                for (size_t x = x0; x < x1; x++) iterations += out.count[out.index(x, y)];
+            }
+            stats.iterations += iterations;
+            tile_iterations[t] = iterations;
+        };
+
+        if (by_cost) {
+            #pragma omp single
+            {
+                // 重さの累積が全体の k / team を超える所で切る
+                size_t parts = omp_get_num_threads();
+                double total = 0.0;
+                for (double c : this->tile_costs) total += std::max(c, 0.0);
+                cost_bounds.assign(parts + 1, tiles_x * tiles_y);
+                cost_bounds[0] = 0;
+                double sum = 0.0;
+                size_t k = 1;
+                for (size_t t = 0; t < this->tile_costs.size() && k < parts; t++) {
+                    sum += total > 0.0 ? std::max(this->tile_costs[t], 0.0) : 1.0;  // 重さがなければタイルの数で分ける
+                    while (k < parts && sum >= (total > 0.0 ? total : this->tile_costs.size()) * k / parts) cost_bounds[k++] = t + 1;
+                }
+            }
+            for (size_t t = cost_bounds[tid]; t < cost_bounds[tid + 1]; t++) runTile(t);
+        } else if (!this->numa_first_touch) {
+            #pragma omp for schedule(dynamic)
+            for (size_t t = 0; t < tiles_x * tiles_y; t++) runTile(t);
+        } else {
+            #pragma omp barrier
+            #pragma omp single
+            {
+                thread_socket.resize(omp_get_num_threads());
+                partition = std::make_unique<SocketPartition>(thread_socket, height, tile_size);
+                next_tile = std::vector<std::atomic<size_t>>(partition->groupCount());
+                for (size_t g = 0; g < partition->groupCount(); g++) {
+                    next_tile[g].store(partition->groupRows(g).first / tile_size * tiles_x);
+                }
+            }
+
+            // first touch: 帯のページを, その帯を計算するソケットのスレッドが最初に書き込む
+            auto [row0, row1] = partition->threadRows(tid);
+            if (field) field->clearRows(row0, row1);
+            else if (count_buf) std::fill(count_buf + row0 * width, count_buf + row1 * width, size_t(0));
+            if (dist_buf) std::fill(dist_buf + row0 * width, dist_buf + row1 * width, -1.0f);
+            #pragma omp barrier
+
+            // 自分の帯のタイルを取り, なくなれば他の帯を手伝う
+            size_t own = partition->groupOfThread(tid);
+            for (size_t k = 0; k < partition->groupCount(); k++) {
+                size_t g = (own + k) % partition->groupCount();
+                size_t end = (partition->groupRows(g).second + tile_size - 1) / tile_size * tiles_x;
+                for (size_t t = next_tile[g].fetch_add(1); t < end; t = next_tile[g].fetch_add(1)) runTile(t);
+            }
+        }
+    }
+
+    // ソケットごとに集計する
+    double wall_s = std::chrono::duration<double>(clock::now() - wall_begin).count();
+    auto stats = std::make_shared<RenderStats>();
+    stats->sockets.assign(Topology::host().socketCount(), SocketStats());
+    for (size_t s = 0; s < stats->sockets.size(); s++) {
+        stats->sockets[s].socket = s;
+        stats->sockets[s].wall_s = wall_s;
+    }
+    for (size_t t = 0; t < team; t++) {
+        SocketStats& total = stats->sockets[std::min(thread_socket[t], stats->sockets.size() - 1)];
+        const SocketStats& part = thread_stats[t];
+        total.threads++;
+        total.tiles += part.tiles;
+        total.pixels += part.pixels;
+        total.iterations += part.iterations;
+        total.busy_s += part.busy_s;
+        total.lane_slots += part.lane_slots;
+        total.lane_active += part.lane_active;
+    }
+    stats->tile_iterations = std::move(tile_iterations);
+    std::atomic_store(&this->last_stats, std::shared_ptr<const RenderStats>(std::move(stats)));
+    return !(cancel && cancel->load());
+}
+
+FrameVector<Color> Mandelbrot::makeColorVector(bool eq_hist) const {
+    IterationField count_vec;
+    this->makeIterationField(count_vec);
+    std::vector<double> brightness_table;
+    if (eq_hist) brightness_table = this->makeBrightnessTable(count_vec);
+    return this->makeColorVector(count_vec, brightness_table, eq_hist);
+}
+
+FrameVector<Color> Mandelbrot::makeColorVector(
+    const IterationView& count_vec,
+    const std::vector<double>& brightness_table,
+    bool eq_hist
+) const {
+    FrameVector<Color> color_vec;
+    this->makeColorVector(count_vec, brightness_table, eq_hist, color_vec);
     return color_vec;
 }
 
-void Mandelbrot::updateComplexRange() {
-    this->re_min = this->re_target - this->width_target / 2;
-    this->re_max = this->re_target + this->width_target / 2;
-    this->im_min = this->im_target - this->height_target / 2;
-    this->im_max = this->im_target + this->height_target / 2;
+void Mandelbrot::makeColorVector(
+    const IterationView& count_vec,
+    const std::vector<double>& brightness_table,
+    bool eq_hist,
+    FrameVector<Color>& color_vec
+) const {
+    MANDEL_TRACE_SCOPE("color");
+    color_vec.resize(count_vec.size());
+
+    this->forEachPixel(count_vec.size(), [&](size_t i) {
+        if (eq_hist) color_vec[i] = this->nToColor_EqHist(count_vec[i], brightness_table);
+        else color_vec[i] = this->nToColor(count_vec[i]);
+    });
+}
+
+void Mandelbrot::makeColorVector(
+    const IterationView& count_vec,
+    const FrameVector<float>& dist_vec,
+    FrameVector<Color>& color_vec
+) const {
+    MANDEL_TRACE_SCOPE("color");
+    color_vec.resize(count_vec.size());
+
+    this->forEachPixel(count_vec.size(), [&](size_t i) {
+        color_vec[i] = this->nToColor_DE(count_vec[i], dist_vec[i]);
+    });
 }
 
-Complex Mandelbrot::getComplexAt(const size_t x, const size_t y) const {
-    Float x_f = static_cast<Float>(x);
-    Float y_f = static_cast<Float>(y);
-    Float width_px_f = static_cast<Float>(width_px);
-    Float height_px_f = static_cast<Float>(height_px);
-    Float one_f = static_cast<Float>(1.0);
-    Float re = (x_f / width_px_f) * re_max + (one_f - x_f / width_px_f) * re_min;
-    Float im = (y_f / height_px_f) * im_min + (one_f - y_f / height_px_f) * im_max;
+std::vector<size_t> Mandelbrot::makePaletteIndexTable(const std::vector<double>& brightness_table, bool eq_hist) const {
+    std::vector<size_t> index_table(this->mandel_count_max + 1);
+    for (size_t n = 0; n <= this->mandel_count_max; n++) {
+        index_table[n] = eq_hist ? this->nToPaletteIndex_EqHist(n, brightness_table) : this->nToPaletteIndex(n);
+    }
+    return index_table;
+}
+
+std::vector<Color> Mandelbrot::makeColorTable(const std::vector<double>& brightness_table, bool eq_hist) const {
+    std::vector<size_t> index_table = this->makePaletteIndexTable(brightness_table, eq_hist);
+    std::vector<Color> color_table(index_table.size());
+    for (size_t n = 0; n < index_table.size(); n++) {
+        color_table[n] = index_table[n] == palette_black ? Color(0, 0, 0) : this->palette[index_table[n]];
+    }
+    return color_table;
+}
 
-    return Complex(re, im);
+bool Mandelbrot::makeColorTiles(const std::vector<Color>& color_table, const ColorTileSink& sink,
+                                const std::atomic<bool>* cancel) const {
+    if (color_table.empty()) throw std::invalid_argument("color_table is empty");
+    size_t last = color_table.size() - 1;
+    TileSink count_sink = [&](size_t x0, size_t y0, size_t w, size_t h, const size_t* counts, size_t stride) {
+        // タイルの反復回数がキャッシュにあるうちに色にする. バッファはスレッドごとに使い回す
+        thread_local std::vector<Color> tile_colors;
+        tile_colors.resize(w * h);
+        for (size_t y = 0; y < h; y++) {
+            for (size_t x = 0; x < w; x++) tile_colors[y * w + x] = color_table[std::min(counts[y * stride + x], last)];
+        }
+        sink(x0, y0, w, h, tile_colors.data(), w);
+    };
+    return this->makeCountTiles(count_sink, cancel);
 }
 
-size_t Mandelbrot::mandelCount(const Complex& c) const {
-    Complex z(Float(0.0), Float(0.0));
-    size_t n = 0;
+bool Mandelbrot::makeColorTiles(const std::vector<Color>& color_table, FrameVector<Color>& color_vec,
+                                const std::atomic<bool>* cancel) const {
+    size_t width = this->regionWidth();
+    color_vec.resize(width * this->regionHeight());
+    return this->makeColorTiles(color_table, [&](size_t x0, size_t y0, size_t w, size_t h, const Color* colors, size_t stride) {
+        for (size_t y = 0; y < h; y++) std::copy(colors + y * stride, colors + y * stride + w, color_vec.data() + (y0 + y) * width + x0);
+    }, cancel);
+}
 
-    while (n < this->mandel_count_max) {
-        z = z * z + c;
+std::vector<double> Mandelbrot::makeSampledBrightnessTable(size_t sample_px) const {
+    if (sample_px == 0) throw std::invalid_argument("sample size must be positive");
+    // CostEstimator の probe と同じく, 同じ数値型で画像全体を小さく描く
+    Mandelbrot sample = *this;
+    size_t width = std::min(sample_px, this->width_px);
+    size_t height = std::max<size_t>(1, static_cast<size_t>(std::lround(static_cast<double>(width) * this->height_px / this->width_px)));
+    sample.clearRegion();
+    sample.setWidthPx(width);
+    sample.setHeightPx(std::min(height, this->height_px));
+    sample.setBackend(this->resolveBackend());
+    IterationField counts;
+    sample.makeIterationField(counts);
+    return sample.makeBrightnessTable(counts);
+}
+
+void Mandelbrot::remapColors(const IterationView& count_vec, const std::vector<Color>& color_table, FrameVector<Color>& color_vec) const {
+    MANDEL_TRACE_SCOPE("remap");
+    color_vec.resize(count_vec.size());
+    this->forEachPixel(count_vec.size(), [&](size_t i) {
+        color_vec[i] = color_table[std::min(count_vec[i], color_table.size() - 1)];
+    });
+}
+
+std::vector<double> Mandelbrot::makeBrightnessTable(const IterationView& count_vec) const {
+    MANDEL_TRACE_SCOPE("histogram");
+    std::vector<size_t> cdf = this->nCdf(this->nHist(count_vec));
+    size_t total = cdf.back();
+    std::vector<double> brightness_table(cdf.size());
+    for (size_t i = 0; i < cdf.size(); ++i) {
+        brightness_table[i] = static_cast<double>(cdf[i]) / static_cast<double>(total);  // 値は [0.0, 1.0]
+    }
+    return brightness_table;
+}
 
-        // abs(z) を使えば、std::abs や boost::multiprecision::abs が
-        // ADL（Argument-Dependent Lookup）で自動的に選ばれます。
-        if (abs(z) > Float(2.0)) {
+void Mandelbrot::updateComplexRange() {
+    // boost の演算は精度の違う値が混ざると既定精度を書き換えるので, mpfr を直接呼ぶ
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar half(bits);
+    auto range = [&](Float& lo, Float& hi, const Float& center, const Float& size) {
+        mpfr_div_2ui(half, size.backend().data(), 1, MPFR_RNDN);
+        mpfr_set_prec(lo.backend().data(), bits);
+        mpfr_set_prec(hi.backend().data(), bits);
+        mpfr_sub(lo.backend().data(), center.backend().data(), half, MPFR_RNDN);
+        mpfr_add(hi.backend().data(), center.backend().data(), half, MPFR_RNDN);
+    };
+    range(this->re_min, this->re_max, this->re_target, this->width_target);
+    range(this->im_min, this->im_max, this->im_target, this->height_target);
+}
+
+void Mandelbrot::makeCountTile(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const {
+    MANDEL_TRACE_TILE(tile_trace, x0, y0);
+    if (this->jit) {
+        if (backend == Backend::LongDouble) this->makeCountTileJit(this->jit->rowLongDouble(), x0, y0, x1, y1, out);
+        else this->makeCountTileJit(this->jit->rowDouble(), x0, y0, x1, y1, out);
+    } else if (this->formula == Formula::Julia) {
+        this->makeCountTileDegree<formula::Julia>(backend, x0, y0, x1, y1, out, disk_fill);
+    } else {
+        this->makeCountTileDegree<formula::Multibrot>(backend, x0, y0, x1, y1, out, disk_fill);
+    }
+    MANDEL_TRACE_COUNTS(tile_trace, out.count, out.stride, x0 - out.x0, y0 - out.y0, x1 - out.x0, y1 - out.y0);
+}
+
+template <template <unsigned> class F>
+void Mandelbrot::makeCountTileDegree(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const {
+    static_assert(max_degree == 8, "update the cases below");
+    switch (this->degree) {
+        case 2: this->makeCountTileF<F<2>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 3: this->makeCountTileF<F<3>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 4: this->makeCountTileF<F<4>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 5: this->makeCountTileF<F<5>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 6: this->makeCountTileF<F<6>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 7: this->makeCountTileF<F<7>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+        case 8: this->makeCountTileF<F<8>>(backend, x0, y0, x1, y1, out, disk_fill); break;
+    }
+}
+
+template <typename F>
+void Mandelbrot::makeCountTileF(Backend backend, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const {
+    switch (backend) {
+        case Backend::Double:
+            this->makeCountTileT<double, F>(x0, y0, x1, y1, out, disk_fill);
+            break;
+        case Backend::LongDouble:
+            this->makeCountTileT<long double, F>(x0, y0, x1, y1, out, disk_fill);
+            break;
+        case Backend::DoubleCompact:
+            if (out.dist) this->makeCountTileT<double, F>(x0, y0, x1, y1, out, disk_fill);
+            else this->makeCountTileCompact<F>(x0, y0, x1, y1, out);
             break;
+        default:
+            this->makeCountTileMpfr<F>(x0, y0, x1, y1, out, disk_fill);
+            break;
+    }
+}
+
+template <typename T, typename F>
+void Mandelbrot::makeCountTileT(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const {
+    // getComplexAt と同じ補間式を T で計算する
+    T re_min_t = toReal<T>(this->re_min), re_max_t = toReal<T>(this->re_max);
+    T im_min_t = toReal<T>(this->im_min), im_max_t = toReal<T>(this->im_max);
+    T width_px_t = static_cast<T>(this->width_px), height_px_t = static_cast<T>(this->height_px);
+
+    // Julia の c. 脱出半径は max(2, |c|)
+    formula::Cpx<T> k{T(0), T(0)}, zero{T(0), T(0)}, one{T(1), T(0)};
+    T bailout2 = 4;
+    if constexpr (F::julia) {
+        k = {toReal<T>(this->julia_re), toReal<T>(this->julia_im)};
+        bailout2 = std::max(bailout2, formula::norm2(k));
+    }
+
+    // 距離の単位にする画素間隔 (縦横で違えば大きい方)
+    T pixel = std::max((re_max_t - re_min_t) / width_px_t, (im_max_t - im_min_t) / height_px_t);
+    bool fill = disk_fill && !F::julia && F::degree == 2;
+    if (out.dist) {
+        for (size_t y = y0; y < y1; y++) std::fill(out.dist + out.index(x0, y), out.dist + out.index(x1, y), -1.0f);
+    }
+
+    for (size_t y = y0; y < y1; y++) {
+        T fy = static_cast<T>(y) / height_px_t;
+        T im = fy * im_min_t + (T(1) - fy) * im_max_t;
+        for (size_t x = x0; x < x1; x++) {
+            T fx = static_cast<T>(x) / width_px_t;
+            T re = fx * re_max_t + (T(1) - fx) * re_min_t;
+            size_t i = out.index(x, y);
+            if (!out.dist) {
+                out.count[i] = formula::count<F>(formula::Cpx<T>{re, im}, k, zero, bailout2, this->mandel_count_max);
+                continue;
+            }
+
+            if (out.dist[i] >= 0.0f) continue;  // fillDisk で埋めた画素
+            formula::Distance<T> d;
+            out.count[i] = formula::countDistance<F>(formula::Cpx<T>{re, im}, k, zero, one, bailout2, this->mandel_count_max, d);
+            out.dist[i] = static_cast<float>(std::min<T>(d.estimate / pixel, T(1e30)));
+            if (fill) {
+                float lower_px = static_cast<float>(std::min<T>(d.lower / pixel, T(1e30)));
+                this->fillDisk(x, y, x0, x1, y1, out.count[i], lower_px, out);
+            }
         }
-        n++;
     }
+}
 
-    return n;
+template <typename T>
+void Mandelbrot::makeCountTileJit(FormulaJit::RowFunction<T> row, size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out) const {
+    // 座標と脱出半径は makeCountTileT と同じ
+    T re_min_t = toReal<T>(this->re_min), re_max_t = toReal<T>(this->re_max);
+    T im_min_t = toReal<T>(this->im_min), im_max_t = toReal<T>(this->im_max);
+    T width_px_t = static_cast<T>(this->width_px), height_px_t = static_cast<T>(this->height_px);
+    bool julia = this->formula == Formula::Julia;
+    T k_re = julia ? toReal<T>(this->julia_re) : T(0), k_im = julia ? toReal<T>(this->julia_im) : T(0);
+    T bailout2 = std::max<T>(4, k_re * k_re + k_im * k_im);
 
-    // Smooth coloring
-    /*
-    if (n == mandel_count_max) {
-        return n; // 集合内：整数で返す or 特別に扱う
+    T re[tile_size];
+    for (size_t x = x0; x < x1; x++) {
+        T fx = static_cast<T>(x) / width_px_t;
+        re[x - x0] = fx * re_max_t + (T(1) - fx) * re_min_t;
+    }
+    for (size_t y = y0; y < y1; y++) {
+        T fy = static_cast<T>(y) / height_px_t;
+        T im = fy * im_min_t + (T(1) - fy) * im_max_t;
+        row(re, im, x1 - x0, julia ? 1 : 0, k_re, k_im, bailout2, this->mandel_count_max, out.count + out.index(x0, y));
     }
-    Float log_zn = log(abs(z));
-    size_t nu = (size_t) (n + 1 - log(log_zn) / log(2.0));
-    return nu;
-    */
+}
+
+template <typename F>
+void Mandelbrot::makeCountTileCompact(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out) const {
+    using Cpx = formula::Cpx<double>;
+    constexpr size_t L = compact_lanes;
+
+    // 座標と脱出半径は makeCountTileT<double> と同じ式で計算する (結果が Double と一致する)
+    double re_min_t = toReal<double>(this->re_min), re_max_t = toReal<double>(this->re_max);
+    double im_min_t = toReal<double>(this->im_min), im_max_t = toReal<double>(this->im_max);
+    double width_px_t = static_cast<double>(this->width_px), height_px_t = static_cast<double>(this->height_px);
+    Cpx k{0.0, 0.0};
+    double bailout2 = 4;
+    if constexpr (F::julia) {
+        k = {toReal<double>(this->julia_re), toReal<double>(this->julia_im)};
+        bailout2 = std::max(bailout2, formula::norm2(k));
+    }
+    const size_t count_max = this->mandel_count_max;
+    const size_t tile_w = x1 - x0, pixels = tile_w * (y1 - y0);
+
+    const double count_max_d = static_cast<double>(count_max);
+
+    // レーンの状態 (構造体の配列ではなく配列の構造体にしてベクトル化する).
+    // n は formula::count と同じ数え方の反復回数, done は脱出したか count_max に達したら 1. 画素のないレーンは done.
+    // SSE2 には 64bit 整数の比較がないので, n と done も double にして z と同じ幅のベクトルに載せる
+    alignas(64) double zr[L], zi[L], cr[L], ci[L], n[L], done[L];
+    size_t pixel_of[L];
+    size_t next = 0;  // 次にレーンに入れるタイル内の画素
+    size_t live = 0;  // 画素の入っているレーン
+
+    auto load = [&](size_t lane) {
+        size_t x = x0 + next % tile_w, y = y0 + next / tile_w;
+        double fx = static_cast<double>(x) / width_px_t, fy = static_cast<double>(y) / height_px_t;
+        double re = fx * re_max_t + (1.0 - fx) * re_min_t;
+        double im = fy * im_min_t + (1.0 - fy) * im_max_t;
+        // Multibrot は z_0 = 0, c = 画素. Julia は z_0 = 画素, c = k
+        zr[lane] = F::julia ? re : 0.0;
+        zi[lane] = F::julia ? im : 0.0;
+        cr[lane] = F::julia ? k.re : re;
+        ci[lane] = F::julia ? k.im : im;
+        n[lane] = 0.0;
+        done[lane] = count_max == 0 ? 1.0 : 0.0;
+        pixel_of[lane] = next++;
+        live++;
+    };
+    for (size_t lane = 0; lane < L; lane++) {
+        zr[lane] = zi[lane] = cr[lane] = ci[lane] = n[lane] = 0.0;
+        done[lane] = 1.0;
+        pixel_of[lane] = SIZE_MAX;
+        if (next < pixels) load(lane);
+    }
+
+    uint64_t slots = 0, active = 0;
+    while (live > 0) {
+        // compact_chunk 回ずつ全レーンを反復する
+        for (size_t s = 0; s < compact_chunk; s++) {
+            uint64_t running = 0;
+            for (size_t lane = 0; lane < L; lane++) running += done[lane] == 0.0;
+            if (running == 0) break;  // 全レーンが終わったらすぐ詰め直す
+            slots += L;
+            active += running;
+
+            // 回数が定数で分岐のないループなので -O2 でベクトル化される. omp simd を付けると
+            // Cpx の一時変数がレーンごとの配列に置かれてベクトル化されなくなる (GCC 12)
+            for (size_t lane = 0; lane < L; lane++) {
+                // 終わったレーンも z は更新し続ける (z を条件付きで書くと分岐になりベクトル化されない).
+                // n と done は max で固定されるので, z が発散して inf や NaN になっても結果は変わらない
+                Cpx z = formula::add(formula::ipow<F::degree>(Cpx{zr[lane], zi[lane]}), Cpx{cr[lane], ci[lane]});
+                zr[lane] = z.re;
+                zi[lane] = z.im;
+                double escape = formula::norm2(z) > bailout2 ? 1.0 : 0.0;
+                double n_next = n[lane] + (1.0 - std::max(done[lane], escape));
+                n[lane] = n_next;
+                done[lane] = std::max(done[lane], std::max(escape, n_next >= count_max_d ? 1.0 : 0.0));
+            }
+        }
+
+        // 終わったレーンの反復回数を書き込み, 未計算の画素を詰める
+        for (size_t lane = 0; lane < L; lane++) {
+            if (done[lane] == 0.0 || pixel_of[lane] == SIZE_MAX) continue;
+            size_t p = pixel_of[lane];
+            out.count[out.index(x0 + p % tile_w, y0 + p / tile_w)] = static_cast<size_t>(n[lane]);
+            pixel_of[lane] = SIZE_MAX;
+            live--;
+            if (next < pixels) load(lane);
+        }
+    }
+
+    if (out.stats) {
+        out.stats->lane_slots += slots;
+        out.stats->lane_active += active;
+    }
+}
+
+template <typename F>
+void Mandelbrot::makeCountTileMpfr(size_t x0, size_t y0, size_t x1, size_t y1, const TileTarget& out, bool disk_fill) const {
+    // 全ての一時変数をこのインスタンスの精度で確保する (Precision.hpp)
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    formula::MpcScratch scratch(bits);
+    MpcVar p(bits), k(bits);
+    MpfrVar bailout2(bits), pixel(bits), work1(bits), work2(bits);
+
+    // Julia の c. 脱出半径は max(2, |c|)
+    mpfr_set_ui(bailout2, 4, MPFR_RNDN);
+    mpc_set_ui(k, 0, MPC_RNDNN);
+    if constexpr (F::julia) {
+        mpc_set_fr_fr(k, this->julia_re.backend().data(), this->julia_im.backend().data(), MPC_RNDNN);
+        mpc_norm(work1, k, MPFR_RNDN);
+        if (mpfr_cmp(work1, bailout2) > 0) mpfr_set(bailout2, work1, MPFR_RNDN);
+    }
+
+    // 距離の単位にする画素間隔 (縦横で違えば大きい方)
+    mpfr_div_ui(pixel, this->width_target.backend().data(), this->width_px, MPFR_RNDN);
+    mpfr_div_ui(work1, this->height_target.backend().data(), this->height_px, MPFR_RNDN);
+    if (mpfr_cmp(work1, pixel) > 0) mpfr_set(pixel, work1, MPFR_RNDN);
+    bool fill = disk_fill && !F::julia && F::degree == 2;
+    if (out.dist) {
+        for (size_t y = y0; y < y1; y++) std::fill(out.dist + out.index(x0, y), out.dist + out.index(x1, y), -1.0f);
+    }
+
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t x = x0; x < x1; x++) {
+            size_t i = out.index(x, y);
+            if (!out.dist) {
+                this->getComplexAt(x, y, p, work1, work2);
+                out.count[i] = formula::countMpc<F>(p, k, bailout2, this->mandel_count_max, scratch);
+                continue;
+            }
+
+            if (out.dist[i] >= 0.0f) continue;  // fillDisk で埋めた画素
+            this->getComplexAt(x, y, p, work1, work2);
+            formula::Distance<double> d;
+            out.count[i] = formula::countDistanceMpc<F>(p, k, bailout2, this->mandel_count_max, pixel, scratch, d);
+            out.dist[i] = static_cast<float>(std::min(d.estimate, 1e30));
+            if (fill) {
+                float lower_px = static_cast<float>(std::min(d.lower, 1e30));
+                this->fillDisk(x, y, x0, x1, y1, out.count[i], lower_px, out);
+            }
+        }
+    }
+}
+
+void Mandelbrot::fillDisk(size_t x, size_t y, size_t x0, size_t x1, size_t y1,
+                          size_t n, float lower_px, const TileTarget& out) const {
+    if (!(lower_px > 1.0f)) return;  // 隣の画素まで届かない
+
+    // 走査順で後ろの画素 (同じ行の右と下の行) だけが未計算
+    size_t r = static_cast<size_t>(std::min(lower_px, static_cast<float>(tile_size)));
+    size_t x_begin = (x >= x0 + r) ? x - r : x0;
+    size_t x_end = std::min(x1, x + r + 1);
+    size_t y_end = std::min(y1, y + r + 1);
+    for (size_t yy = y; yy < y_end; yy++) {
+        for (size_t xx = x_begin; xx < x_end; xx++) {
+            size_t i = out.index(xx, yy);
+            if (out.dist[i] >= 0.0f) continue;
+            float dx = static_cast<float>(xx) - static_cast<float>(x);
+            float dy = static_cast<float>(yy) - static_cast<float>(y);
+            float d = std::sqrt(dx * dx + dy * dy);
+            if (d < lower_px) {
+                out.count[i] = n;
+                out.dist[i] = lower_px - d;
+            }
+        }
+    }
+}
+
+void Mandelbrot::getComplexAt(size_t x, size_t y, mpc_ptr out, mpfr_ptr work1, mpfr_ptr work2) const {
+    // re = (x / width_px) * re_max + (1 - x / width_px) * re_min
+    mpfr_set_ui(work1, x, MPFR_RNDN);
+    mpfr_div_ui(work1, work1, this->width_px, MPFR_RNDN);
+    mpfr_mul(work2, work1, this->re_max.backend().data(), MPFR_RNDN);
+    mpfr_ui_sub(work1, 1, work1, MPFR_RNDN);
+    mpfr_mul(work1, work1, this->re_min.backend().data(), MPFR_RNDN);
+    mpfr_add(mpc_realref(out), work2, work1, MPFR_RNDN);
+
+    // im = (y / height_px) * im_min + (1 - y / height_px) * im_max
+    mpfr_set_ui(work1, y, MPFR_RNDN);
+    mpfr_div_ui(work1, work1, this->height_px, MPFR_RNDN);
+    mpfr_mul(work2, work1, this->im_min.backend().data(), MPFR_RNDN);
+    mpfr_ui_sub(work1, 1, work1, MPFR_RNDN);
+    mpfr_mul(work1, work1, this->im_max.backend().data(), MPFR_RNDN);
+    mpfr_add(mpc_imagref(out), work2, work1, MPFR_RNDN);
 }
 
 Color Mandelbrot::nToColor(size_t n) const {
-    Float step = Float(this->mandel_count_max / this->palette.size());
-    Float left = Float(0.0);
+    return palette.at(this->nToPaletteIndex(n));
+}
+
+size_t Mandelbrot::nToPaletteIndex(size_t n) const {
+    double step = static_cast<double>(this->mandel_count_max / this->palette.size());
+    double left = 0.0;
 
     for (size_t i = 0; i < this->palette.size(); i++) {
         if ((size_t) (left + step * i) <= n && n <= (size_t) (left + step * (i + 1))) {
-            return palette.at(i);
+            return i;
         }
     }
 
-    return palette.back();
+    return palette.size() - 1;
 }
 
-Color Mandelbrot::nToColor_EqHist(size_t n, std::vector<Float> brightness_table) const {
+Color Mandelbrot::nToColor_DE(size_t n, float dist_px) const {
     if (n >= this->mandel_count_max) {
         return Color(0, 0, 0);
     }
-    Float brightness = brightness_table[n];  // ← nに対応する明るさ
-    size_t idx = size_t(brightness * (palette.size() - 1));
+    float t = std::min(1.0f, dist_px / de_falloff_px);
+    size_t idx = static_cast<size_t>(t * (palette.size() - 1));
     return palette.at(idx);
 }
 
-std::vector<size_t> Mandelbrot::nHist() const {
+Color Mandelbrot::nToColor_EqHist(size_t n, const std::vector<double>& brightness_table) const {
+    size_t idx = this->nToPaletteIndex_EqHist(n, brightness_table);
+    return idx == palette_black ? Color(0, 0, 0) : palette.at(idx);
+}
+
+size_t Mandelbrot::nToPaletteIndex_EqHist(size_t n, const std::vector<double>& brightness_table) const {
+    if (n >= this->mandel_count_max) {
+        return palette_black;
+    }
+    double brightness = brightness_table[n];  // ← nに対応する明るさ
+    return size_t(brightness * (palette.size() - 1));
+}
+
+std::vector<size_t> Mandelbrot::nHist(const IterationView& n_vec) const {
     std::vector<size_t> hist(mandel_count_max + 1, 0);
-    std::vector<size_t> n_vec = this->makeCountVector();
 
     int n_threads = omp_get_max_threads();
     std::vector<std::vector<size_t>> local_hists(n_threads, std::vector<size_t>(mandel_count_max + 1, 0));
@@ -246,8 +1171,7 @@ std::vector<size_t> Mandelbrot::nHist() const {
     return hist;
 }
 
-std::vector<size_t> Mandelbrot::nCdf() const {
-    std::vector<size_t> hist = this->nHist();
+std::vector<size_t> Mandelbrot::nCdf(const std::vector<size_t>& hist) const {
     std::vector<size_t> cdf(hist.size(), 0);
 
     cdf[0] = hist[0];
@@ -260,7 +1184,7 @@ std::vector<size_t> Mandelbrot::nCdf() const {
 
 std::vector<Float> Mandelbrot::calcGradMag() const {
     std::vector<Float> mag;
-    std::vector<size_t> n_vec = this->makeCountVector();
+    FrameVector<size_t> n_vec = this->makeCountVector();
 
     for (size_t y = 1; y < this->height_px - 1; y++) {
         for (size_t x = 1; x < this->width_px - 1; x++) {
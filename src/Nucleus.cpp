@@ -0,0 +1,221 @@
+#include "Nucleus.hpp"
+#include <deque>
+#include "FloatExp.hpp"
+#include "Precision.hpp"
+
+
+namespace {
+
+// 精度 bits の複素数 (mpfr_t の組)
+struct MpfrComplex {
+    MpfrVar re, im;
+    explicit MpfrComplex(mpfr_prec_t bits) : re(bits), im(bits) {}
+};
+
+// z <- z^2 + c. t は作業用
+void squareAdd(MpfrComplex& z, mpfr_srcptr cr, mpfr_srcptr ci, mpfr_ptr t) {
+    mpfr_sqr(t, z.re, MPFR_RNDN);
+    mpfr_fms(t, z.im, z.im, t, MPFR_RNDN);  // zi^2 - zr^2
+    mpfr_mul(z.im, z.re, z.im, MPFR_RNDN);
+    mpfr_mul_2ui(z.im, z.im, 1, MPFR_RNDN);
+    mpfr_add(z.im, z.im, ci, MPFR_RNDN);
+    mpfr_sub(z.re, cr, t, MPFR_RNDN);
+}
+
+// a <- a * b. t1, t2 は作業用
+void mulAssign(MpfrComplex& a, const MpfrComplex& b, mpfr_ptr t1, mpfr_ptr t2) {
+    mpfr_mul(t1, a.re, b.re, MPFR_RNDN);
+    mpfr_mul(t2, a.im, b.im, MPFR_RNDN);
+    mpfr_sub(t1, t1, t2, MPFR_RNDN);
+    mpfr_mul(t2, a.re, b.im, MPFR_RNDN);
+    mpfr_mul(a.im, a.im, b.re, MPFR_RNDN);
+    mpfr_add(a.im, a.im, t2, MPFR_RNDN);
+    mpfr_set(a.re, t1, MPFR_RNDN);
+}
+
+// out <- a / b. t1, t2, den は作業用. b = 0 なら false
+bool divide(MpfrComplex& out, const MpfrComplex& a, const MpfrComplex& b, mpfr_ptr t1, mpfr_ptr t2, mpfr_ptr den) {
+    mpfr_sqr(den, b.re, MPFR_RNDN);
+    mpfr_fma(den, b.im, b.im, den, MPFR_RNDN);
+    if (mpfr_zero_p(den)) return false;
+    mpfr_mul(t1, a.re, b.re, MPFR_RNDN);
+    mpfr_fma(t1, a.im, b.im, t1, MPFR_RNDN);  // ar br + ai bi
+    mpfr_mul(t2, a.im, b.re, MPFR_RNDN);
+    mpfr_mul(out.im, a.re, b.im, MPFR_RNDN);
+    mpfr_sub(t2, t2, out.im, MPFR_RNDN);  // ai br - ar bi
+    mpfr_div(out.re, t1, den, MPFR_RNDN);
+    mpfr_div(out.im, t2, den, MPFR_RNDN);
+    return true;
+}
+
+FloatExp toFloatExp(mpfr_srcptr x) {
+    long e = 0;
+    double m = mpfr_get_d_2exp(&e, x, MPFR_RNDN);
+    return FloatExp(m, e);
+}
+
+// 多角形 z[0..3] が原点を囲めば true. 原点から正の実軸方向の半直線と辺の交差を数える.
+// 原点の近くでは z が double の範囲より小さくなるので FloatExp で判定する
+bool surroundsOrigin(const FloatExp (&zr)[4], const FloatExp (&zi)[4]) {
+    const FloatExp zero(0.0);
+    bool inside = false;
+    for (size_t k = 0; k < 4; k++) {
+        size_t j = (k + 1) % 4;
+        bool a_up = zi[k] > zero, b_up = zi[j] > zero;
+        if (a_up == b_up) continue;
+        // 辺と実軸の交点 x = (ar bi - ai br) / (bi - ai) が正か. bi - ai の符号は b_up で決まる
+        FloatExp cross = zr[k] * zi[j] - zi[k] * zr[j];
+        if ((cross > zero) == b_up) inside = !inside;
+    }
+    return inside;
+}
+
+}  // namespace
+
+
+NucleusLocator::NucleusLocator(size_t precision) : precision(precision) {}
+
+size_t NucleusLocator::getPrecision() const {
+    return this->precision;
+}
+
+size_t NucleusLocator::findPeriod(const Float& re, const Float& im, const Float& radius, size_t max_period) const {
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar t(bits);
+
+    // 4隅を一周する順に並べる: 左下, 右下, 右上, 左上
+    const int sign_re[4] = {-1, 1, 1, -1}, sign_im[4] = {-1, -1, 1, 1};
+    std::deque<MpfrComplex> c, z;  // MpfrVar は移動できないので deque に作る
+    for (size_t k = 0; k < 4; k++) {
+        c.emplace_back(bits);
+        z.emplace_back(bits);
+        if (sign_re[k] > 0) mpfr_add(c[k].re, re.backend().data(), radius.backend().data(), MPFR_RNDN);
+        else mpfr_sub(c[k].re, re.backend().data(), radius.backend().data(), MPFR_RNDN);
+        if (sign_im[k] > 0) mpfr_add(c[k].im, im.backend().data(), radius.backend().data(), MPFR_RNDN);
+        else mpfr_sub(c[k].im, im.backend().data(), radius.backend().data(), MPFR_RNDN);
+        mpfr_set_zero(z[k].re, 1);
+        mpfr_set_zero(z[k].im, 1);
+    }
+
+    FloatExp zr[4], zi[4];
+    for (size_t n = 1; n <= max_period; n++) {
+        for (size_t k = 0; k < 4; k++) {
+            squareAdd(z[k], c[k].re, c[k].im, t);
+            zr[k] = toFloatExp(z[k].re);
+            zi[k] = toFloatExp(z[k].im);
+            // 隅が発散したら, それより長い周期は box period では調べられない
+            if (zr[k] * zr[k] + zi[k] * zi[k] > FloatExp(65536.0)) return 0;
+        }
+        if (surroundsOrigin(zr, zi)) return n;
+    }
+    return 0;
+}
+
+bool NucleusLocator::newton(size_t period, Float& re, Float& im, size_t max_steps, size_t* steps) const {
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar t1(bits), t2(bits), t3(bits);
+    MpfrComplex c(bits), z(bits), dz(bits), delta(bits);
+    mpfr_set(c.re, re.backend().data(), MPFR_RNDN);
+    mpfr_set(c.im, im.backend().data(), MPFR_RNDN);
+    // |delta| がこれより小さくなったら収束とする (|c| ~ 1 に対して精度の下位 8 bit を除いた桁)
+    const mpfr_exp_t tolerance_exp = -(bits - 8);
+
+    bool converged = false;
+    size_t step = 0;
+    while (step < max_steps && !converged) {
+        step++;
+        mpfr_set_zero(z.re, 1);
+        mpfr_set_zero(z.im, 1);
+        mpfr_set_zero(dz.re, 1);
+        mpfr_set_zero(dz.im, 1);
+        for (size_t i = 0; i < period; i++) {
+            // dz <- 2 z dz + 1 (z は更新前の値)
+            mulAssign(dz, z, t1, t2);
+            mpfr_mul_2ui(dz.re, dz.re, 1, MPFR_RNDN);
+            mpfr_mul_2ui(dz.im, dz.im, 1, MPFR_RNDN);
+            mpfr_add_ui(dz.re, dz.re, 1, MPFR_RNDN);
+            squareAdd(z, c.re, c.im, t1);
+        }
+        if (!divide(delta, z, dz, t1, t2, t3)) return false;
+        mpfr_sub(c.re, c.re, delta.re, MPFR_RNDN);
+        mpfr_sub(c.im, c.im, delta.im, MPFR_RNDN);
+        if (!mpfr_number_p(c.re) || !mpfr_number_p(c.im)) return false;
+
+        converged = (mpfr_zero_p(delta.re) || mpfr_get_exp(delta.re) < tolerance_exp)
+                 && (mpfr_zero_p(delta.im) || mpfr_get_exp(delta.im) < tolerance_exp);
+    }
+    if (steps) *steps = step;
+    if (!converged) return false;
+
+    re = makeFloat("0", this->precision);
+    im = makeFloat("0", this->precision);
+    mpfr_set(re.backend().data(), c.re, MPFR_RNDN);
+    mpfr_set(im.backend().data(), c.im, MPFR_RNDN);
+    return true;
+}
+
+Float NucleusLocator::atomSize(size_t period, const Float& re, const Float& im) const {
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar t1(bits), t2(bits), t3(bits);
+    MpfrComplex z(bits), l(bits), b(bits), inv(bits), one(bits);
+    mpfr_set_zero(z.re, 1);
+    mpfr_set_zero(z.im, 1);
+    mpfr_set_ui(l.re, 1, MPFR_RNDN);
+    mpfr_set_zero(l.im, 1);
+    mpfr_set_ui(b.re, 1, MPFR_RNDN);
+    mpfr_set_zero(b.im, 1);
+    mpfr_set_ui(one.re, 1, MPFR_RNDN);
+    mpfr_set_zero(one.im, 1);
+
+    for (size_t i = 1; i < period; i++) {
+        squareAdd(z, re.backend().data(), im.backend().data(), t1);
+        mulAssign(l, z, t1, t2);  // l <- 2 z l
+        mpfr_mul_2ui(l.re, l.re, 1, MPFR_RNDN);
+        mpfr_mul_2ui(l.im, l.im, 1, MPFR_RNDN);
+        if (!divide(inv, one, l, t1, t2, t3)) break;  // b <- b + 1 / l
+        mpfr_add(b.re, b.re, inv.re, MPFR_RNDN);
+        mpfr_add(b.im, b.im, inv.im, MPFR_RNDN);
+    }
+
+    // size = 1 / (b l^2) の絶対値
+    mulAssign(b, l, t1, t2);
+    mulAssign(b, l, t1, t2);
+    Float size = makeFloat("0", this->precision);
+    mpfr_hypot(t1, b.re, b.im, MPFR_RNDN);
+    mpfr_ui_div(size.backend().data(), 1, t1, MPFR_RNDN);
+    return size;
+}
+
+NucleusLocator::Result NucleusLocator::locate(
+    const Float& re, const Float& im, const Float& radius, size_t max_period, size_t max_steps
+) const {
+    Result result;
+    result.period = this->findPeriod(re, im, radius, max_period);
+    if (result.period == 0) {
+        result.error = "no period found up to " + std::to_string(max_period);
+        return result;
+    }
+
+    result.re = makeFloat(re, this->precision);
+    result.im = makeFloat(im, this->precision);
+    if (!this->newton(result.period, result.re, result.im, max_steps, &result.newton_steps)) {
+        result.error = "Newton's method did not converge for period " + std::to_string(result.period);
+        return result;
+    }
+
+    // 別の成分に収束していないか (中心は正方形の中にあるはず)
+    mpfr_prec_t bits = digitsToBits(this->precision);
+    MpfrVar dr(bits), di(bits), limit(bits);
+    mpfr_sub(dr, result.re.backend().data(), re.backend().data(), MPFR_RNDN);
+    mpfr_sub(di, result.im.backend().data(), im.backend().data(), MPFR_RNDN);
+    mpfr_hypot(dr, dr, di, MPFR_RNDN);
+    mpfr_mul_2ui(limit, radius.backend().data(), 1, MPFR_RNDN);
+    if (mpfr_cmp(dr, limit) > 0) {
+        result.error = "Newton's method left the view for period " + std::to_string(result.period);
+        return result;
+    }
+
+    result.size = this->atomSize(result.period, result.re, result.im);
+    result.found = true;
+    return result;
+}
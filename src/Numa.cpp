@@ -0,0 +1,204 @@
+#include "Numa.hpp"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+
+namespace {
+
+// "0-3,8-11" の形式の CPU リスト
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        size_t dash = item.find('-');
+        try {
+            int first = std::stoi(item.substr(0, dash));
+            int last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+            for (int c = first; c <= last; c++) cpus.push_back(c);
+        } catch (const std::exception&) {
+            return {};
+        }
+    }
+    return cpus;
+}
+
+std::string readLine(const std::string& path) {
+    std::ifstream ifs(path);
+    std::string line;
+    std::getline(ifs, line);
+    return line;
+}
+
+}  // namespace
+
+
+Topology::Topology() {
+    // このプロセスに許された CPU
+    std::vector<int> allowed;
+    #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &set)) allowed.push_back(c);
+            }
+        }
+    #endif
+    if (allowed.empty()) allowed.push_back(0);
+
+    // NUMA ノードをソケットとして扱う. ノードの情報がなければ物理パッケージで分ける
+    std::map<int, size_t> socket_of;
+    for (int node : parseCpuList(readLine("/sys/devices/system/node/online"))) {
+        std::string list = readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        for (int c : parseCpuList(list)) socket_of[c] = static_cast<size_t>(node);
+    }
+    if (socket_of.empty()) {
+        for (int c : allowed) {
+            std::string id = readLine("/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/physical_package_id");
+            socket_of[c] = id.empty() ? 0 : static_cast<size_t>(std::max(0, std::atoi(id.c_str())));
+        }
+    }
+
+    // 許された CPU のあるソケットだけを 0 から番号付けし直す
+    std::map<size_t, std::vector<int>> grouped;
+    for (int c : allowed) grouped[socket_of.count(c) ? socket_of[c] : 0].push_back(c);
+    int max_cpu = allowed.back();
+    this->cpu_socket.assign(static_cast<size_t>(max_cpu) + 1, 0);
+    for (auto& g : grouped) {
+        for (int c : g.second) this->cpu_socket[c] = this->sockets.size();
+        this->sockets.push_back(std::move(g.second));
+    }
+}
+
+const Topology& Topology::host() {
+    static const Topology topology;
+    return topology;
+}
+
+size_t Topology::socketCount() const {
+    return this->sockets.size();
+}
+
+size_t Topology::cpuCount() const {
+    size_t n = 0;
+    for (const auto& s : this->sockets) n += s.size();
+    return n;
+}
+
+size_t Topology::socketOfCpu(int cpu) const {
+    if (cpu < 0 || static_cast<size_t>(cpu) >= this->cpu_socket.size()) return 0;
+    return this->cpu_socket[cpu];
+}
+
+int Topology::cpuForThread(size_t thread, Pinning pinning) const {
+    if (pinning == Pinning::Scatter) {
+        const std::vector<int>& cpus = this->sockets[thread % this->sockets.size()];
+        return cpus[(thread / this->sockets.size()) % cpus.size()];
+    }
+    // Compact (None でも同じ順序を返す)
+    thread %= this->cpuCount();
+    for (const auto& s : this->sockets) {
+        if (thread < s.size()) return s[thread];
+        thread -= s.size();
+    }
+    return this->sockets.front().front();
+}
+
+std::string Topology::pinningName(Pinning pinning) {
+    switch (pinning) {
+        case Pinning::Compact: return "compact";
+        case Pinning::Scatter: return "scatter";
+        default: return "none";
+    }
+}
+
+Pinning Topology::pinningFromName(const std::string& name) {
+    if (name == "none") return Pinning::None;
+    if (name == "compact") return Pinning::Compact;
+    if (name == "scatter") return Pinning::Scatter;
+    throw std::invalid_argument("Unknown pinning: " + name);
+}
+
+
+bool pinCurrentThread(int cpu) {
+    #ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    #else
+        (void)cpu;
+        return false;
+    #endif
+}
+
+int currentCpu() {
+    #ifdef __linux__
+        return sched_getcpu();
+    #else
+        return -1;
+    #endif
+}
+
+
+SocketPartition::SocketPartition(const std::vector<size_t>& thread_socket, size_t rows, size_t align) {
+    // ソケット番号の小さい順にグループを作る
+    std::vector<size_t> used(thread_socket);
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    this->group_socket = used;
+    this->group_threads.assign(used.size(), 0);
+    this->thread_group.resize(thread_socket.size());
+    this->thread_rank.resize(thread_socket.size());
+    for (size_t t = 0; t < thread_socket.size(); t++) {
+        size_t g = std::lower_bound(used.begin(), used.end(), thread_socket[t]) - used.begin();
+        this->thread_group[t] = g;
+        this->thread_rank[t] = this->group_threads[g]++;
+    }
+
+    // 行はスレッド数に比例して, align 行単位で分ける
+    size_t units = (rows + align - 1) / align;
+    size_t threads = std::max<size_t>(1, thread_socket.size());
+    this->group_begin.assign(used.size() + 1, 0);
+    size_t cumulative = 0;
+    for (size_t g = 0; g < used.size(); g++) {
+        cumulative += this->group_threads[g];
+        this->group_begin[g + 1] = std::min(rows, units * cumulative / threads * align);
+    }
+    this->group_begin.back() = rows;
+}
+
+size_t SocketPartition::groupCount() const {
+    return this->group_socket.size();
+}
+
+size_t SocketPartition::groupOfThread(size_t thread) const {
+    return this->thread_group[thread];
+}
+
+size_t SocketPartition::socketOfGroup(size_t group) const {
+    return this->group_socket[group];
+}
+
+size_t SocketPartition::threadsInGroup(size_t group) const {
+    return this->group_threads[group];
+}
+
+std::pair<size_t, size_t> SocketPartition::groupRows(size_t group) const {
+    return {this->group_begin[group], this->group_begin[group + 1]};
+}
+
+std::pair<size_t, size_t> SocketPartition::threadRows(size_t thread) const {
+    size_t g = this->thread_group[thread];
+    auto [first, last] = this->groupRows(g);
+    size_t n = this->group_threads[g], r = this->thread_rank[thread];
+    return {first + (last - first) * r / n, first + (last - first) * (r + 1) / n};
+}
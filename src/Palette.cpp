@@ -59,6 +59,27 @@ void Palette::dedupe() {
 }
 */
 
+// rotated: shift 色分回転. 結果の i 番目は元の (i + shift) 番目で, 小数部は隣の色と線形補間
+Palette Palette::rotated(double shift) const {
+    Palette p;
+    size_t n = this->size();
+    if (n == 0) return p;
+
+    double base = std::floor(shift);
+    double frac = shift - base;
+    // 負の shift も [0, n) に収める
+    size_t offset = static_cast<size_t>(std::fmod(std::fmod(base, static_cast<double>(n)) + n, static_cast<double>(n)));
+    p.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        const Color& a = this->at((i + offset) % n);
+        const Color& b = this->at((i + offset + 1) % n);
+        p.add(Color(static_cast<int>(std::lround(a[0] + (b[0] - a[0]) * frac)),
+                    static_cast<int>(std::lround(a[1] + (b[1] - a[1]) * frac)),
+                    static_cast<int>(std::lround(a[2] + (b[2] - a[2]) * frac))));
+    }
+    return p;
+}
+
 
 // Sort
 
@@ -180,6 +201,53 @@ Palette Palette::makeGrayScale(size_t n) {
     return p;
 }
 
+// interpolate: 同じ色数の a と b を色ごとに t (0~1) で線形補間
+Palette Palette::interpolate(const Palette& a, const Palette& b, double t) {
+    if (a.size() != b.size()) {
+        throw std::invalid_argument("Palettes to interpolate must have the same size");
+    }
+    Palette p;
+    p.reserve(a.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        p.add(Color(static_cast<int>(std::lround(a[i][0] + (b[i][0] - a[i][0]) * t)),
+                    static_cast<int>(std::lround(a[i][1] + (b[i][1] - a[i][1]) * t)),
+                    static_cast<int>(std::lround(a[i][2] + (b[i][2] - a[i][2]) * t))));
+    }
+    return p;
+}
+
+
+// fromSpec: 文字列からパレットを作成
+Palette Palette::fromSpec(const std::string& spec) {
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (true) {
+        size_t end = spec.find(':', begin);
+        fields.push_back(spec.substr(begin, end - begin));
+        if (end == std::string::npos) break;
+        begin = end + 1;
+    }
+
+    const std::string& kind = fields[0];
+    size_t expected = (kind == "gray") ? 2 : 6;
+    if ((kind != "gray" && kind != "hue" && kind != "sat" && kind != "bri") || fields.size() != expected) {
+        throw std::invalid_argument("Invalid palette spec: " + spec);
+    }
+
+    try {
+        size_t n = std::stoul(fields[1]);
+        if (kind == "gray") return makeGrayScale(n);
+
+        double a = std::stod(fields[2]), b = std::stod(fields[3]);
+        double c = std::stod(fields[4]), d = std::stod(fields[5]);
+        if (kind == "hue") return makeGradationHue(n, a, b, c, d);
+        if (kind == "sat") return makeGradationSat(n, a, b, c, d);
+        return makeGradationBri(n, a, b, c, d);
+    } catch (const std::logic_error&) {  // stoul / stod の失敗
+        throw std::invalid_argument("Invalid palette spec: " + spec);
+    }
+}
+
 
 // Operator overload
 
@@ -0,0 +1,421 @@
+#include "RenderCoordinator.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "RenderWorker.hpp"
+#include "Socket.hpp"
+
+
+namespace {
+
+// "key=VALUE" の VALUE. なければ空
+std::string valueOf(const std::string& line, const std::string& key) {
+    size_t pos = line.find(" " + key + "=");
+    if (pos == std::string::npos) return "";
+    size_t begin = pos + key.size() + 2;
+    return line.substr(begin, line.find(' ', begin) - begin);
+}
+
+double median(std::vector<double> v) {
+    if (v.empty()) return 0.0;
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    return v[v.size() / 2];
+}
+
+}  // namespace
+
+
+RenderCoordinator::RenderCoordinator(const Options& options) : options(options) {
+    this->options.tile_px = std::max<size_t>(32, (options.tile_px + 31) / 32 * 32);
+    this->options.max_frames_in_flight = std::max<size_t>(1, options.max_frames_in_flight);
+    this->options.max_attempts = std::max<size_t>(1, options.max_attempts);
+}
+
+RenderCoordinator::~RenderCoordinator() {
+    this->shutdown();
+}
+
+size_t RenderCoordinator::run(const std::string& address, const std::vector<RenderJob>& jobs, std::ostream& log) {
+    this->jobs = jobs;
+    this->listen_fd = listenSocket(address);
+    if (this->listen_fd < 0) throw std::runtime_error("Failed to listen on: " + address);
+    this->threads.emplace_back(&RenderCoordinator::acceptLoop, this);
+    if (this->options.local_workers > 0) this->spawnLocalWorkers(address);
+
+    BatchRenderer renderer;
+    size_t done = 0, failed = 0;
+    while (done < this->jobs.size()) {
+        size_t index;
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.wait_for(lock, std::chrono::seconds(1), [this] { return !this->completed.empty(); });
+            if (this->completed.empty()) {
+                // ローカルのワーカーだけで描画していて全て終了した
+                bool any_alive = std::any_of(this->connections.begin(), this->connections.end(),
+                                             [](const auto& c) { return c->alive; });
+                if (this->options.local_workers > 0 && !any_alive && !this->localWorkersAlive()) {
+                    while (this->next_frame < this->jobs.size()) {
+                        size_t index = this->next_frame++;
+                        this->frames[index].job = this->jobs[index];
+                    }
+                    for (auto& f : this->frames) {
+                        if (f.second.remaining > 0 || f.second.tiles == 0) this->failFrame(f.first, "all local workers exited");
+                    }
+                }
+                continue;
+            }
+            index = this->completed.front();
+            this->completed.pop_front();
+            frame = std::move(this->frames.at(index));
+            this->frames.erase(index);
+        }
+        this->cv.notify_all();  // 次のフレームを組み立てられる
+
+        const RenderJob& job = frame.job;
+        std::string error = frame.error;
+        if (error.empty()) {
+            try {
+                job.apply(renderer.getEngine());
+                bool saved = job.distance ? renderer.colorize(job, frame.counts, frame.dist)
+                                          : renderer.colorize(job, frame.counts);
+                if (!saved) error = "Failed to save PNG";
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        done++;
+        double seconds = std::chrono::duration<double>(Clock::now() - frame.started).count();
+        log << "[" << done << "/" << this->jobs.size() << "] " << job.output << ": ";
+        if (error.empty()) {
+            log << seconds << " s (" << frame.tiles << " tiles)" << std::endl;
+        } else {
+            log << "FAILED: " << error << std::endl;
+            failed++;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        log << "workers:";
+        for (const auto& c : this->connections) log << " " << c->name << "=" << c->tiles;
+        log << " | reassigned " << this->reassigned << ", duplicated " << this->duplicated << std::endl;
+    }
+    this->shutdown();
+    return failed;
+}
+
+void RenderCoordinator::shutdown() {
+    std::vector<std::thread> joining;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->finished = true;
+        if (this->listen_fd >= 0) ::shutdown(this->listen_fd, SHUT_RDWR);
+        for (const auto& c : this->connections) {
+            std::lock_guard<std::mutex> write_lock(c->write_mutex);
+            writeLine(c->fd, "quit");
+            ::shutdown(c->fd, SHUT_RDWR);
+        }
+        joining.swap(this->threads);
+    }
+    this->cv.notify_all();
+    for (std::thread& t : joining) t.join();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (const auto& c : this->connections) ::close(c->fd);
+    this->connections.clear();
+    if (this->listen_fd >= 0) ::close(this->listen_fd);
+    this->listen_fd = -1;
+    for (pid_t pid : this->children) ::waitpid(pid, nullptr, 0);
+    this->children.clear();
+}
+
+void RenderCoordinator::acceptLoop() {
+    while (true) {
+        int fd = ::accept(this->listen_fd, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->finished) {
+            if (fd >= 0) ::close(fd);
+            break;
+        }
+        if (fd < 0) continue;
+        this->connections.push_back(std::make_unique<Connection>());
+        Connection& conn = *this->connections.back();
+        conn.id = this->connections.size() - 1;
+        conn.fd = fd;
+        conn.name = "worker" + std::to_string(conn.id);
+        this->threads.emplace_back(&RenderCoordinator::connectionLoop, this, std::ref(conn));
+    }
+}
+
+void RenderCoordinator::connectionLoop(Connection& conn) {
+    SocketReader reader(conn.fd);
+    std::string line;
+    if (reader.readLine(line) && line.compare(0, 5, "hello") == 0) {
+        std::string pid = valueOf(line, "pid");
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!pid.empty()) conn.name += "(pid " + pid + ")";
+    } else {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        conn.alive = false;
+        return;
+    }
+
+    uint64_t id;
+    std::string job_line;
+    size_t unit_pixels;
+    bool unit_distance;
+    std::vector<uint8_t> payload;
+    while (this->nextUnit(conn, id, job_line, unit_pixels, unit_distance)) {
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(conn.write_mutex);
+            sent = writeLine(conn.fd, job_line);
+        }
+        if (!sent || !reader.readLine(line)) {
+            this->fail(conn, id, "worker disconnected");
+            break;
+        }
+
+        std::string command = line.substr(0, line.find(' '));
+        if (valueOf(line, "id") != std::to_string(id)) {
+            this->fail(conn, id, "protocol error: " + line);
+            break;
+        }
+        if (command == "result") {
+            // 確保する前に渡したタイルの大きさと比べる. 違えば続くバイナリの長さを信用できないので切断する
+            std::string pixels = valueOf(line, "pixels");
+            bool distance = valueOf(line, "distance") == "1";
+            if (pixels != std::to_string(unit_pixels) || distance != unit_distance) {
+                this->fail(conn, id, "result size mismatch: " + line);
+                break;
+            }
+            payload.resize(unit_pixels * 4 * (distance ? 2 : 1));
+            if (!reader.readBytes(payload.data(), payload.size())) {
+                this->fail(conn, id, "worker disconnected");
+                break;
+            }
+            if (!this->deliver(conn, id, std::strtod(valueOf(line, "seconds").c_str(), nullptr), payload, distance)) {
+                this->fail(conn, id, "result size mismatch");
+            }
+        } else if (command == "error") {
+            size_t message = line.find(' ', line.find(" id=") + 1);
+            this->fail(conn, id, message == std::string::npos ? "worker error" : line.substr(message + 1));
+        } else {
+            this->fail(conn, id, "cancelled");  // 他のワーカーが先に終えたタイル
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    conn.alive = false;
+}
+
+bool RenderCoordinator::nextUnit(Connection& conn, uint64_t& id, std::string& line, size_t& pixels, bool& distance) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (!this->finished) {
+        Unit* unit = nullptr;
+        while (!unit && !this->pending.empty()) {
+            auto it = this->units.find(this->pending.front());
+            this->pending.pop_front();
+            if (it != this->units.end() && it->second.running.empty()) {
+                id = it->first;
+                unit = &it->second;
+            }
+        }
+
+        // 渡すタイルがなければ次のフレームを分ける
+        if (!unit && this->frames.size() < this->options.max_frames_in_flight && this->next_frame < this->jobs.size()) {
+            this->admitFrame();
+            continue;
+        }
+
+        // 遅いタイルを手の空いたワーカーにも渡す
+        if (!unit) {
+            double limit = std::max(this->options.min_slow_s, this->options.slow_factor * median(this->unit_seconds));
+            auto now = Clock::now();
+            for (auto& u : this->units) {
+                if (u.second.running.size() == 1 && u.second.running[0] != conn.id
+                    && std::chrono::duration<double>(now - u.second.started).count() > limit) {
+                    id = u.first;
+                    unit = &u.second;
+                    this->duplicated++;
+                    break;
+                }
+            }
+        }
+
+        if (unit) {
+            if (unit->running.empty()) unit->started = Clock::now();
+            unit->running.push_back(conn.id);
+            RenderJob job = this->frames.at(unit->frame).job;
+            job.output.clear();
+            job.precision = std::to_string(job.resolvePrecision());
+            job.has_region = true;
+            job.region_x0 = unit->x0;
+            job.region_y0 = unit->y0;
+            job.region_x1 = unit->x1;
+            job.region_y1 = unit->y1;
+            line = "job id=" + std::to_string(id) + " " + job.toLine();
+            pixels = (unit->x1 - unit->x0) * (unit->y1 - unit->y0);
+            distance = job.distance;
+            return true;
+        }
+        this->cv.wait_for(lock, std::chrono::milliseconds(200));
+    }
+    return false;
+}
+
+void RenderCoordinator::admitFrame() {
+    size_t index = this->next_frame++;
+    Frame& frame = this->frames[index];
+    frame.job = this->jobs[index];
+    frame.started = Clock::now();
+    const RenderJob& job = frame.job;
+
+    if (job.output.empty()) {
+        this->failFrame(index, "output is not set");
+        return;
+    }
+    if (job.mandel_count_max > std::numeric_limits<uint32_t>::max()) {
+        this->failFrame(index, "mandel_count_max does not fit in 32 bits");
+        return;
+    }
+    // region 付きのジョブはその範囲だけを描画する
+    size_t fx0 = 0, fy0 = 0, fx1 = job.width_px, fy1 = job.height_px;
+    if (job.has_region) {
+        fx0 = std::min(job.region_x0, job.width_px);
+        fy0 = std::min(job.region_y0, job.height_px);
+        fx1 = std::max(fx0, std::min(job.region_x1, job.width_px));
+        fy1 = std::max(fy0, std::min(job.region_y1, job.height_px));
+    }
+    frame.counts.resize((fx1 - fx0) * (fy1 - fy0));
+    if (job.distance) frame.dist.resize(frame.counts.size());
+
+    size_t tile = this->options.tile_px;
+    for (size_t y = fy0; y < fy1; y += tile) {
+        for (size_t x = fx0; x < fx1; x += tile) {
+            uint64_t id = this->next_unit++;
+            Unit& unit = this->units[id];
+            unit.frame = index;
+            unit.x0 = x;
+            unit.y0 = y;
+            unit.x1 = std::min(x + tile, fx1);
+            unit.y1 = std::min(y + tile, fy1);
+            this->pending.push_back(id);
+            frame.tiles++;
+        }
+    }
+    frame.remaining = frame.tiles;
+    if (frame.tiles == 0) this->failFrame(index, "Empty region");
+    this->cv.notify_all();
+}
+
+bool RenderCoordinator::deliver(Connection& conn, uint64_t id, double seconds, const std::vector<uint8_t>& payload, bool distance) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->units.find(id);
+    if (it == this->units.end()) return true;  // 他のワーカーが先に返したか, フレームが失敗した
+    Unit unit = it->second;
+    Frame& frame = this->frames.at(unit.frame);
+
+    size_t w = unit.x1 - unit.x0, h = unit.y1 - unit.y0;
+    if (payload.size() != w * h * 4 * (distance ? 2 : 1) || distance != frame.job.distance) return false;
+
+    // フレームのバッファは region (なければ画像全体) の大きさ
+    const RenderJob& job = frame.job;
+    size_t fx0 = job.has_region ? std::min(job.region_x0, job.width_px) : 0;
+    size_t fy0 = job.has_region ? std::min(job.region_y0, job.height_px) : 0;
+    size_t stride = job.has_region ? std::min(job.region_x1, job.width_px) - fx0 : job.width_px;
+    for (size_t y = 0; y < h; y++) {
+        size_t row = (unit.y0 + y - fy0) * stride + (unit.x0 - fx0);
+        for (size_t x = 0; x < w; x++) {
+            frame.counts[row + x] = RenderWorker::decodeU32(payload.data() + (y * w + x) * 4);
+        }
+        if (distance) {
+            const uint8_t* dist = payload.data() + w * h * 4;
+            for (size_t x = 0; x < w; x++) {
+                uint32_t bits = RenderWorker::decodeU32(dist + (y * w + x) * 4);
+                std::memcpy(&frame.dist[row + x], &bits, 4);
+            }
+        }
+    }
+
+    // 同じタイルを描画中の他のワーカーは止める
+    for (size_t other : unit.running) {
+        if (other == conn.id) continue;
+        Connection& c = *this->connections[other];
+        std::lock_guard<std::mutex> write_lock(c.write_mutex);
+        writeLine(c.fd, "cancel id=" + std::to_string(id));
+    }
+    this->units.erase(it);
+    this->unit_seconds.push_back(seconds);
+    conn.tiles++;
+    if (--frame.remaining == 0) {
+        this->completed.push_back(unit.frame);
+        this->cv.notify_all();
+    }
+    return true;
+}
+
+void RenderCoordinator::fail(Connection& conn, uint64_t id, const std::string& error) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->units.find(id);
+    if (it == this->units.end()) return;
+    Unit& unit = it->second;
+    unit.running.erase(std::remove(unit.running.begin(), unit.running.end(), conn.id), unit.running.end());
+    if (error == "cancelled") {
+        if (unit.running.empty()) this->pending.push_front(id);
+        return;
+    }
+
+    if (++unit.attempts >= this->options.max_attempts) {
+        this->failFrame(unit.frame, "tile " + std::to_string(unit.x0) + "," + std::to_string(unit.y0) + ": " + error);
+    } else if (unit.running.empty()) {
+        this->pending.push_front(id);
+        this->reassigned++;
+    }
+    this->cv.notify_all();
+}
+
+void RenderCoordinator::failFrame(size_t frame, const std::string& error) {
+    Frame& f = this->frames.at(frame);
+    if (!f.error.empty()) return;
+    f.error = error;
+    f.counts = FrameVector<size_t>();
+    f.dist = FrameVector<float>();
+    for (auto it = this->units.begin(); it != this->units.end();) {
+        if (it->second.frame == frame) it = this->units.erase(it);
+        else ++it;
+    }
+    this->completed.push_back(frame);
+    this->cv.notify_all();
+}
+
+void RenderCoordinator::spawnLocalWorkers(const std::string& address) {
+    for (size_t i = 0; i < this->options.local_workers; i++) {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            // ワーカーの標準出力 (omp_info など) は捨てる
+            int null_fd = ::open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) ::dup2(null_fd, STDOUT_FILENO);
+            const char* exe = this->options.worker_exe.c_str();
+            ::execl(exe, exe, "worker", address.c_str(), static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+        if (pid > 0) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->children.push_back(pid);
+        }
+    }
+}
+
+bool RenderCoordinator::localWorkersAlive() {
+    auto exited = [](pid_t pid) { return ::waitpid(pid, nullptr, WNOHANG) == pid; };
+    this->children.erase(std::remove_if(this->children.begin(), this->children.end(), exited), this->children.end());
+    return !this->children.empty();
+}
@@ -0,0 +1,317 @@
+#include "RenderJob.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "util.hpp"
+
+
+namespace {
+
+// 10進の文字列 s の |s| の log10. double の範囲を超える指数 (1e-400 など) も扱う
+double log10Abs(const std::string& s) {
+    size_t e = s.find_first_of("eE");
+    double mantissa = std::abs(std::stod(s.substr(0, e)));
+    double exponent = (e == std::string::npos) ? 0.0 : std::stod(s.substr(e + 1));
+    return std::log10(mantissa) + exponent;
+}
+
+bool parseBool(const std::string& key, const std::string& value) {
+    if (value == "true" || value == "1") return true;
+    if (value == "false" || value == "0") return false;
+    throw std::invalid_argument("Invalid value for " + key + ": " + value);
+}
+
+size_t parseSize(const std::string& key, const std::string& value) {
+    size_t pos = 0;
+    unsigned long n = 0;
+    try {
+        n = std::stoul(value, &pos);
+    } catch (const std::logic_error&) {
+        pos = 0;
+    }
+    if (pos == 0 || pos != value.size() || n == 0) {
+        throw std::invalid_argument("Invalid value for " + key + ": " + value);
+    }
+    return n;
+}
+
+// s が10進の数 [+-] (digits [. [digits]] | . digits) [(e|E) [+-] digits] の形なら true.
+// std::stold が読む "nan", "inf", 16進 (0x1p-3) や, 後ろに余計な文字のあるものは false
+bool isDecimalNumber(const std::string& s) {
+    size_t i = 0, n = s.size();
+    auto digits = [&]() {
+        size_t begin = i;
+        while (i < n && std::isdigit(static_cast<unsigned char>(s[i]))) i++;
+        return i - begin;
+    };
+    if (i < n && (s[i] == '+' || s[i] == '-')) i++;
+    size_t mantissa = digits();
+    if (i < n && s[i] == '.') {
+        i++;
+        mantissa += digits();
+    }
+    if (mantissa == 0) return false;
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < n && (s[i] == '+' || s[i] == '-')) i++;
+        if (digits() == 0) return false;
+    }
+    return i == n;
+}
+
+// 複素平面上の値は文字列のまま持つので, 10進の数として読めることだけ確かめる.
+// long double で表せない指数 (1e-5000 など) も mpfr では表せるので受け付ける
+const std::string& checkNumber(const std::string& key, const std::string& value) {
+    if (!isDecimalNumber(value)) {
+        throw std::invalid_argument("Invalid value for " + key + ": " + value);
+    }
+    return value;
+}
+
+// checkNumber に加えて, double の有限の値として読めることを確かめる (色数など, double で使う値)
+const std::string& checkDouble(const std::string& key, const std::string& value) {
+    checkNumber(key, value);
+    // 桁あふれだけを弾く (strtod は inf を返す). 1e-400 などは 0 として受け付ける
+    if (!std::isfinite(std::strtod(value.c_str(), nullptr))) {
+        throw std::invalid_argument("Invalid value for " + key + ": " + value);
+    }
+    return value;
+}
+
+std::vector<std::string> splitWhitespace(const std::string& line) {
+    std::vector<std::string> tokens;
+    std::istringstream iss(line);
+    std::string token;
+    while (iss >> token) tokens.push_back(token);
+    return tokens;
+}
+
+// JSON のオブジェクト (値は数値でも文字列でもよい) を job に set する
+void setFromTree(RenderJob& job, const boost::property_tree::ptree& tree) {
+    for (const auto& kv : tree) {
+        if (!kv.second.empty()) {
+            throw std::invalid_argument("Nested value for key: " + kv.first);
+        }
+        job.set(kv.first, kv.second.data());
+    }
+}
+
+std::vector<RenderJob> readJsonJobs(std::istream& is) {
+    namespace pt = boost::property_tree;
+    pt::ptree root;
+    try {
+        pt::read_json(is, root);
+    } catch (const pt::json_parser_error& e) {
+        throw std::invalid_argument(std::string("JSON: ") + e.what());
+    }
+
+    RenderJob defaults;
+    const pt::ptree* jobs = &root;
+    // ジョブの配列はキーが空文字列の子として読まれる
+    if (root.empty() || !root.begin()->first.empty()) {
+        if (auto d = root.get_child_optional("defaults")) setFromTree(defaults, *d);
+        auto j = root.get_child_optional("jobs");
+        if (!j) throw std::invalid_argument("JSON: \"jobs\" is missing");
+        jobs = &*j;
+    }
+
+    std::vector<RenderJob> result;
+    for (const auto& kv : *jobs) {
+        RenderJob job = defaults;
+        try {
+            setFromTree(job, kv.second);
+        } catch (const std::invalid_argument& e) {
+            throw std::invalid_argument("job " + std::to_string(result.size()) + ": " + e.what());
+        }
+        result.push_back(job);
+    }
+    return result;
+}
+
+std::vector<RenderJob> readTextJobs(std::istream& is) {
+    RenderJob defaults;
+    std::vector<RenderJob> result;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(is, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+        std::vector<std::string> tokens = splitWhitespace(line);
+        if (tokens.empty()) continue;
+
+        try {
+            if (tokens[0] == "defaults") {
+                defaults.setFromLine(line.substr(line.find("defaults") + 8));
+            } else {
+                RenderJob job = defaults;
+                job.setFromLine(line);
+                result.push_back(job);
+            }
+        } catch (const std::invalid_argument& e) {
+            throw std::invalid_argument("line " + std::to_string(line_no) + ": " + e.what());
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+
+void RenderJob::set(const std::string& key, const std::string& value) {
+    if (key == "re_target") this->re_target = checkNumber(key, value);
+    else if (key == "im_target") this->im_target = checkNumber(key, value);
+    else if (key == "width_target") this->width_target = checkNumber(key, value);
+    else if (key == "height_target") this->height_target = value.empty() ? value : checkNumber(key, value);
+    else if (key == "width_px") this->width_px = parseSize(key, value);
+    else if (key == "height_px") this->height_px = parseSize(key, value);
+    else if (key == "precision") this->precision = (value == "auto") ? value : std::to_string(parseSize(key, value));
+    else if (key == "mandel_count_max") this->mandel_count_max = parseSize(key, value);
+    else if (key == "palette") {
+        Palette::fromSpec(value);  // 書式の確認だけ
+        this->palette = value;
+    }
+    else if (key == "eq_hist") this->eq_hist = parseBool(key, value);
+    else if (key == "fused") this->fused = parseBool(key, value);
+    else if (key == "backend") this->backend = Mandelbrot::backendFromName(value);
+    else if (key == "formula") this->formula = Mandelbrot::formulaFromName(value);
+    else if (key == "degree") {
+        size_t d = parseSize(key, value);
+        if (d < 2 || d > Mandelbrot::max_degree) throw std::invalid_argument("Unsupported degree: " + value);
+        this->degree = static_cast<unsigned>(d);
+    }
+    else if (key == "julia_re") this->julia_re = checkNumber(key, value);
+    else if (key == "julia_im") this->julia_im = checkNumber(key, value);
+    else if (key == "expression") {
+        if (!value.empty()) FormulaJit::generateSource(value);  // 書式の確認だけ
+        this->expression = value;
+    }
+    else if (key == "distance") this->distance = parseBool(key, value);
+    else if (key == "disk_fill") this->disk_fill = parseBool(key, value);
+    else if (key == "region") {
+        this->has_region = !value.empty();
+        if (!this->has_region) return;
+        std::vector<std::string> v = splitString(value, ',');
+        if (v.size() != 4 || v[0].find_first_not_of("0123456789") != std::string::npos
+                          || v[1].find_first_not_of("0123456789") != std::string::npos) {
+            throw std::invalid_argument("Invalid value for region: " + value);
+        }
+        this->region_x0 = std::stoul(v[0]);
+        this->region_y0 = std::stoul(v[1]);
+        this->region_x1 = parseSize(key, v[2]);
+        this->region_y1 = parseSize(key, v[3]);
+        if (this->region_x0 >= this->region_x1 || this->region_y0 >= this->region_y1) {
+            throw std::invalid_argument("Empty region: " + value);
+        }
+    }
+    else if (key == "cycle_frames") this->cycle_frames = (value == "0") ? 0 : parseSize(key, value);
+    else if (key == "cycle_shift") this->cycle_shift = (value == "auto") ? value : checkDouble(key, value);
+    else if (key == "cycle_palette") {
+        if (!value.empty()) Palette::fromSpec(value);  // 書式の確認だけ
+        this->cycle_palette = value;
+    }
+    else if (key == "counts_output") this->counts_output = value;
+    else if (key == "counts_input") this->counts_input = value;
+    else if (key == "output") this->output = value;
+    else throw std::invalid_argument("Unknown key: " + key);
+}
+
+void RenderJob::setFromLine(const std::string& line) {
+    for (const std::string& token : splitWhitespace(line)) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) throw std::invalid_argument("Expected key=value: " + token);
+        this->set(token.substr(0, eq), token.substr(eq + 1));
+    }
+}
+
+std::string RenderJob::toLine() const {
+    std::ostringstream oss;
+    oss << "re_target=" << this->re_target
+        << " im_target=" << this->im_target
+        << " width_target=" << this->width_target;
+    if (!this->height_target.empty()) oss << " height_target=" << this->height_target;
+    oss << " width_px=" << this->width_px
+        << " height_px=" << this->height_px
+        << " precision=" << this->precision
+        << " mandel_count_max=" << this->mandel_count_max
+        << " palette=" << this->palette
+        << " eq_hist=" << (this->eq_hist ? "true" : "false")
+        << " backend=" << Mandelbrot::backendName(this->backend)
+        << " formula=" << Mandelbrot::formulaName(this->formula)
+        << " degree=" << this->degree;
+    if (this->formula == Formula::Julia) oss << " julia_re=" << this->julia_re << " julia_im=" << this->julia_im;
+    if (!this->expression.empty()) oss << " expression=" << this->expression;
+    if (this->fused) oss << " fused=true";
+    if (this->distance) oss << " distance=true disk_fill=" << (this->disk_fill ? "true" : "false");
+    if (this->has_region) {
+        oss << " region=" << this->region_x0 << "," << this->region_y0 << "," << this->region_x1 << "," << this->region_y1;
+    }
+    if (this->cycle_frames > 0) {
+        oss << " cycle_frames=" << this->cycle_frames << " cycle_shift=" << this->cycle_shift;
+        if (!this->cycle_palette.empty()) oss << " cycle_palette=" << this->cycle_palette;
+    }
+    if (!this->counts_output.empty()) oss << " counts_output=" << this->counts_output;
+    if (!this->counts_input.empty()) oss << " counts_input=" << this->counts_input;
+    if (!this->output.empty()) oss << " output=" << this->output;
+    return oss.str();
+}
+
+double RenderJob::resolveCycleShift(size_t palette_size) const {
+    if (this->cycle_shift != "auto") return std::strtod(this->cycle_shift.c_str(), nullptr);
+    return this->cycle_palette.empty() ? static_cast<double>(palette_size) : 0.0;
+}
+
+size_t RenderJob::resolvePrecision() const {
+    if (this->precision != "auto") return std::stoul(this->precision);
+
+    // bench の requiredPrecision と同じ: 画素間隔の桁数 + 余裕 10 桁, 最低 20 桁
+    double pixel_digits = std::log10(static_cast<double>(std::max(this->width_px, this->height_px)))
+                        - log10Abs(this->width_target);
+    if (!this->height_target.empty()) {
+        pixel_digits = std::max(pixel_digits, std::log10(static_cast<double>(this->height_px)) - log10Abs(this->height_target));
+    }
+    return std::max<size_t>(20, static_cast<size_t>(std::max(0.0, std::ceil(pixel_digits))) + 10);
+}
+
+void RenderJob::apply(Mandelbrot& engine) const {
+    // 文字列 -> Float の変換は精度を明示して行う (既定精度は使わない. Precision.hpp)
+    size_t prec = this->resolvePrecision();
+    engine.setPrecision(prec);
+    Float re = makeFloat(this->re_target, prec), im = makeFloat(this->im_target, prec);
+    Float width = makeFloat(this->width_target, prec);
+    Float height = makeFloat(this->height_target.empty() ? "0" : this->height_target, prec);
+    if (this->height_target.empty()) {
+        mpfr_mul_ui(height.backend().data(), width.backend().data(), this->height_px, MPFR_RNDN);
+        mpfr_div_ui(height.backend().data(), height.backend().data(), this->width_px, MPFR_RNDN);
+    }
+
+    engine.setWidthPx(this->width_px);
+    engine.setHeightPx(this->height_px);
+    engine.setComplexParams(re, im, width, height);
+    engine.setMandelCountMax(this->mandel_count_max);
+    engine.setBackend(this->backend);
+    engine.setFormula(this->formula, this->degree);
+    engine.setJuliaParam(makeFloat(this->julia_re, prec), makeFloat(this->julia_im, prec));
+    if (engine.getExpression() != this->expression) engine.setExpression(this->expression);
+    if (this->has_region) engine.setRegion(this->region_x0, this->region_y0, this->region_x1, this->region_y1);
+    else engine.clearRegion();
+}
+
+
+std::vector<RenderJob> readJobFile(const std::string& filename) {
+    std::ifstream ifs(filename);
+    if (!ifs) throw std::invalid_argument("Failed to open: " + filename);
+
+    // 最初の空白以外の文字で書式を判定する
+    char first = 0;
+    while (ifs.get(first) && std::isspace(static_cast<unsigned char>(first))) {}
+    ifs.clear();
+    ifs.seekg(0);
+
+    if (first == '{' || first == '[') return readJsonJobs(ifs);
+    return readTextJobs(ifs);
+}
@@ -0,0 +1,303 @@
+#include "RenderServer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Socket.hpp"
+
+
+RenderServer::RenderServer(size_t cache_capacity) : cache(cache_capacity) {
+    this->worker = std::thread(&RenderServer::workerLoop, this);
+}
+
+RenderServer::~RenderServer() {
+    this->stop();
+}
+
+bool RenderServer::serve(const std::string& socket_path) {
+    // listenSocket は '/' のないアドレスを TCP とみなすので, 相対パスには "./" を付ける
+    int fd = listenSocket(socket_path.find('/') == std::string::npos ? "./" + socket_path : socket_path);
+    if (fd < 0) return false;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->listen_fd = fd;
+    }
+
+    while (true) {
+        int client = ::accept(fd, nullptr, nullptr);
+        std::list<Client> finished;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopping) {
+                if (client >= 0) ::close(client);
+                break;
+            }
+            // 終わった接続のスレッドを回収する (fd は各スレッドが閉じている)
+            for (auto it = this->clients.begin(); it != this->clients.end();) {
+                auto next = std::next(it);
+                if (it->finished) finished.splice(finished.end(), this->clients, it);
+                it = next;
+            }
+            if (client >= 0) {
+                Client* c = &this->clients.emplace_back();
+                c->fd = client;
+                c->thread = std::thread(&RenderServer::runClient, this, c);
+            }
+        }
+        for (Client& c : finished) c.thread.join();
+    }
+
+    this->stop();
+    ::unlink(socket_path.c_str());
+    return true;
+}
+
+void RenderServer::stop() {
+    std::list<Client> clients;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+        // shutdown で accept / recv を起こす. 接続の fd は各スレッドが終了時に閉じる
+        if (this->listen_fd >= 0) ::shutdown(this->listen_fd, SHUT_RDWR);
+        for (Client& c : this->clients) {
+            if (!c.finished) ::shutdown(c.fd, SHUT_RDWR);
+        }
+        if (this->running) this->running->cancel = true;
+        clients.swap(this->clients);
+    }
+    this->queue_cv.notify_all();
+
+    for (Client& c : clients) c.thread.join();
+    if (this->worker.joinable()) this->worker.join();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->listen_fd >= 0) ::close(this->listen_fd);
+    this->listen_fd = -1;
+}
+
+std::string RenderServer::handle(const std::string& line) {
+    return this->submit(line).get();
+}
+
+std::future<std::string> RenderServer::submit(const std::string& line) {
+    std::promise<std::string> immediate;
+    std::future<std::string> result = immediate.get_future();
+
+    std::istringstream iss(line);
+    std::string command;
+    iss >> command;
+
+    if (command == "stats") {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::ostringstream oss;
+        oss << "ok queued=" << this->queue.size()
+            << " cache=" << this->cache.size()
+            << " hits=" << this->cache.getHits()
+            << " misses=" << this->cache.getMisses()
+            << " cancelled=" << this->cancelled;
+        immediate.set_value(oss.str());
+        return result;
+    }
+    if (command == "shutdown") {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+            if (this->listen_fd >= 0) ::shutdown(this->listen_fd, SHUT_RDWR);
+        }
+        this->queue_cv.notify_all();
+        immediate.set_value("ok");
+        return result;
+    }
+    if (command != "render") {
+        immediate.set_value("error Unknown command: " + command);
+        return result;
+    }
+
+    auto request = std::make_shared<Request>();
+    request->priority = Priority::Interactive;
+    std::string token;
+    try {
+        while (iss >> token) {
+            size_t eq = token.find('=');
+            if (eq == std::string::npos) throw std::invalid_argument("Expected key=value: " + token);
+            std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+            if (key == "priority") {
+                if (value == "interactive") request->priority = Priority::Interactive;
+                else if (value == "batch") request->priority = Priority::Batch;
+                else throw std::invalid_argument("Invalid value for priority: " + value);
+            }
+            else if (key == "session") request->session = value;
+            else if (key == "id") request->id = value;
+            else request->job.set(key, value);
+        }
+        if (request->job.output.empty()) throw std::invalid_argument("output is not set");
+    } catch (const std::invalid_argument& e) {
+        immediate.set_value("error id=" + request->id + " " + e.what());
+        return result;
+    }
+
+    result = request->reply.get_future();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->stopping) {
+            request->reply.set_value("cancelled id=" + request->id);
+            return result;
+        }
+        // 同じ session の古い要求は不要になる
+        if (!request->session.empty()) {
+            for (const RequestPtr& r : this->queue) {
+                if (r->session == request->session) r->cancel = true;
+            }
+            if (this->running && this->running->session == request->session) this->running->cancel = true;
+        }
+        request->seq = this->next_seq++;
+        this->queue.push_back(request);
+    }
+    this->queue_cv.notify_one();
+    return result;
+}
+
+void RenderServer::workerLoop() {
+    while (true) {
+        RequestPtr request;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->queue_cv.wait(lock, [this] { return this->stopping || !this->queue.empty(); });
+            if (this->stopping) break;
+
+            auto next = std::min_element(this->queue.begin(), this->queue.end(), [](const RequestPtr& a, const RequestPtr& b) {
+                if (a->priority != b->priority) return a->priority < b->priority;
+                return a->seq < b->seq;
+            });
+            request = *next;
+            this->queue.erase(next);
+            this->running = request;
+        }
+
+        std::string reply = request->cancel ? "cancelled id=" + request->id : this->render(*request);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running.reset();
+            if (reply.compare(0, 9, "cancelled") == 0) this->cancelled++;
+        }
+        request->reply.set_value(reply);
+    }
+
+    // 停止時に残っている要求は中止扱い
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (const RequestPtr& r : this->queue) r->reply.set_value("cancelled id=" + r->id);
+    this->queue.clear();
+}
+
+std::string RenderServer::render(Request& request) {
+    const RenderJob& job = request.job;
+    auto t0 = std::chrono::steady_clock::now();
+    Mandelbrot& engine = this->renderer.getEngine();
+
+    try {
+        if (!job.counts_output.empty() || !job.counts_input.empty()) {
+            throw std::invalid_argument("counts_output / counts_input are only supported by batch");
+        }
+        job.apply(engine);
+
+        bool cached = false;
+        bool saved;
+        if (job.distance) {
+            // 距離推定はキャッシュしない
+            if (!engine.makeDistanceVector(this->dist_counts, this->dist_vec, job.disk_fill, &request.cancel)) {
+                return "cancelled id=" + request.id;
+            }
+            saved = this->renderer.colorize(job, this->dist_counts, this->dist_vec);
+        } else {
+            std::string key = CountCache::keyOf(job);
+            CountCache::CountField counts;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                counts = this->cache.find(key);
+            }
+            cached = static_cast<bool>(counts);
+            if (!cached) {
+                // 前回の描画を平行移動しただけなら, 重なる部分の反復回数を使い回す
+                if (!engine.makeCountVectorPanned(this->pan, &request.cancel)) return "cancelled id=" + request.id;
+                auto fresh = std::make_shared<IterationField>();
+                fresh->assign(this->pan.counts, engine.regionWidth(), engine.regionHeight(), engine.getMandelCountMax());
+                counts = fresh;
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->cache.insert(key, counts);
+            }
+            saved = this->renderer.colorize(job, *counts);
+        }
+        if (!saved) return "error id=" + request.id + " Failed to save PNG: " + job.output;
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::ostringstream oss;
+        oss << "ok id=" << request.id
+            << " output=" << job.output
+            << " backend=" << Mandelbrot::backendName(engine.resolveBackend())
+            << " cached=" << (cached ? "true" : "false")
+            << " seconds=" << seconds;
+        return oss.str();
+    } catch (const std::exception& e) {
+        return "error id=" + request.id + " " + e.what();
+    }
+}
+
+void RenderServer::runClient(Client* client) {
+    this->connectionLoop(client->fd);
+    std::lock_guard<std::mutex> lock(this->mutex);
+    ::close(client->fd);
+    client->finished = true;
+}
+
+void RenderServer::connectionLoop(int fd) {
+    // 応答は要求の順に返す. 読み込み側が future を積み, 書き込み側が順に待つ
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    std::deque<std::future<std::string>> pending;
+    bool closed = false;
+
+    std::thread writer([&] {
+        while (true) {
+            std::future<std::string> reply;
+            {
+                std::unique_lock<std::mutex> lock(pending_mutex);
+                pending_cv.wait(lock, [&] { return closed || !pending.empty(); });
+                if (pending.empty()) break;
+                reply = std::move(pending.front());
+                pending.pop_front();
+            }
+            writeLine(fd, reply.get());
+        }
+    });
+
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+        ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) break;
+        buffer.append(chunk, static_cast<size_t>(n));
+
+        size_t newline;
+        while ((newline = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.find_first_not_of(" \t") == std::string::npos) continue;
+
+            std::future<std::string> reply = this->submit(line);
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending.push_back(std::move(reply));
+            pending_cv.notify_one();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        closed = true;
+    }
+    pending_cv.notify_one();
+    writer.join();
+}
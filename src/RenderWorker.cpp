@@ -0,0 +1,148 @@
+#include "RenderWorker.hpp"
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Socket.hpp"
+
+
+namespace {
+
+// "id=ID" の ID. なければ空
+std::string idOf(const std::string& line) {
+    size_t pos = line.find(" id=");
+    if (pos == std::string::npos) return "";
+    size_t begin = pos + 4;
+    return line.substr(begin, line.find(' ', begin) - begin);
+}
+
+void putU32(uint8_t* p, uint32_t v) {
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+    p[2] = static_cast<uint8_t>(v >> 16);
+    p[3] = static_cast<uint8_t>(v >> 24);
+}
+
+}  // namespace
+
+
+void RenderWorker::encodeCounts(const FrameVector<size_t>& counts, std::vector<uint8_t>& out) {
+    size_t offset = out.size();
+    out.resize(offset + counts.size() * 4);
+    for (size_t i = 0; i < counts.size(); i++) {
+        putU32(out.data() + offset + i * 4, static_cast<uint32_t>(counts[i]));
+    }
+}
+
+void RenderWorker::encodeDistances(const FrameVector<float>& dist, std::vector<uint8_t>& out) {
+    static_assert(sizeof(float) == 4, "float must be 32-bit");
+    size_t offset = out.size();
+    out.resize(offset + dist.size() * 4);
+    for (size_t i = 0; i < dist.size(); i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &dist[i], 4);
+        putU32(out.data() + offset + i * 4, bits);
+    }
+}
+
+uint32_t RenderWorker::decodeU32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+         | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+bool RenderWorker::run(const std::string& address) {
+    int fd = connectSocket(address);
+    if (fd < 0) return false;
+    writeLine(fd, "hello pid=" + std::to_string(::getpid()) + " threads=" + std::to_string(omp_get_max_threads()));
+
+    std::thread renderer(&RenderWorker::renderLoop, this, fd);
+
+    // 読み込みはこのスレッドで行い, 描画中でも cancel を受け取れるようにする
+    SocketReader reader(fd);
+    std::string line;
+    while (reader.readLine(line)) {
+        std::istringstream iss(line);
+        std::string command;
+        iss >> command;
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (command == "job") {
+            this->pending = line;
+            this->cv.notify_one();
+        } else if (command == "cancel") {
+            if (idOf(line) == this->running_id) this->cancel = true;
+            else this->cancelled_id = idOf(line);
+        } else if (command == "quit") {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->quitting = true;
+        this->cancel = true;
+    }
+    this->cv.notify_one();
+    renderer.join();
+    ::close(fd);
+    return true;
+}
+
+void RenderWorker::renderLoop(int fd) {
+    while (true) {
+        std::string line, id;
+        bool cancelled = false;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cv.wait(lock, [this] { return this->quitting || !this->pending.empty(); });
+            if (this->quitting) break;
+            line.swap(this->pending);
+            id = idOf(line);
+            // 始める前の cancel はこのジョブのものか, 終わったジョブへの遅れた cancel なので, どちらでも使い終わる
+            cancelled = id == this->cancelled_id;
+            this->cancelled_id.clear();
+            this->running_id = id;
+            this->cancel = false;
+        }
+
+        // コーディネータは1ジョブに必ず1つの応答を待つので, cancel 済みでも応答は返す
+        std::string reply = cancelled ? "cancelled id=" + id : this->render(id, line, fd);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running_id.clear();
+        }
+        if (!reply.empty()) writeLine(fd, reply);
+    }
+}
+
+std::string RenderWorker::render(const std::string& id, const std::string& line, int fd) {
+    auto t0 = std::chrono::steady_clock::now();
+    RenderJob job;
+    try {
+        // "job id=ID key=value ..." の key=value 部分
+        size_t rest = line.find(' ', line.find(" id=") + 1);
+        job.setFromLine(rest == std::string::npos ? "" : line.substr(rest));
+        job.apply(this->engine);
+
+        bool done = job.distance
+                  ? this->engine.makeDistanceVector(this->count_vec, this->dist_vec, job.disk_fill, &this->cancel)
+                  : this->engine.makeCountVector(this->count_vec, &this->cancel);
+        if (!done) return "cancelled id=" + id;
+    } catch (const std::exception& e) {
+        return "error id=" + id + " " + e.what();
+    }
+
+    this->payload.clear();
+    encodeCounts(this->count_vec, this->payload);
+    if (job.distance) encodeDistances(this->dist_vec, this->payload);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::ostringstream oss;
+    oss << "result id=" << id
+        << " pixels=" << this->count_vec.size()
+        << " distance=" << (job.distance ? 1 : 0)
+        << " seconds=" << seconds;
+    if (writeLine(fd, oss.str())) writeAll(fd, this->payload.data(), this->payload.size());
+    return "";
+}
@@ -0,0 +1,154 @@
+#include "Socket.hpp"
+#include <algorithm>
+#include <cstring>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace {
+
+bool isUnixAddress(const std::string& address) {
+    return address.find('/') != std::string::npos;
+}
+
+bool unixAddress(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    std::strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+// "HOST:PORT" を getaddrinfo で引く. HOST が空か "*" なら全てのインタフェース
+addrinfo* resolveTcp(const std::string& address, bool passive) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return nullptr;
+    std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = nullptr;
+    const char* node = (host.empty() || host == "*") ? nullptr : host.c_str();
+    if (::getaddrinfo(node, port.c_str(), &hints, &result) != 0) return nullptr;
+    return result;
+}
+
+}  // namespace
+
+
+int listenSocket(const std::string& address, int backlog) {
+    if (isUnixAddress(address)) {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr)) return -1;
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        ::unlink(address.c_str());  // 前回のソケットファイルが残っていれば消す
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, backlog) < 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo* list = resolveTcp(address, true);
+    int fd = -1;
+    for (addrinfo* ai = list; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || ::listen(fd, backlog) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (list) ::freeaddrinfo(list);
+    return fd;
+}
+
+int connectSocket(const std::string& address) {
+    if (isUnixAddress(address)) {
+        sockaddr_un addr;
+        if (!unixAddress(address, addr)) return -1;
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo* list = resolveTcp(address, false);
+    int fd = -1;
+    for (addrinfo* ai = list; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (list) ::freeaddrinfo(list);
+    return fd;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = ::send(fd, p + sent, size - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool writeLine(int fd, const std::string& line) {
+    // 例外のメッセージなどに改行が混ざっても, 1行として送る
+    std::string data = line;
+    for (char& ch : data) {
+        if (ch == '\n' || ch == '\r') ch = ' ';
+    }
+    data += '\n';
+    return writeAll(fd, data.data(), data.size());
+}
+
+
+bool SocketReader::fill() {
+    char chunk[65536];
+    ssize_t n = ::recv(this->fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) return false;
+    this->buffer.append(chunk, static_cast<size_t>(n));
+    return true;
+}
+
+bool SocketReader::readLine(std::string& line) {
+    size_t newline;
+    while ((newline = this->buffer.find('\n')) == std::string::npos) {
+        if (!this->fill()) return false;
+    }
+    line = this->buffer.substr(0, newline);
+    this->buffer.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+bool SocketReader::readBytes(void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    size_t got = std::min(size, this->buffer.size());
+    std::memcpy(p, this->buffer.data(), got);
+    this->buffer.erase(0, got);
+    while (got < size) {
+        ssize_t n = ::recv(this->fd, p + got, size - got, 0);
+        if (n <= 0) return false;
+        got += static_cast<size_t>(n);
+    }
+    return true;
+}
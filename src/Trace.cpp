@@ -0,0 +1,298 @@
+// Trace.cpp
+
+
+#ifdef MANDEL_TRACE
+
+#include "Trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace trace {
+
+namespace {
+
+int64_t steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+#ifdef __linux__
+// スレッドごとの perf_event グループ (cycles, instructions, cache-misses)
+struct PerfGroup {
+    bool tried = false;
+    int leader = -1;
+    std::vector<int> fds;
+
+    ~PerfGroup() {
+        for (int fd : this->fds) close(fd);
+    }
+
+    int open(uint64_t config, int group_fd) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.disabled = (group_fd == -1) ? 1 : 0;
+        // pid = 0, cpu = -1: 呼び出したスレッドをどの CPU 上でも計測
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+
+    bool init() {
+        this->tried = true;
+        this->leader = this->open(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (this->leader < 0) return false;
+        this->fds.push_back(this->leader);
+        for (uint64_t config : {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES}) {
+            int fd = this->open(config, this->leader);
+            if (fd < 0) {
+                for (int f : this->fds) close(f);
+                this->fds.clear();
+                this->leader = -1;
+                return false;
+            }
+            this->fds.push_back(fd);
+        }
+        ioctl(this->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(this->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+    }
+
+    PerfSample read() const {
+        PerfSample sample;
+        uint64_t buf[4];  // nr, cycles, instructions, cache-misses
+        if (this->leader < 0) return sample;
+        if (::read(this->leader, buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf)) || buf[0] != 3) return sample;
+        sample.valid = true;
+        sample.cycles = buf[1];
+        sample.instructions = buf[2];
+        sample.cache_misses = buf[3];
+        return sample;
+    }
+};
+#endif
+
+bool isStage(const char* name) {
+    return std::strcmp(name, "tile") != 0 && std::strcmp(name, "frame") != 0;
+}
+
+}  // namespace
+
+
+Recorder::Recorder() : origin_ns(steadyNs()) {
+    const char* perf = std::getenv("MANDEL_TRACE_PERF");
+    this->perf_enabled = perf && std::strcmp(perf, "0") != 0;
+}
+
+Recorder& Recorder::instance() {
+    static Recorder recorder;
+    return recorder;
+}
+
+ThreadBuffer& Recorder::threadBuffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->buffers.push_back(std::make_unique<ThreadBuffer>());
+        buffer = this->buffers.back().get();
+        buffer->tid = static_cast<int>(this->buffers.size()) - 1;
+        buffer->events.reserve(4096);
+    }
+    return *buffer;
+}
+
+int64_t Recorder::now() const {
+    return steadyNs() - this->origin_ns;
+}
+
+PerfSample Recorder::readPerf() {
+    #ifdef __linux__
+        if (!this->perf_enabled) return PerfSample();
+        thread_local PerfGroup group;
+        if (!group.tried && !group.init()) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::cerr << "[trace] perf_event_open failed; hardware counters disabled for this thread" << std::endl;
+        }
+        return group.read();
+    #else
+        return PerfSample();
+    #endif
+}
+
+void Recorder::beginFrame(size_t) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto& buffer : this->buffers) buffer->frame_begin = buffer->events.size();
+    this->frame_begin_ns = this->now();
+}
+
+// 並列領域の外 (全スレッドが待機中) で呼ぶこと
+void Recorder::endFrame(size_t frame, size_t pixels, std::ostream& os) {
+    int64_t frame_end_ns = this->now();
+
+    Event frame_event{};
+    frame_event.name = "frame";
+    frame_event.begin_ns = this->frame_begin_ns;
+    frame_event.end_ns = frame_end_ns;
+    frame_event.x = static_cast<int64_t>(frame);  // frame イベントでは x にフレーム番号を入れる
+    frame_event.y = -1;
+    ThreadBuffer& own = this->threadBuffer();
+    frame_event.tid = own.tid;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    std::vector<std::pair<std::string, int64_t>> stages;  // 登場順
+    size_t tiles = 0;
+    int64_t tile_min = -1, tile_max = 0, tile_total = 0;
+    uint64_t iterations = 0, max_count = 0;
+    PerfSample perf;
+    std::map<int, int64_t> busy_ns;  // tid -> タイル処理時間の合計
+
+    for (auto& buffer : this->buffers) {
+        for (size_t i = buffer->frame_begin; i < buffer->events.size(); i++) {
+            const Event& e = buffer->events[i];
+            int64_t dur = e.end_ns - e.begin_ns;
+            if (isStage(e.name)) {
+                auto it = std::find_if(stages.begin(), stages.end(),
+                                       [&](const auto& s) { return s.first == e.name; });
+                if (it == stages.end()) stages.emplace_back(e.name, dur);
+                else it->second += dur;
+            } else if (std::strcmp(e.name, "tile") == 0) {
+                tiles++;
+                tile_total += dur;
+                tile_min = (tile_min < 0) ? dur : std::min(tile_min, dur);
+                tile_max = std::max(tile_max, dur);
+                iterations += e.iterations;
+                max_count = std::max(max_count, e.max_count);
+                busy_ns[e.tid] += dur;
+                if (e.perf.valid) {
+                    perf.valid = true;
+                    perf.cycles += e.perf.cycles;
+                    perf.instructions += e.perf.instructions;
+                    perf.cache_misses += e.perf.cache_misses;
+                }
+            }
+        }
+    }
+    own.events.push_back(frame_event);
+
+    int64_t wall_ns = frame_end_ns - this->frame_begin_ns;
+    auto ms = [](int64_t ns) { return ns / 1e6; };
+
+    os << std::fixed << std::setprecision(3)
+       << "[trace] frame " << frame << ": " << ms(wall_ns) << " ms |";
+    for (size_t i = 0; i < stages.size(); i++) {
+        os << (i ? ", " : " ") << stages[i].first << " " << ms(stages[i].second) << " ms";
+    }
+    if (tiles > 0) {
+        os << " | tiles " << tiles
+           << " (min " << ms(tile_min) << ", mean " << ms(tile_total / static_cast<int64_t>(tiles))
+           << ", max " << ms(tile_max) << " ms)"
+           << " | iterations " << iterations
+           << " (" << std::setprecision(1) << (pixels ? static_cast<double>(iterations) / pixels : 0.0)
+           << "/px, max " << max_count << ")";
+
+        // 各スレッドが makeCountVector 区間のうちタイル処理に使った割合
+        int64_t iterate_ns = 0;
+        for (const auto& s : stages) if (s.first == "makeCountVector") iterate_ns += s.second;
+        if (iterate_ns > 0) {
+            double busy_sum = 0.0;
+            for (const auto& b : busy_ns) busy_sum += static_cast<double>(b.second) / iterate_ns;
+            os << " | threads " << busy_ns.size()
+               << ", busy " << std::setprecision(1) << 100.0 * busy_sum / busy_ns.size() << "%";
+        }
+    }
+    if (perf.valid) {
+        os << std::setprecision(2)
+           << " | cycles " << static_cast<double>(perf.cycles)
+           << ", instructions " << static_cast<double>(perf.instructions)
+           << " (IPC " << (perf.cycles ? static_cast<double>(perf.instructions) / perf.cycles : 0.0) << ")"
+           << ", cache-misses " << perf.cache_misses;
+    }
+    os << std::defaultfloat << std::endl;
+}
+
+bool Recorder::writeChromeTrace(const std::string& filename) const {
+    std::ofstream ofs(filename);
+    if (!ofs) return false;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    ofs << std::fixed << std::setprecision(3);
+    ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (const auto& buffer : this->buffers) {
+        ofs << (first ? "" : ",\n")
+            << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid
+            << ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+        first = false;
+        for (const Event& e : buffer->events) {
+            ofs << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.tid
+                << ", \"ts\": " << e.begin_ns / 1e3
+                << ", \"dur\": " << (e.end_ns - e.begin_ns) / 1e3
+                << ", \"args\": {";
+            std::string sep;
+            if (std::strcmp(e.name, "frame") == 0) {
+                ofs << "\"frame\": " << e.x;
+                sep = ", ";
+            } else if (e.x >= 0) {
+                ofs << "\"x\": " << e.x << ", \"y\": " << e.y
+                    << ", \"iterations\": " << e.iterations << ", \"max_count\": " << e.max_count;
+                sep = ", ";
+            }
+            if (e.perf.valid) {
+                ofs << sep << "\"cycles\": " << e.perf.cycles
+                    << ", \"instructions\": " << e.perf.instructions
+                    << ", \"cache_misses\": " << e.perf.cache_misses;
+            }
+            ofs << "}}";
+        }
+    }
+    ofs << "\n]}\n";
+    return static_cast<bool>(ofs);
+}
+
+
+Scope::Scope(const char* name, int64_t x, int64_t y) {
+    Recorder& recorder = Recorder::instance();
+    this->event = Event{};
+    this->event.name = name;
+    this->event.tid = recorder.threadBuffer().tid;
+    this->event.x = x;
+    this->event.y = y;
+    this->event.perf = recorder.readPerf();
+    this->event.begin_ns = recorder.now();
+}
+
+Scope::~Scope() {
+    Recorder& recorder = Recorder::instance();
+    this->event.end_ns = recorder.now();
+    PerfSample end = recorder.readPerf();
+    if (this->event.perf.valid && end.valid) {
+        this->event.perf.cycles = end.cycles - this->event.perf.cycles;
+        this->event.perf.instructions = end.instructions - this->event.perf.instructions;
+        this->event.perf.cache_misses = end.cache_misses - this->event.perf.cache_misses;
+    } else {
+        this->event.perf.valid = false;
+    }
+    recorder.threadBuffer().events.push_back(this->event);
+}
+
+}  // namespace trace
+
+#endif  // MANDEL_TRACE
@@ -0,0 +1,72 @@
+#include "ZoomCheckpoint.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "util.hpp"
+
+
+bool ZoomCheckpoint::load(const std::string& filename) {
+    std::ifstream ifs(filename);
+    if (!ifs) return false;
+
+    ZoomCheckpoint c;
+    bool complete = false;
+    std::string line;
+    try {
+        while (std::getline(ifs, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+            if (key == "next_frame") c.next_frame = std::stoul(value);
+            else if (key == "frames") c.frames = std::stoul(value);
+            else if (key == "precision") c.precision = std::stoul(value);
+            else if (key == "width_px") c.width_px = std::stoul(value);
+            else if (key == "height_px") c.height_px = std::stoul(value);
+            else if (key == "re_target") c.re_target = value;
+            else if (key == "im_target") c.im_target = value;
+            else if (key == "width_target_init") c.width_target_init = value;
+            else if (key == "scale") c.scale = value;
+            else if (key == "mandel_count_max_init") c.mandel_count_max_init = std::stoul(value);
+            else if (key == "palette") c.palette = value;
+            else if (key == "width_target") c.width_target = value;
+            else if (key == "height_target") c.height_target = value;
+            else if (key == "mandel_count_max") c.mandel_count_max = std::stoul(value);
+            else if (key == "end") complete = true;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (!complete) return false;  // 最後の行がない (rename する前の古い形式や手で切ったファイル)
+    *this = c;
+    return true;
+}
+
+bool ZoomCheckpoint::save(const std::string& filename) const {
+    std::ostringstream oss;
+    oss << "next_frame=" << this->next_frame << "\n"
+        << "frames=" << this->frames << "\n"
+        << "precision=" << this->precision << "\n"
+        << "width_px=" << this->width_px << "\n"
+        << "height_px=" << this->height_px << "\n"
+        << "re_target=" << this->re_target << "\n"
+        << "im_target=" << this->im_target << "\n"
+        << "width_target_init=" << this->width_target_init << "\n"
+        << "scale=" << this->scale << "\n"
+        << "mandel_count_max_init=" << this->mandel_count_max_init << "\n"
+        << "palette=" << this->palette << "\n"
+        << "width_target=" << this->width_target << "\n"
+        << "height_target=" << this->height_target << "\n"
+        << "mandel_count_max=" << this->mandel_count_max << "\n"
+        << "end=1\n";
+    return writeFileAtomic(filename, oss.str());
+}
+
+bool ZoomCheckpoint::sameRun(const ZoomCheckpoint& other) const {
+    return this->precision == other.precision
+        && this->width_px == other.width_px && this->height_px == other.height_px
+        && this->re_target == other.re_target && this->im_target == other.im_target
+        && this->width_target_init == other.width_target_init
+        && this->scale == other.scale
+        && this->mandel_count_max_init == other.mandel_count_max_init
+        && this->palette == other.palette;
+}
@@ -1,32 +1,223 @@
 #include "Mandelbrot.hpp"
+#include "BatchRenderer.hpp"
+#include "Buddhabrot.hpp"
+#include "RenderCoordinator.hpp"
+#include "RenderJob.hpp"
+#include "RenderServer.hpp"
+#include "RenderWorker.hpp"
+#include "ZoomCheckpoint.hpp"
 #include "util.hpp"
+#include <chrono>
+#include <cmath>
+#include <unistd.h>
 
 //using Float = boost::multiprecision::mpfr_float;
 //using Complex = boost::multiprecision::mpc_complex;
 
 void omp_info();
 
-int main() {
+// ./prg batch FILE: ジョブファイルの全てのビューを1プロセスで描画する (RenderJob.hpp)
+int runBatch(const std::string& job_file) {
+    std::vector<RenderJob> jobs;
+    try {
+        jobs = readJobFile(job_file);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << job_file << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    BatchRenderer renderer;
+    size_t failed = renderer.run(jobs, std::cout);
+    std::cout << jobs.size() - failed << "/" << jobs.size() << " jobs rendered" << std::endl;
+    return failed ? 1 : 0;
+}
+
+// ./prg coordinate FILE [--listen ADDRESS] [--local N] [--tile PX]:
+// ジョブファイルをタイルに分けてワーカーで描画する (RenderCoordinator.hpp)
+int runCoordinate(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " coordinate FILE [--listen ADDRESS] [--local N] [--tile PX]" << std::endl;
+        return 1;
+    }
+    std::string job_file = argv[2];
+    std::string address = "/tmp/mandel-coordinator-" + std::to_string(::getpid()) + ".sock";
+    RenderCoordinator::Options options;
+    // 自分自身をワーカーとして起動する
+    options.worker_exe = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : argv[0];
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for: " << arg << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--listen") address = value;
+            else if (arg == "--local") options.local_workers = std::stoul(value);
+            else if (arg == "--tile") options.tile_px = std::stoul(value);
+            else {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return 1;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<RenderJob> jobs;
+    try {
+        jobs = readJobFile(job_file);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << job_file << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    RenderCoordinator coordinator(options);
+    std::cout << "listening on " << address << std::endl;
+    size_t failed;
+    try {
+        failed = coordinator.run(address, jobs, std::cout);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << jobs.size() - failed << "/" << jobs.size() << " jobs rendered" << std::endl;
+    return failed ? 1 : 0;
+}
+
+// ./prg buddhabrot OUTPUT [key=value ...]: 軌道の密度を描画する (Buddhabrot.hpp).
+// キーは Buddhabrot::Options のメンバ名と, 色付けの palette (Palette::fromSpec), gamma, reverse.
+// 密度 0 がパレットの先頭の色になる. gray は白から黒なので, 既定では反転して背景を黒にする
+int runBuddhabrot(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " buddhabrot OUTPUT [key=value ...]" << std::endl;
+        return 1;
+    }
+    std::string output = argv[2];
+    Buddhabrot::Options options;
+    std::string pal_spec = "gray:256";
+    double gamma = 0.5;
+    bool reverse = true;
+    try {
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos) throw std::invalid_argument("Expected key=value: " + arg);
+            std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+            if (key == "palette") pal_spec = value;
+            else if (key == "gamma") {
+                size_t pos = 0;
+                try {
+                    gamma = std::stod(value, &pos);
+                } catch (const std::logic_error&) {
+                    pos = 0;
+                }
+                if (pos == 0 || pos != value.size() || !std::isfinite(gamma)) {
+                    throw std::invalid_argument("Invalid value for gamma: " + value);
+                }
+            }
+            else if (key == "reverse") reverse = (value == "true" || value == "1");
+            else options.set(key, value);
+        }
+        Palette pal = Palette::fromSpec(pal_spec);
+        if (reverse) pal.reverse();
+
+        Buddhabrot buddhabrot(options);
+        bool ok = buddhabrot.render(std::cout);
+        const Buddhabrot::Stats& stats = buddhabrot.getStats();
+        std::cout << stats.samples << " orbits in " << stats.seconds << " s" << std::endl;
+
+        FrameVector<Color> colors;
+        buddhabrot.makeColorVector(pal, gamma, colors);
+        if (!savePNG(output, colors, options.width_px, options.height_px)) {
+            std::cerr << "Failed to save PNG: " << output << std::endl;
+            return 1;
+        }
+        std::cout << "PNG saved successfully: " << output << std::endl;
+        return ok ? 0 : 1;
+    } catch (const std::exception& e) {  // 不正なオプション (stoul / stod の out_of_range も) とチェックポイントの入出力
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+// ズームで同時に描画するフレーム数. 1フレームのタイル (32x32) がスレッドあたり 8 個以上になるように,
+// 残りのスレッドをフレーム間の並列に回す (64x64 では全スレッドが別々のフレームを描画する)
+size_t framesInParallel(size_t threads, size_t w_px, size_t h_px) {
+    size_t tiles = ((w_px + 31) / 32) * ((h_px + 31) / 32);
+    size_t inner = std::clamp<size_t>(tiles / 8, 1, std::max<size_t>(1, threads));
+    return std::max<size_t>(1, threads / inner);
+}
+
+int main(int argc, char* argv[]) {
     omp_info();
 
+    if (argc >= 2 && std::string(argv[1]) == "batch") {
+        if (argc != 3) {
+            std::cerr << "usage: " << argv[0] << " batch FILE" << std::endl;
+            return 1;
+        }
+        return runBatch(argv[2]);
+    }
+    // ./prg serve SOCKET: 描画要求を受け付ける常駐サーバ (RenderServer.hpp)
+    if (argc >= 2 && std::string(argv[1]) == "serve") {
+        if (argc != 3) {
+            std::cerr << "usage: " << argv[0] << " serve SOCKET" << std::endl;
+            return 1;
+        }
+        RenderServer server;
+        std::cout << "listening on " << argv[2] << std::endl;
+        if (!server.serve(argv[2])) {
+            std::cerr << "Failed to listen on: " << argv[2] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "buddhabrot") {
+        return runBuddhabrot(argc, argv);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "coordinate") {
+        return runCoordinate(argc, argv);
+    }
+    // ./prg worker ADDRESS: コーディネータに接続してタイルを描画する (RenderWorker.hpp)
+    if (argc >= 2 && std::string(argv[1]) == "worker") {
+        if (argc != 3) {
+            std::cerr << "usage: " << argv[0] << " worker ADDRESS" << std::endl;
+            return 1;
+        }
+        RenderWorker worker;
+        if (!worker.run(argv[2])) {
+            std::cerr << "Failed to connect to: " << argv[2] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // ズームの目標は tools/nucleus でビュー内のミニブロの中心として求められる
     size_t prec = 64;
     size_t w_px = 512;
     size_t h_px = w_px;
-    Float re_tar = Float(-0.5);  // -1.26222162762384535370226702572022420406
-    Float im_tar = Float(0.0);  // 0.04591700163513884695098681782544085357512
-    Float w_tar = Float(2.0);
+    Float re_tar = makeFloat("-0.5", prec);  // -1.26222162762384535370226702572022420406
+    Float im_tar = makeFloat("0.0", prec);  // 0.04591700163513884695098681782544085357512
+    Float w_tar = makeFloat("2.0", prec);
     Float h_tar = w_tar;
     Float w_tar_init = w_tar;
     size_t mcnt_max_init = 300;
-    Palette pal = Palette::makeGradationHue(256, 0, 360, 1.0, 0.9);
+    std::string pal_spec = "hue:256:0:360:1.0:0.9";  // チェックポイントでパレットを区別するのにも使う
+    Palette pal = Palette::fromSpec(pal_spec);
     //pal.reverse();
     size_t frames = 1;
-    Float scale = Float(0.87);
+    Float scale = makeFloat("0.87", prec);
 
-    Mandelbrot m;
-    m.setAllParams(prec, w_px, h_px, re_tar, im_tar, w_tar, h_tar, mcnt_max_init, pal);
-
-    for (size_t i = 0; i < frames; i++) {
+    // フレームごとのパラメタを先に決めておく (描画の順番によらず同じ値になる).
+    // 最後のフレームの次の分も作り, チェックポイントに入れる (frames を増やして再開できる)
+    struct ZoomFrame {
+        Float w_tar, h_tar;
+        size_t mcnt_max;
+    };
+    std::vector<ZoomFrame> zoom;
+    for (size_t i = 0; i <= frames; i++) {
         // mandel count maxの動的変更
         Float zoom_ratio = w_tar_init / w_tar;
         size_t mcnt_max = static_cast<size_t>(
@@ -35,19 +226,118 @@ int main() {
                 30000
             )
         );
-        std::cout << "mandel count max: " << mcnt_max << std::endl;
-        m.setMandelCountMax(mcnt_max);
+        zoom.push_back({w_tar, h_tar, mcnt_max});
 
-        if (savePNG("./frames/output" + std::to_string(i) + ".png", m.makeColorVector(true), m.getWidthPx(), m.getHeightPx())) {
-            std::cout << "PNG saved successfully: output" + std::to_string(i) + ".png\n";
+        w_tar *= scale;
+        h_tar = w_tar * h_px / w_px;
+    }
+
+    // 中断したアニメーションの再開. チェックポイントの設定とパラメタが一致すれば,
+    // その前のフレームを検査して最初の欠けたフレームから描画する
+    const std::string checkpoint_file = "./frames/checkpoint.txt";
+    const double checkpoint_interval_s = 30.0;
+    ZoomCheckpoint checkpoint;
+    checkpoint.frames = frames;
+    checkpoint.precision = prec;
+    checkpoint.width_px = w_px;
+    checkpoint.height_px = h_px;
+    checkpoint.re_target = toExactString(re_tar);
+    checkpoint.im_target = toExactString(im_tar);
+    checkpoint.width_target_init = toExactString(w_tar_init);
+    checkpoint.scale = toExactString(scale);
+    checkpoint.mandel_count_max_init = mcnt_max_init;
+    checkpoint.palette = pal_spec;
+    auto frameFile = [](size_t i) { return "./frames/output" + std::to_string(i) + ".png"; };
+
+    size_t start = 0;
+    ZoomCheckpoint saved;
+    if (saved.load(checkpoint_file)) {
+        size_t next = std::min(saved.next_frame, frames);
+        if (!saved.sameRun(checkpoint)) {
+            std::cout << "checkpoint is for a different animation; starting from frame 0" << std::endl;
+        } else if (saved.next_frame <= frames && (toExactString(zoom[next].w_tar) != saved.width_target
+                                  || toExactString(zoom[next].h_tar) != saved.height_target
+                                  || zoom[next].mcnt_max != saved.mandel_count_max)) {
+            std::cout << "checkpoint parameters of frame " << next << " differ; starting from frame 0" << std::endl;
         } else {
-            std::cerr << "Failed to save PNG.\n";
+            start = next;
+        }
+    }
+    for (size_t i = 0; i < start; i++) {
+        if (!verifyPNG(frameFile(i), w_px, h_px)) {
+            std::cout << "frame " << i << " is missing or corrupt" << std::endl;
+            start = i;
+            break;
         }
+    }
+    if (start > 0) std::cout << "resuming from frame " << start << std::endl;
 
-        w_tar *= scale;
-        h_tar = w_tar * h_px / w_px;
-        m.setComplexParams(re_tar, im_tar, w_tar, h_tar);
+    // 小さいフレームは1枚ではスレッドが余るので, 複数のフレームを同時に描画する
+    size_t frame_threads = framesInParallel(omp_get_max_threads(), w_px, h_px);
+    size_t inner_threads = std::max<size_t>(1, omp_get_max_threads() / frame_threads);
+    frame_threads = std::min(frame_threads, std::max<size_t>(1, frames - start));
+    std::cout << "frames in parallel: " << frame_threads << " x " << inner_threads << " threads" << std::endl;
+    omp_set_max_active_levels(2);
+
+    // エンジン (精度・バッファ) はフレームを描画するスレッドごとに持つ
+    std::vector<Mandelbrot> engines(frame_threads);
+    for (Mandelbrot& m : engines) {
+        m.setAllParams(prec, w_px, h_px, re_tar, im_tar, zoom[0].w_tar, zoom[0].h_tar, mcnt_max_init, pal);
+    }
+
+    // チェックポイントは保存に成功したフレームが連続している所まで進める
+    bool contiguous = true;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+
+    #pragma omp parallel num_threads(frame_threads)
+    {
+        Mandelbrot& m = engines[omp_get_thread_num()];
+        omp_set_num_threads(inner_threads);  // m の中の並列領域のスレッド数
+        // このスレッドが前に描画したフレーム. その反復回数の分布を次のビューに写し, 重さの等しい範囲に分けて
+        // スレッドに固定で割り当てる (近いフレームは重さの分布が似ている).
+        // 1枚ずつ描画するときは直前のフレーム i - 1. 複数のフレームを同時に描画するときは, フレーム i を始める時点で
+        // i - 1 はまだ描画中なので, 終わっている最も新しいフレーム i - frame_threads (このスレッドの前のフレーム) を使う.
+        // tileCostsFrom がビューの違いを写すので, frame_threads ステップ離れていても分布の位置は合う
+        Mandelbrot prev = m;
+
+        // 各スレッドは1フレームずつ描画し, 保存はフレームの順に行う
+        #pragma omp for schedule(static, 1) ordered
+        for (size_t i = start; i < frames; i++) {
+            // トレースのフレーム集計はフレームを1枚ずつ描画するときだけ
+            if (frame_threads == 1) MANDEL_TRACE_FRAME_BEGIN(i);
+
+            m.setComplexParams(re_tar, im_tar, zoom[i].w_tar, zoom[i].h_tar);
+            m.setMandelCountMax(zoom[i].mcnt_max);
+            m.setTileCosts(m.tileCostsFrom(prev));
+            FrameVector<Color> colors = m.makeColorVector(true);
+            prev = m;
+
+            #pragma omp ordered
+            {
+                std::cout << "mandel count max: " << zoom[i].mcnt_max << std::endl;
+                if (savePNGAtomic(frameFile(i), colors, m.getWidthPx(), m.getHeightPx())) {
+                    std::cout << "PNG saved successfully: output" + std::to_string(i) + ".png\n";
+                } else {
+                    std::cerr << "Failed to save PNG.\n";
+                    contiguous = false;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                bool due = std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval_s;
+                if (contiguous && (due || i + 1 == frames)) {
+                    checkpoint.next_frame = i + 1;
+                    checkpoint.width_target = toExactString(zoom[i + 1].w_tar);
+                    checkpoint.height_target = toExactString(zoom[i + 1].h_tar);
+                    checkpoint.mandel_count_max = zoom[i + 1].mcnt_max;
+                    if (!checkpoint.save(checkpoint_file)) std::cerr << "Failed to save checkpoint.\n";
+                    last_checkpoint = now;
+                }
+            }
+            if (frame_threads == 1) MANDEL_TRACE_FRAME_END(i, w_px * h_px);
+        }
     }
 
+    MANDEL_TRACE_WRITE("./frames/trace.json");
+
     return 0;
 }
@@ -3,10 +3,19 @@
 #include <boost/multiprecision/cpp_complex.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
 #include "Mandelbrot_proto.hpp"
+#include "FloatExp.hpp"
 
+// 指数の範囲が広い型にするときは定義する
+//#define PROTO_FLOATEXP
+#ifdef PROTO_FLOATEXP
+using Float = FloatExp;
+template <typename T>
+using Complex = FloatExpComplex<T>;
+#else
 using Float = long double;
 template <typename T>
 using Complex = std::complex<T>;
+#endif
 
 void omp_info();
 
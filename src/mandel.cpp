@@ -0,0 +1,388 @@
+#include "mandel.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <omp.h>
+#include "AsyncRender.hpp"
+#include "Mandelbrot.hpp"
+#include "RenderJob.hpp"
+
+
+// C API の描画の状態. ライブラリ全体で共有するものは持たない
+struct mandel_renderer {
+    RenderJob job;
+    Mandelbrot engine;
+    std::string palette_spec;  // engine に設定済みのパレット
+    int threads = 0;
+    std::atomic<bool> cancel{false};
+
+    // 非同期の描画. async_mutex は他のスレッドの mandel_cancel などと入れ替えを分けるため
+    mutable std::mutex async_mutex;
+    std::unique_ptr<AsyncRender> async;
+    std::chrono::steady_clock::time_point async_started;
+
+    // mandel_set_pan_reuse. 前の描画の反復回数とその設定
+    bool pan_reuse = false;
+    PannedCounts pan;
+
+    // mandel_render_rgb の作業用 (描画の間で使い回す)
+    IterationField field;
+    FrameVector<size_t> count_vec;
+    FrameVector<float> dist_vec;
+    FrameVector<Color> color_vec;
+
+    mandel_stats stats{};
+    std::string backend_name;
+    std::string error;
+};
+
+
+namespace {
+
+// 例外を mandel_status と r->error にする. C の呼び出し側に例外を出さない
+template <typename Body>
+mandel_status guarded(mandel_renderer* r, Body body) {
+    if (!r) return MANDEL_ERROR_INVALID_ARGUMENT;
+    r->error.clear();
+    try {
+        return body();
+    } catch (const std::invalid_argument& e) {
+        r->error = e.what();
+        return MANDEL_ERROR_INVALID_ARGUMENT;
+    } catch (const std::bad_alloc&) {
+        r->error = "out of memory";
+        return MANDEL_ERROR_OUT_OF_MEMORY;
+    } catch (const std::exception& e) {
+        r->error = e.what();
+        return MANDEL_ERROR_INTERNAL;
+    }
+}
+
+// 呼び出したスレッドの OpenMP のスレッド数を一時的に変える
+class ThreadCountScope {
+    public:
+    explicit ThreadCountScope(int threads) : saved(omp_get_max_threads()), changed(threads > 0) {
+        if (this->changed) omp_set_num_threads(threads);
+    }
+    ~ThreadCountScope() {
+        if (this->changed) omp_set_num_threads(this->saved);
+    }
+
+
+    private:
+    int saved;
+    bool changed;
+};
+
+// 前の非同期の描画を待って片付ける
+void finishAsync(mandel_renderer* r) {
+    std::unique_ptr<AsyncRender> async;
+    {
+        std::lock_guard<std::mutex> lock(r->async_mutex);
+        async.swap(r->async);
+    }
+    if (async) async->getFuture().wait();
+}
+
+// job を engine に設定し, 描画を始める
+void prepare(mandel_renderer* r) {
+    finishAsync(r);
+    r->cancel.store(false);
+    r->job.apply(r->engine);
+    if (r->job.palette != r->palette_spec) {
+        r->engine.setPalette(Palette::fromSpec(r->job.palette));
+        r->palette_spec = r->job.palette;
+    }
+}
+
+// engine の直前の描画の集計を r->stats にまとめる
+void collectStats(mandel_renderer* r, const Mandelbrot& engine, double seconds) {
+    mandel_stats stats{};
+    stats.seconds = seconds;
+    for (const SocketStats& s : engine.getSocketStats()) {
+        stats.iterations += s.iterations;
+        stats.pixels += s.pixels;
+        stats.tiles += s.tiles;
+    }
+    stats.precision = engine.getPrecision();
+    r->backend_name = Mandelbrot::backendName(engine.resolveBackend());
+    stats.backend = r->backend_name.c_str();
+    r->stats = stats;
+}
+
+// 前の描画から平行移動した分だけを計算して r->pan.counts を更新する
+bool renderPanned(mandel_renderer* r) {
+    return r->engine.makeCountVectorPanned(r->pan, &r->cancel);
+}
+
+double secondsSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+}  // namespace
+
+
+extern "C" {
+
+int mandel_api_version(void) {
+    return MANDEL_API_VERSION;
+}
+
+mandel_renderer* mandel_create(void) {
+    try {
+        return new mandel_renderer();
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+void mandel_destroy(mandel_renderer* r) {
+    if (r) {
+        mandel_cancel(r);
+        finishAsync(r);
+    }
+    delete r;
+}
+
+mandel_status mandel_set(mandel_renderer* r, const char* key, const char* value) {
+    return guarded(r, [&]() {
+        if (!key || !value) throw std::invalid_argument("key and value must not be NULL");
+        std::string k = key;
+        if (k == "output" || k.compare(0, 6, "cycle_") == 0) throw std::invalid_argument("Unsupported key: " + k);
+        r->job.set(k, value);
+        return MANDEL_OK;
+    });
+}
+
+mandel_status mandel_set_view(mandel_renderer* r, const char* re, const char* im,
+                              const char* width, const char* height,
+                              size_t width_px, size_t height_px) {
+    return guarded(r, [&]() {
+        if (!re || !im || !width) throw std::invalid_argument("re, im and width must not be NULL");
+        // 途中で失敗したときに半端な設定が残らないよう, 写しに設定してから入れ替える
+        RenderJob job = r->job;
+        job.set("re_target", re);
+        job.set("im_target", im);
+        job.set("width_target", width);
+        job.set("height_target", height ? height : "");
+        job.set("width_px", std::to_string(width_px));
+        job.set("height_px", std::to_string(height_px));
+        r->job = job;
+        return MANDEL_OK;
+    });
+}
+
+mandel_status mandel_set_threads(mandel_renderer* r, int threads) {
+    return guarded(r, [&]() {
+        if (threads < 0) throw std::invalid_argument("threads must not be negative");
+        r->threads = threads;
+        return MANDEL_OK;
+    });
+}
+
+mandel_status mandel_set_pan_reuse(mandel_renderer* r, int enable) {
+    return guarded(r, [&]() {
+        finishAsync(r);
+        r->pan_reuse = enable != 0;
+        if (!r->pan_reuse) {
+            r->pan.clear();
+        }
+        return MANDEL_OK;
+    });
+}
+
+size_t mandel_output_width(const mandel_renderer* r) {
+    if (!r) return 0;
+    if (!r->job.has_region) return r->job.width_px;
+    return std::min(r->job.region_x1, r->job.width_px) - std::min(r->job.region_x0, r->job.width_px);
+}
+
+size_t mandel_output_height(const mandel_renderer* r) {
+    if (!r) return 0;
+    if (!r->job.has_region) return r->job.height_px;
+    return std::min(r->job.region_y1, r->job.height_px) - std::min(r->job.region_y0, r->job.height_px);
+}
+
+mandel_status mandel_render_counts(mandel_renderer* r, uint32_t* counts, size_t stride) {
+    return guarded(r, [&]() {
+        if (!counts) throw std::invalid_argument("counts must not be NULL");
+        if (stride < mandel_output_width(r)) throw std::invalid_argument("stride is smaller than the width");
+        if (r->job.mandel_count_max > UINT32_MAX) throw std::invalid_argument("mandel_count_max does not fit in uint32_t");
+        auto t0 = std::chrono::steady_clock::now();
+        ThreadCountScope scope(r->threads);
+        prepare(r);
+
+        if (r->pan_reuse) {
+            bool done = renderPanned(r);
+            size_t width = mandel_output_width(r), height = mandel_output_height(r);
+            #pragma omp parallel for schedule(static)
+            for (size_t y = 0; y < height; y++) {
+                for (size_t x = 0; x < width; x++) counts[y * stride + x] = static_cast<uint32_t>(r->pan.counts[y * width + x]);
+            }
+            collectStats(r, r->engine, secondsSince(t0));
+            return done ? MANDEL_OK : MANDEL_ERROR_CANCELLED;
+        }
+
+        // タイルを計算したスレッドが呼び出し側のバッファに直接書き込む
+        TileSink sink = [&](size_t x0, size_t y0, size_t w, size_t h, const size_t* tile, size_t tile_stride) {
+            for (size_t y = 0; y < h; y++) {
+                uint32_t* dst = counts + (y0 + y) * stride + x0;
+                const size_t* src = tile + y * tile_stride;
+                for (size_t x = 0; x < w; x++) dst[x] = static_cast<uint32_t>(src[x]);
+            }
+        };
+        bool done = r->engine.makeCountTiles(sink, &r->cancel);
+        collectStats(r, r->engine, secondsSince(t0));
+        return done ? MANDEL_OK : MANDEL_ERROR_CANCELLED;
+    });
+}
+
+mandel_status mandel_render_rgb(mandel_renderer* r, uint8_t* rgb, size_t stride) {
+    return guarded(r, [&]() {
+        if (!rgb) throw std::invalid_argument("rgb must not be NULL");
+        size_t width = mandel_output_width(r), height = mandel_output_height(r);
+        if (stride < 3 * width) throw std::invalid_argument("stride is smaller than 3 * width");
+        auto t0 = std::chrono::steady_clock::now();
+        ThreadCountScope scope(r->threads);
+        prepare(r);
+        Mandelbrot& engine = r->engine;
+
+        auto store = [&](size_t y, size_t x, const Color& c) {
+            uint8_t* p = rgb + y * stride + 3 * x;
+            p[0] = static_cast<uint8_t>(c[0]);
+            p[1] = static_cast<uint8_t>(c[1]);
+            p[2] = static_cast<uint8_t>(c[2]);
+        };
+
+        if (r->job.distance) {
+            // 距離推定の色は画素ごとに距離で決まるので, エンジンの色付けの結果を写す
+            if (!engine.makeDistanceVector(r->count_vec, r->dist_vec, r->job.disk_fill, &r->cancel)) {
+                collectStats(r, r->engine, secondsSince(t0));
+                return MANDEL_ERROR_CANCELLED;
+            }
+            engine.makeColorVector(r->count_vec, r->dist_vec, r->color_vec);
+            #pragma omp parallel for schedule(static)
+            for (size_t y = 0; y < height; y++) {
+                for (size_t x = 0; x < width; x++) store(y, x, r->color_vec[y * width + x]);
+            }
+        } else if (!r->job.eq_hist && !r->pan_reuse) {
+            // 平坦化しなければ色は反復回数だけで決まるので, タイルごとに色にして rgb に書き込む (反復回数の画像も作らない)
+            ColorTileSink sink = [&](size_t x0, size_t y0, size_t w, size_t h, const Color* colors, size_t tile_stride) {
+                for (size_t y = 0; y < h; y++) {
+                    for (size_t x = 0; x < w; x++) store(y0 + y, x0 + x, colors[y * tile_stride + x]);
+                }
+            };
+            bool done = engine.makeColorTiles(engine.makeColorTable({}, false), sink, &r->cancel);
+            collectStats(r, r->engine, secondsSince(t0));
+            return done ? MANDEL_OK : MANDEL_ERROR_CANCELLED;
+        } else {
+            // ヒストグラム平坦化には全画素の反復回数が要るので, 反復回数は IterationField (1画素 2~4 byte) に持ち,
+            // 反復回数 -> 色の表で rgb に直接書き込む (色の画像は作らない). pan_reuse なら前の描画の pan.counts を使う
+            bool done = r->pan_reuse ? renderPanned(r) : engine.makeIterationField(r->field, &r->cancel);
+            if (!done) {
+                collectStats(r, r->engine, secondsSince(t0));
+                return MANDEL_ERROR_CANCELLED;
+            }
+            IterationView counts = r->pan_reuse ? IterationView(r->pan.counts) : IterationView(r->field);
+            std::vector<double> brightness_table;
+            if (r->job.eq_hist) brightness_table = engine.makeBrightnessTable(counts);
+            std::vector<Color> color_table = engine.makeColorTable(brightness_table, r->job.eq_hist);
+
+            #pragma omp parallel for schedule(static)
+            for (size_t y = 0; y < height; y++) {
+                for (size_t x = 0; x < width; x++) {
+                    store(y, x, color_table[std::min(counts[y * width + x], color_table.size() - 1)]);
+                }
+            }
+        }
+        collectStats(r, r->engine, secondsSince(t0));
+        return MANDEL_OK;
+    });
+}
+
+mandel_status mandel_render_counts_async(mandel_renderer* r, uint32_t* counts, size_t stride,
+                                         mandel_tile_callback callback, void* user) {
+    return guarded(r, [&]() {
+        if (!counts) throw std::invalid_argument("counts must not be NULL");
+        if (stride < mandel_output_width(r)) throw std::invalid_argument("stride is smaller than the width");
+        if (r->job.mandel_count_max > UINT32_MAX) throw std::invalid_argument("mandel_count_max does not fit in uint32_t");
+        prepare(r);
+
+        // タイルを呼び出し側のバッファに書いてから callback に渡す. キューには入れない
+        TileSink sink = [=](size_t x0, size_t y0, size_t w, size_t h, const size_t* tile, size_t tile_stride) {
+            for (size_t y = 0; y < h; y++) {
+                uint32_t* dst = counts + (y0 + y) * stride + x0;
+                const size_t* src = tile + y * tile_stride;
+                for (size_t x = 0; x < w; x++) dst[x] = static_cast<uint32_t>(src[x]);
+            }
+            if (callback) callback(user, x0, y0, w, h, counts + y0 * stride + x0, stride);
+        };
+        std::lock_guard<std::mutex> lock(r->async_mutex);
+        r->async_started = std::chrono::steady_clock::now();
+        r->async = std::make_unique<AsyncRender>(r->engine, sink, false, r->threads);
+        if (r->cancel.load()) r->async->cancel();  // 開始の直前の mandel_cancel
+        return MANDEL_OK;
+    });
+}
+
+mandel_status mandel_wait(mandel_renderer* r) {
+    return guarded(r, [&]() {
+        std::unique_ptr<AsyncRender> async;
+        {
+            std::lock_guard<std::mutex> lock(r->async_mutex);
+            async.swap(r->async);
+        }
+        if (!async) return MANDEL_OK;
+        bool done = async->wait();
+        collectStats(r, async->getEngine(), secondsSince(r->async_started));
+        return done ? MANDEL_OK : MANDEL_ERROR_CANCELLED;
+    });
+}
+
+double mandel_progress(const mandel_renderer* r) {
+    if (!r) return 1.0;
+    std::lock_guard<std::mutex> lock(r->async_mutex);
+    return r->async ? r->async->progress() : 1.0;
+}
+
+int mandel_finished(const mandel_renderer* r) {
+    if (!r) return 1;
+    std::lock_guard<std::mutex> lock(r->async_mutex);
+    return r->async ? r->async->finished() : 1;
+}
+
+void mandel_cancel(mandel_renderer* r) {
+    if (!r) return;
+    r->cancel.store(true);
+    std::lock_guard<std::mutex> lock(r->async_mutex);
+    if (r->async) r->async->cancel();
+}
+
+mandel_status mandel_get_stats(const mandel_renderer* r, mandel_stats* stats) {
+    if (!r || !stats) return MANDEL_ERROR_INVALID_ARGUMENT;
+    *stats = r->stats;
+    if (!stats->backend) stats->backend = "";
+    return MANDEL_OK;
+}
+
+const char* mandel_last_error(const mandel_renderer* r) {
+    return r ? r->error.c_str() : "";
+}
+
+const char* mandel_status_string(mandel_status status) {
+    switch (status) {
+        case MANDEL_OK: return "ok";
+        case MANDEL_ERROR_INVALID_ARGUMENT: return "invalid argument";
+        case MANDEL_ERROR_CANCELLED: return "cancelled";
+        case MANDEL_ERROR_OUT_OF_MEMORY: return "out of memory";
+        case MANDEL_ERROR_INTERNAL: return "internal error";
+    }
+    return "unknown status";
+}
+
+}  // extern "C"
@@ -1,4 +1,8 @@
 #include "util.hpp"
+#include "Trace.hpp"
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
 
 void omp_info()
 {
@@ -17,19 +21,13 @@ void omp_info()
     std::cout << "Max number of threads: " << max_threads << std::endl;
 }
 
-// PNGファイルの作成
-bool savePNG(const std::string& filename, const std::vector<Color>& img, size_t width_px, size_t height_px)
+// PNG を開いたファイル fp に書き込む (fp は閉じない)
+static bool writePNG(FILE* fp, const FrameVector<Color>& img, size_t width_px, size_t height_px)
 {
-    if (img.size() != width_px * height_px) return false;
-
-    FILE* fp = fopen(filename.c_str(), "wb");
-    if (!fp) return false;
-
     // libPNGの初期化
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
     if (!png)
     {
-        fclose(fp);
         return false;
     }
 
@@ -37,14 +35,14 @@ bool savePNG(const std::string& filename, const std::vector<Color>& img, size_t
     if (!info)
     {
         png_destroy_write_struct(&png, nullptr);
-        fclose(fp);
         return false;
     }
 
+    // 行のバッファは longjmp で抜けても解放されるように vector で持つ
+    std::vector<std::vector<png_byte>> rows(height_px, std::vector<png_byte>(width_px * 3));
     if (setjmp(png_jmpbuf(png)))
     {
         png_destroy_write_struct(&png, &info);
-        fclose(fp);
         return false;
     }
 
@@ -66,7 +64,7 @@ bool savePNG(const std::string& filename, const std::vector<Color>& img, size_t
     std::vector<png_bytep> row_pointers(height_px);
     for (size_t y = 0; y < height_px; ++y)
     {
-        row_pointers[y] = new png_byte[width_px * 3];
+        row_pointers[y] = rows[y].data();
         for (size_t x = 0; x < width_px; ++x)
         {
             const Color& pixel = img[y * width_px + x];
@@ -80,13 +78,112 @@ bool savePNG(const std::string& filename, const std::vector<Color>& img, size_t
     png_write_image(png, row_pointers.data());
     png_write_end(png, nullptr);
 
-    // メモリ解放
-    for (size_t y = 0; y < height_px; ++y)
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+// PNGファイルの作成
+bool savePNG(const std::string& filename, const FrameVector<Color>& img, size_t width_px, size_t height_px)
+{
+    MANDEL_TRACE_SCOPE("savePNG");
+    if (img.size() != width_px * height_px) return false;
+
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = writePNG(fp, img, width_px, height_px);
+    return fclose(fp) == 0 && ok;
+}
+
+bool savePNGAtomic(const std::string& filename, const FrameVector<Color>& img, size_t width_px, size_t height_px)
+{
+    MANDEL_TRACE_SCOPE("savePNG");
+    if (img.size() != width_px * height_px) return false;
+
+    std::string tmp = filename + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = writePNG(fp, img, width_px, height_px);
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), filename.c_str()) != 0)
     {
-        delete[] row_pointers[y];
+        std::remove(tmp.c_str());
+        return false;
     }
-    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+// 検査では壊れたファイルは想定内なので libpng のメッセージは出さない
+static void silentPNGError(png_structp png, png_const_charp)
+{
+    png_longjmp(png, 1);
+}
+
+static void silentPNGWarning(png_structp, png_const_charp) {}
+
+// PNGファイルの検査 (全ての行を展開する)
+bool verifyPNG(const std::string& filename, size_t width_px, size_t height_px)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp) return false;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, silentPNGError, silentPNGWarning);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (!info)
+    {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        fclose(fp);
+        return false;
+    }
+
+    std::vector<png_byte> row;
+    if (setjmp(png_jmpbuf(png)))
+    {
+        // 途中で切れたファイルや CRC の誤り
+        png_destroy_read_struct(&png, &info, nullptr);
+        fclose(fp);
+        return false;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    bool ok = png_get_image_width(png, info) == width_px && png_get_image_height(png, info) == height_px
+           && png_get_interlace_type(png, info) == PNG_INTERLACE_NONE;
+    if (ok)
+    {
+        row.resize(png_get_rowbytes(png, info));
+        for (size_t y = 0; y < height_px; ++y) png_read_row(png, row.data(), nullptr);
+        png_read_end(png, nullptr);
+    }
+    png_destroy_read_struct(&png, &info, nullptr);
     fclose(fp);
+    return ok;
+}
 
+bool writeFileAtomic(const std::string& filename, const std::string& data)
+{
+    std::string tmp = filename + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        return false;
+    }
     return true;
-}
\ No newline at end of file
+}
+
+std::vector<std::string> splitString(const std::string& s, char delim)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, delim))
+    {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
@@ -0,0 +1,287 @@
+// accuracy.cpp
+// 数値型 (Backend) と mpfr の精度ごとに同じビューを描画し, mpfr の基準 (Backend::Mpfr) との
+// 差を測る. 幅 10^-k のビューを k = 1, 2, ... と深くしていき,
+// 各数値型が初めて基準と食い違う深さを求める.
+// 境界付近の画素は軌道がカオス的で, どの精度でも丸め方次第で回数が変わる. そこで基準を
+// さらに 10 桁上げた描画との不一致率を「ノイズ」とし, ノイズ + threshold を超えたら失敗とする.
+// Backend::Auto の切り替え基準 (Mandelbrot::auto_guard_bits) はこの結果から決める.
+//
+// 例: ./accuracy --targets i,seahorse --depths 8:18 --size 48 --out accuracy.json
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "Mandelbrot.hpp"
+#include "util.hpp"
+
+
+// ズームの中心. 境界上か境界のごく近くにあり, 深くしても構造が残る
+struct Target {
+    std::string name;
+    std::string re, im;
+};
+
+const std::vector<Target> TARGETS = {
+    {"i",        "0.0", "1.0"},  // Misiurewicz 点 c = i
+    {"seahorse", "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139"},
+    {"main",     "-1.26222162762384535370226702572022420406", "0.04591700163513884695098681782544085357512"},
+};
+
+// 基準と比べる描画方法
+struct Candidate {
+    Backend backend;
+    size_t precision;  // mpfr のときの10進の桁数. それ以外では基準と同じ
+};
+
+struct Comparison {
+    Candidate candidate;
+    double mismatch_fraction;
+    size_t max_count_diff;
+    double time_s;
+    bool ok;
+};
+
+struct Run {
+    std::string target;
+    int depth;
+    double log2_pixel_ratio;  // log2(画素間隔 / max(|c|, 1))
+    size_t reference_precision;
+    double reference_s;
+    double noise_fraction;  // 基準と, 基準より 10 桁多い mpfr との不一致率
+    std::vector<Comparison> comparisons;
+};
+
+
+FrameVector<size_t> render(
+    const Target& target, int depth, size_t size, size_t max_iter,
+    Backend backend, size_t precision, double& time_s
+) {
+    // 座標は precision 桁で丸めてから渡す (その精度で指定した場合と同じになる)
+    Mandelbrot m;
+    Float re = makeFloat(target.re, precision), im = makeFloat(target.im, precision);
+    Float width = makeFloat("1e-" + std::to_string(depth), precision);
+    m.setAllParams(precision, size, size, re, im, width, width, max_iter);
+    m.setBackend(backend);
+
+    auto t0 = std::chrono::steady_clock::now();
+    FrameVector<size_t> count_vec = m.makeCountVector();
+    time_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    return count_vec;
+}
+
+// 不一致画素の割合と回数の差の最大値
+double compareCounts(const FrameVector<size_t>& a, const FrameVector<size_t>& b, size_t& max_diff) {
+    size_t mismatches = 0;
+    max_diff = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        size_t diff = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+        if (diff) mismatches++;
+        max_diff = std::max(max_diff, diff);
+    }
+    return static_cast<double>(mismatches) / a.size();
+}
+
+std::string candidateName(const Candidate& c) {
+    std::string name = Mandelbrot::backendName(c.backend);
+    if (c.backend == Backend::Mpfr) name += "@" + std::to_string(c.precision);
+    return name;
+}
+
+// 仮数部の bit 数. mpfr は10進の桁数から換算
+int mantissaBits(const Candidate& c) {
+    switch (c.backend) {
+        case Backend::Double:
+        case Backend::DoubleCompact: return std::numeric_limits<double>::digits;
+        case Backend::LongDouble: return std::numeric_limits<long double>::digits;
+        default: return static_cast<int>(std::ceil(c.precision * std::log2(10.0)));
+    }
+}
+
+void usage() {
+    std::cerr
+        << "usage: accuracy [options]\n"
+        << "  --targets   i,seahorse,main   ズームの中心 (default: all)\n"
+        << "  --depths    1:20              幅 10^-k の k の範囲\n"
+        << "  --size      48                画像の一辺 [px]\n"
+        << "  --max-iter  1000\n"
+        << "  --backends  double,long_double\n"
+        << "  --precs     10,20             比較する mpfr の10進の桁数\n"
+        << "  --threshold 0.01              ノイズ + threshold を超える不一致率で失敗とする\n"
+        << "  --out       FILE              JSON の出力先 (default: stdout)\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> target_names;
+    for (const Target& t : TARGETS) target_names.push_back(t.name);
+    int depth_min = 1, depth_max = 20;
+    size_t size = 48;
+    size_t max_iter = 1000;
+    std::vector<std::string> backend_names = {"double", "long_double"};
+    std::vector<size_t> precs = {10, 20};
+    double threshold = 0.01;
+    std::string out_file;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--targets") target_names = splitString(value, ',');
+        else if (arg == "--depths") {
+            std::vector<std::string> range = splitString(value, ':');
+            if (range.size() != 2) {
+                usage();
+                return 1;
+            }
+            depth_min = std::stoi(range[0]);
+            depth_max = std::stoi(range[1]);
+        }
+        else if (arg == "--size") size = std::stoul(value);
+        else if (arg == "--max-iter") max_iter = std::stoul(value);
+        else if (arg == "--backends") backend_names = splitString(value, ',');
+        else if (arg == "--precs") {
+            precs.clear();
+            for (const std::string& p : splitString(value, ',')) precs.push_back(std::stoul(p));
+        }
+        else if (arg == "--threshold") threshold = std::stod(value);
+        else if (arg == "--out") out_file = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    std::vector<Candidate> candidates;
+    try {
+        for (const std::string& name : backend_names) {
+            Backend b = Mandelbrot::backendFromName(name);
+            if (b == Backend::Mpfr || b == Backend::Auto) {
+                std::cerr << "mpfr is compared through --precs; auto is not a fixed backend" << std::endl;
+                return 1;
+            }
+            candidates.push_back({b, 0});
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    for (size_t p : precs) candidates.push_back({Backend::Mpfr, p});
+
+    std::vector<Run> runs;
+    for (const std::string& name : target_names) {
+        auto it = std::find_if(TARGETS.begin(), TARGETS.end(), [&](const Target& t) { return t.name == name; });
+        if (it == TARGETS.end()) {
+            std::cerr << "Unknown target: " << name << std::endl;
+            return 1;
+        }
+        double magnitude = std::max({1.0, std::abs(std::stod(it->re)), std::abs(std::stod(it->im))});
+
+        for (int depth = depth_min; depth <= depth_max; depth++) {
+            Run run;
+            run.target = name;
+            run.depth = depth;
+            run.log2_pixel_ratio = -depth * std::log2(10.0) - std::log2(static_cast<double>(size)) - std::log2(magnitude);
+            // 基準: 画素間隔より 20 桁多い mpfr
+            run.reference_precision = static_cast<size_t>(depth + std::ceil(std::log10(static_cast<double>(size)))) + 20;
+
+            std::cerr << "accuracy: " << name << " 1e-" << depth << " reference mpfr@" << run.reference_precision << std::endl;
+            FrameVector<size_t> reference = render(*it, depth, size, max_iter, Backend::Mpfr, run.reference_precision, run.reference_s);
+            double noise_s;
+            size_t noise_diff;
+            FrameVector<size_t> finer = render(*it, depth, size, max_iter, Backend::Mpfr, run.reference_precision + 10, noise_s);
+            run.noise_fraction = compareCounts(reference, finer, noise_diff);
+
+            for (Candidate c : candidates) {
+                size_t precision = (c.backend == Backend::Mpfr) ? c.precision : run.reference_precision;
+                Comparison cmp{c, 0.0, 0, 0.0, true};
+                FrameVector<size_t> counts = render(*it, depth, size, max_iter, c.backend, precision, cmp.time_s);
+                cmp.mismatch_fraction = compareCounts(counts, reference, cmp.max_count_diff);
+                cmp.ok = cmp.mismatch_fraction <= run.noise_fraction + threshold;
+                run.comparisons.push_back(cmp);
+            }
+            runs.push_back(run);
+        }
+    }
+
+    std::ofstream ofs;
+    if (!out_file.empty()) {
+        ofs.open(out_file);
+        if (!ofs) {
+            std::cerr << "Failed to open: " << out_file << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& os = out_file.empty() ? std::cout : ofs;
+
+    os << std::setprecision(9);
+    os << "{\n";
+    os << "  \"schema\": 1,\n";
+    os << "  \"size\": " << size << ",\n";
+    os << "  \"max_iter\": " << max_iter << ",\n";
+    os << "  \"threshold\": " << threshold << ",\n";
+    os << "  \"auto_guard_bits\": " << Mandelbrot::auto_guard_bits << ",\n";
+    os << "  \"runs\": [\n";
+    for (size_t r = 0; r < runs.size(); r++) {
+        const Run& run = runs[r];
+        os << "    {\"target\": \"" << run.target << "\", \"depth\": " << run.depth
+           << ", \"log2_pixel_ratio\": " << run.log2_pixel_ratio
+           << ", \"reference_precision\": " << run.reference_precision
+           << ", \"reference_s\": " << run.reference_s
+           << ", \"noise_fraction\": " << run.noise_fraction << ", \"results\": [\n";
+        for (size_t i = 0; i < run.comparisons.size(); i++) {
+            const Comparison& c = run.comparisons[i];
+            os << "      {\"backend\": \"" << candidateName(c.candidate) << "\""
+               << ", \"mismatch_fraction\": " << c.mismatch_fraction
+               << ", \"max_count_diff\": " << c.max_count_diff
+               << ", \"time_s\": " << c.time_s
+               << ", \"ok\": " << (c.ok ? "true" : "false") << "}"
+               << (i + 1 < run.comparisons.size() ? "," : "") << "\n";
+        }
+        os << "    ]}" << (r + 1 < runs.size() ? "," : "") << "\n";
+    }
+    os << "  ],\n";
+
+    // 各ターゲット・各数値型で最初に失敗した深さ.
+    // guard_bits: その深さを Auto で避けるのに必要な auto_guard_bits の最小値
+    os << "  \"first_failure\": [\n";
+    bool first = true;
+    for (const std::string& name : target_names) {
+        for (const Candidate& c : candidates) {
+            const Run* failed = nullptr;
+            size_t index = &c - candidates.data();
+            for (const Run& run : runs) {
+                if (run.target == name && !run.comparisons[index].ok) {
+                    failed = &run;
+                    break;
+                }
+            }
+            os << (first ? "" : ",\n") << "    {\"target\": \"" << name
+               << "\", \"backend\": \"" << candidateName(c) << "\"";
+            if (failed) {
+                int guard_bits = static_cast<int>(std::floor(failed->log2_pixel_ratio + mantissaBits(c))) + 1;
+                os << ", \"depth\": " << failed->depth
+                   << ", \"log2_pixel_ratio\": " << failed->log2_pixel_ratio
+                   << ", \"guard_bits\": " << guard_bits << "}";
+                std::cerr << name << " " << candidateName(c) << ": fails at 1e-" << failed->depth
+                          << " (needs auto_guard_bits >= " << guard_bits << ")" << std::endl;
+            } else {
+                os << ", \"depth\": null}";
+                std::cerr << name << " " << candidateName(c) << ": no failure in range" << std::endl;
+            }
+            first = false;
+        }
+    }
+    os << "\n  ]\n";
+    os << "}\n";
+
+    return 0;
+}
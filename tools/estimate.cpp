@@ -0,0 +1,86 @@
+// estimate.cpp
+// ジョブ (RenderJob の key=value) の重さを小さな試し描きから見積もる (CostEstimator.hpp).
+// 反復回数の合計・集合内の割合・指定したスレッド数での時間を出力する. --map でコストマップも出力する.
+//
+// 例: ./estimate re_target=-0.743643887 im_target=0.131825904 width_target=1e-7 width_px=3840 height_px=2160
+//     ./estimate --threads 16 --calibration bench.json re_target=0 im_target=1 width_target=1e-30 mandel_count_max=3000
+
+
+#include <iostream>
+#include <string>
+#include <omp.h>
+#include "CostEstimator.hpp"
+#include "RenderJob.hpp"
+
+
+void usage() {
+    std::cerr
+        << "usage: estimate [options] key=value...\n"
+        << "  --threads N        描画に使うスレッド数 (既定: OpenMP の既定値)\n"
+        << "  --probe P          試し描きの幅 [px] (既定 32)\n"
+        << "  --calibration F    bench の JSON (--out) で反復の速さを校正する\n"
+        << "  --map              probe の画素ごとの反復回数の予測を行ごとに出力する\n";
+}
+
+int main(int argc, char* argv[]) {
+    RenderJob job;
+    int threads = omp_get_max_threads();
+    size_t probe_px = 32;
+    bool print_map = false;
+    CostEstimator::Calibration calibration;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--map") {
+                print_map = true;
+                continue;
+            }
+            if (arg.compare(0, 2, "--") == 0) {
+                if (i + 1 >= argc) {
+                    usage();
+                    return 1;
+                }
+                std::string value = argv[++i];
+                if (arg == "--threads") threads = std::stoi(value);
+                else if (arg == "--probe") probe_px = std::stoul(value);
+                else if (arg == "--calibration") calibration = CostEstimator::calibrateFile(value);
+                else {
+                    usage();
+                    return 1;
+                }
+                continue;
+            }
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos) {
+                usage();
+                return 1;
+            }
+            job.set(arg.substr(0, eq), arg.substr(eq + 1));
+        }
+
+        Mandelbrot engine;
+        job.apply(engine);
+        CostEstimator::Estimate e = CostEstimator(calibration).estimate(engine, threads, probe_px);
+        std::cout << "backend: " << e.backend << "\n"
+                  << "precision: " << e.precision << "\n"
+                  << "pixels: " << e.pixels << "\n"
+                  << "iterations: " << e.iterations << "\n"
+                  << "interior: " << e.interior_fraction << "\n"
+                  << "threads: " << e.threads << "\n"
+                  << "seconds: " << e.seconds << "\n"
+                  << "probe: " << e.probe_width << "x" << e.probe_height << " in " << e.probe_seconds << " s\n";
+        if (print_map) {
+            for (size_t j = 0; j < e.probe_height; j++) {
+                for (size_t i = 0; i < e.probe_width; i++) {
+                    std::cout << (i ? " " : "") << e.cell_cost[j * e.probe_width + i];
+                }
+                std::cout << "\n";
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+    return 0;
+}
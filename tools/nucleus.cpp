@@ -0,0 +1,87 @@
+// nucleus.cpp
+// ビュー内で最も周期の短いミニブロの中心を探す (Nucleus.hpp).
+// 見つかった中心と大きさから, そのミニブロ全体が収まる描画範囲を RenderJob の形式で出力するので,
+// ジョブファイルや main.cpp のズームの目標にそのまま使える.
+//
+// 例: ./nucleus -1.7548 0.0 0.01
+//     ./nucleus -1.26222162762 0.0459170016 1e-9 --max-period 100000 --precision 40
+
+
+#include <iostream>
+#include <string>
+#include "Nucleus.hpp"
+#include "Precision.hpp"
+#include "RenderJob.hpp"
+
+
+void usage() {
+    std::cerr
+        << "usage: nucleus RE IM WIDTH [options]\n"
+        << "  --max-period N   box period で調べる周期の上限 (既定 10000)\n"
+        << "  --precision D    mpfr の10進の桁数 (既定: ビューの幅から決めた桁数 + 10)\n"
+        << "  --max-steps N    Newton 法の反復の上限 (既定 64)\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        usage();
+        return 1;
+    }
+    RenderJob view;
+    size_t max_period = 10000, max_steps = 64, precision = 0;
+    try {
+        view.set("re_target", argv[1]);
+        view.set("im_target", argv[2]);
+        view.set("width_target", argv[3]);
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                usage();
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--max-period") max_period = std::stoul(value);
+            else if (arg == "--precision") precision = std::stoul(value);
+            else if (arg == "--max-steps") max_steps = std::stoul(value);
+            else {
+                usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+
+    // Newton 法は中心を画素間隔より細かく求めるので, 描画に要る桁数に余裕を足す
+    if (precision == 0) precision = view.resolvePrecision() + 10;
+    Float re = makeFloat(view.re_target, precision), im = makeFloat(view.im_target, precision);
+    Float radius = makeFloat(view.width_target, precision);
+    mpfr_div_2ui(radius.backend().data(), radius.backend().data(), 1, MPFR_RNDN);
+
+    NucleusLocator locator(precision);
+    NucleusLocator::Result result = locator.locate(re, im, radius, max_period, max_steps);
+    if (!result.found) {
+        std::cerr << result.error << std::endl;
+        return 1;
+    }
+
+    // 成分の大きさ (主カージオイドで 1) の 3 倍で成分全体が収まる
+    Float width = makeFloat("3", precision);
+    mpfr_mul(width.backend().data(), width.backend().data(), result.size.backend().data(), MPFR_RNDN);
+
+    std::cout << "period: " << result.period << "\n"
+              << "newton steps: " << result.newton_steps << "\n"
+              << "re: " << toExactString(result.re) << "\n"
+              << "im: " << toExactString(result.im) << "\n"
+              << "size: " << toExactString(result.size) << "\n";
+
+    RenderJob target;
+    target.set("re_target", toExactString(result.re));
+    target.set("im_target", toExactString(result.im));
+    target.set("width_target", toExactString(width));
+    std::cout << "job: re_target=" << target.re_target << " im_target=" << target.im_target
+              << " width_target=" << target.width_target << " precision=" << target.resolvePrecision() << std::endl;
+    return 0;
+}